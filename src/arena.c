@@ -0,0 +1,166 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Set up an empty arena.  (A zeroed arena_st is also ready to use.)
+ *
+ * @param arena Arena to initialize
+ * @param block_size Size of the blocks memory is handed out from (0 for
+ *        ARENA_BLOCK_SIZE)
+ */
+void init_arena(arena_st* arena, size_t block_size)
+{
+	memset(arena, 0, sizeof(arena_st));
+
+	arena->block_size = block_size;
+}
+
+static arena_block_st* _new_block(arena_st* arena, size_t size)
+{
+	size_t block_size = (arena->block_size == 0) ? ARENA_BLOCK_SIZE : arena->block_size;
+
+	if (size > block_size) {
+		block_size = size;
+	}
+
+	arena_block_st* block = (arena_block_st*)malloc(sizeof(arena_block_st) + block_size);
+
+	if (block == NULL) {
+		return NULL;
+	}
+
+	block->next = NULL;
+	block->size = block_size;
+	block->used = 0;
+
+	return block;
+}
+
+/**
+ * Allocate memory from the arena.  It stays valid until the arena is
+ * released to a mark taken before the allocation, reset or cleaned up.
+ *
+ * @param arena Arena
+ * @param size Bytes wanted
+ * @return Memory (not zeroed), or NULL if a new block couldn't be
+ *         allocated
+ */
+void* arena_alloc(arena_st* arena, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (arena->current == NULL) {
+		if (arena->first == NULL) {
+			arena->first = _new_block(arena, size);
+
+			if (arena->first == NULL) {
+				return NULL;
+			}
+		}
+
+		arena->current = arena->first;
+		arena->current->used = 0;
+	}
+
+	// Move on to blocks kept from earlier use, then to a new one.
+
+	while (arena->current->size - arena->current->used < size) {
+		arena_block_st* next = arena->current->next;
+
+		if (next == NULL || next->size < size) {
+			arena_block_st* block = _new_block(arena, size);
+
+			if (block == NULL) {
+				return NULL;
+			}
+
+			block->next = next;
+			next = block;
+
+			arena->current->next = block;
+		}
+
+		arena->current = next;
+		arena->current->used = 0;
+	}
+
+	void* data = arena->current->data + arena->current->used;
+
+	arena->current->used += size;
+
+	return data;
+}
+
+/**
+ * Note the arena's position, to release everything allocated after it.
+ */
+arena_mark_st arena_mark(arena_st* arena)
+{
+	arena_mark_st mark;
+
+	mark.block = arena->current;
+	mark.used = (arena->current == NULL) ? 0 : arena->current->used;
+
+	return mark;
+}
+
+/**
+ * Give back everything allocated since mark was taken.  Marks must be
+ * released in the reverse order they were taken.
+ */
+void arena_release(arena_st* arena, arena_mark_st mark)
+{
+	arena->current = mark.block;
+
+	if (arena->current != NULL) {
+		arena->current->used = mark.used;
+	}
+}
+
+/**
+ * Give back everything allocated from the arena, keeping its blocks.
+ */
+void reset_arena(arena_st* arena)
+{
+	arena->current = NULL;
+}
+
+void cleanup_arena(arena_st* arena)
+{
+	while (arena->first != NULL) {
+		arena_block_st* next = arena->first->next;
+
+		free(arena->first);
+
+		arena->first = next;
+	}
+
+	arena->current = NULL;
+}
@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+// Bump allocator for memory that lives only as long as some piece of
+// work, such as parsing one MFT record.  Memory is handed out from large
+// blocks and given back all at once, by releasing to a mark taken earlier;
+// the blocks are kept for reuse, so a loop that marks and releases settles
+// down to no malloc() calls at all.
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// Allocations are aligned for any type.  Block data starts aligned too, so
+// offsets rounded up to this are aligned addresses.
+
+#define ARENA_ALIGN 16
+
+typedef struct arena_block_st {
+	struct arena_block_st* next;
+	size_t size; // Bytes in data
+	size_t used;
+	_Alignas(ARENA_ALIGN) unsigned char data[];
+} arena_block_st;
+
+typedef struct arena_st {
+	arena_block_st* first;
+	arena_block_st* current; // Block being allocated from
+
+	size_t block_size; // Size of new blocks (0 for ARENA_BLOCK_SIZE)
+} arena_st;
+
+typedef struct arena_mark_st {
+	arena_block_st* block;
+	size_t used;
+} arena_mark_st;
+
+void init_arena(arena_st* arena, size_t block_size);
+
+void* arena_alloc(arena_st* arena, size_t size);
+
+arena_mark_st arena_mark(arena_st* arena);
+
+void arena_release(arena_st* arena, arena_mark_st mark);
+
+void reset_arena(arena_st* arena);
+
+void cleanup_arena(arena_st* arena);
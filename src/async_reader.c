@@ -0,0 +1,494 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "async_reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <unistd.h>
+
+#include <scsi/sg.h>
+#include <linux/major.h>
+
+#define ERR(...) \
+	ar->error = 1; \
+	snprintf(ar->error_msg, 4096, __VA_ARGS__);
+
+// Sense keys and additional sense codes used by the file-backed stand-in.
+
+#define SENSE_KEY_MEDIUM_ERROR 0x03
+#define SENSE_KEY_ILLEGAL_REQUEST 0x05
+#define ASC_UNRECOVERED_READ_ERROR 0x11
+#define ASC_LBA_OUT_OF_RANGE 0x21
+
+/**
+ * Test whether an open file is an sg character device.
+ */
+static int _is_sg_device(struct stat* st)
+{
+	return S_ISCHR(st->st_mode) && major(st->st_rdev) == SCSI_GENERIC_MAJOR;
+}
+
+/**
+ * Seconds on the clock reads are timed by: the block source's if it keeps
+ * one, else the host's.
+ */
+static double _now(async_reader_st* ar)
+{
+	if (ar->source != NULL && ar->source->clock != NULL) {
+		return ar->source->clock(ar->source);
+	}
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Open a device for queued reads.  Only sg devices are opened for writing
+ * (the sg driver takes commands by write()); image files are read with
+ * pread(), and anything else, block devices included, is refused, as
+ * writing a command to one would write it to the disk.
+ *
+ * @param ar Reader to initialize
+ * @param dev sg device (or image file, see async_reader.h)
+ * @param depth Commands in flight at once (-1 for 8)
+ * @param block_size Logical block size (-1 for 512)
+ * @return 0 on success, nonzero on failure (ar->error_msg set)
+ */
+int init_async_reader(async_reader_st* ar, const char* dev, int depth, int block_size)
+{
+	memset(ar, 0, sizeof(async_reader_st));
+
+	ar->dev = (char*)malloc(strlen(dev) + 1);
+	strcpy(ar->dev, dev);
+
+	ar->depth = (depth > 0) ? depth : 8;
+	ar->block_size = (block_size > 0) ? block_size : 512;
+	ar->timeout = 500000;
+	ar->next_pack_id = 1;
+
+	ar->cmds = (async_cmd_st*)malloc(sizeof(async_cmd_st) * ar->depth);
+	memset(ar->cmds, 0, sizeof(async_cmd_st) * ar->depth);
+
+	// Find out what the device is before opening it for writing.
+
+	ar->fd = open(ar->dev, O_RDONLY | O_NONBLOCK);
+
+	if (ar->fd == -1) {
+		ERR("Unable to open %s: %s\n", ar->dev, strerror(errno));
+
+		return 1;
+	}
+
+	struct stat st;
+
+	if (fstat(ar->fd, &st)) {
+		ERR("Unable to stat %s: %s\n", ar->dev, strerror(errno));
+
+		close(ar->fd);
+		ar->fd = -1;
+
+		return 1;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		ar->file_backed = 1;
+
+		return 0;
+	}
+
+	if (!_is_sg_device(&st)) {
+		ERR("%s isn't an sg device or an image file\n", ar->dev);
+
+		close(ar->fd);
+		ar->fd = -1;
+
+		return 1;
+	}
+
+	close(ar->fd);
+
+	// The sg driver wants O_RDWR for write(); O_NONBLOCK makes read() return
+	// EAGAIN instead of waiting when nothing has completed.  Check it's
+	// still the same device once open.
+
+	ar->fd = open(ar->dev, O_RDWR | O_NONBLOCK);
+
+	if (ar->fd == -1) {
+		ERR("Unable to open %s: %s\n", ar->dev, strerror(errno));
+
+		return 1;
+	}
+
+	struct stat st_rw;
+
+	if (fstat(ar->fd, &st_rw) || !_is_sg_device(&st_rw) || st_rw.st_rdev != st.st_rdev) {
+		ERR("%s changed while being opened\n", ar->dev);
+
+		close(ar->fd);
+		ar->fd = -1;
+
+		return 1;
+	}
+
+	int version;
+
+	if (ioctl(ar->fd, SG_GET_VERSION_NUM, &version) < 0 || version < 30000) {
+		ERR("%s doesn't support the sg version 3 interface\n", ar->dev);
+
+		close(ar->fd);
+		ar->fd = -1;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Set up queued reads from a block source (a simulated device, say) rather
+ * than a device.
+ *
+ * @param ar Reader to initialize
+ * @param source Block source
+ * @param depth Commands in flight at once (-1 for 8)
+ * @param block_size Logical block size (-1 for 512)
+ * @return 0
+ */
+int init_async_reader_source(async_reader_st* ar, block_source_st* source, int depth, int block_size)
+{
+	memset(ar, 0, sizeof(async_reader_st));
+
+	ar->dev = (char*)malloc(strlen("(block source)") + 1);
+	strcpy(ar->dev, "(block source)");
+
+	ar->depth = (depth > 0) ? depth : 8;
+	ar->block_size = (block_size > 0) ? block_size : 512;
+	ar->timeout = 500000;
+	ar->next_pack_id = 1;
+
+	ar->cmds = (async_cmd_st*)malloc(sizeof(async_cmd_st) * ar->depth);
+	memset(ar->cmds, 0, sizeof(async_cmd_st) * ar->depth);
+
+	ar->fd = -1;
+	ar->file_backed = 1;
+	ar->source = source;
+
+	return 0;
+}
+
+void cleanup_async_reader(async_reader_st* ar)
+{
+	// Completions still outstanding are read (and discarded) so the driver
+	// doesn't write into buffers the caller is about to free.
+
+	async_completion_st completion;
+
+	while (ar->in_flight > 0 && (ar->fd != -1 || ar->source != NULL)) {
+		if (async_read_complete(ar, &completion, 1) < 0) {
+			break;
+		}
+	}
+
+	if (ar->fd != -1) {
+		close(ar->fd);
+
+		ar->fd = -1;
+	}
+
+	free(ar->cmds);
+	free(ar->dev);
+
+	ar->cmds = NULL;
+	ar->dev = NULL;
+}
+
+/**
+ * Queue a read.
+ *
+ * @param ar Async reader
+ * @param lba First block
+ * @param len Number of blocks
+ * @param buf Buffer for len * block_size bytes, left alone until the read
+ *            completes
+ * @param user Tag handed back with the completion
+ * @return 0 if queued, 1 if depth commands are already in flight, -1 on
+ *         failure (ar->error_msg set)
+ */
+int async_read_submit(async_reader_st* ar, uint64_t lba, uint32_t len, unsigned char* buf, void* user)
+{
+	if (ar->in_flight == ar->depth) {
+		return 1;
+	}
+
+	async_cmd_st* cmd = NULL;
+
+	for (int i = 0; i < ar->depth; i++) {
+		if (ar->cmds[i].pack_id == 0) {
+			cmd = &ar->cmds[i];
+
+			break;
+		}
+	}
+
+	cmd->lba = lba;
+	cmd->len = len;
+	cmd->buf = buf;
+	cmd->user = user;
+
+	cmd->pack_id = ar->next_pack_id++;
+
+	cmd->submitted = _now(ar);
+
+	if (ar->next_pack_id <= 0) {
+		ar->next_pack_id = 1;
+	}
+
+	if (!ar->file_backed) {
+		struct sg_io_hdr hdr;
+
+		memset(&hdr, 0, sizeof(sg_io_hdr_t));
+
+		cdb_read_16(cmd->cmd, 0, 0, 0, lba, len);
+
+		hdr.interface_id = 'S';
+		hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+		hdr.cmd_len = sizeof(cmd->cmd);
+		hdr.mx_sb_len = ASYNC_SENSE_LEN;
+		hdr.dxfer_len = len * ar->block_size;
+		hdr.dxferp = buf;
+		hdr.cmdp = cmd->cmd;
+		hdr.sbp = cmd->sense;
+		hdr.timeout = ar->timeout;
+		hdr.pack_id = cmd->pack_id;
+		hdr.usr_ptr = cmd;
+
+		ssize_t ret;
+
+		do {
+			ret = write(ar->fd, &hdr, sizeof(sg_io_hdr_t));
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret == -1) {
+			ERR("Unable to queue read of LBA %lu on %s: %s\n", lba, ar->dev, strerror(errno));
+
+			cmd->pack_id = 0;
+
+			return -1;
+		}
+	}
+
+	ar->in_flight++;
+
+	return 0;
+}
+
+static void _complete_cmd(async_reader_st* ar, async_cmd_st* cmd, async_completion_st* completion)
+{
+	completion->seconds = _now(ar) - cmd->submitted;
+
+	completion->lba = cmd->lba;
+	completion->len = cmd->len;
+	completion->buf = cmd->buf;
+	completion->user = cmd->user;
+
+	cmd->pack_id = 0;
+
+	ar->in_flight--;
+}
+
+/**
+ * Serve the oldest queued read from the block source, or with pread(),
+ * faking the sense data a disk would send for an unreadable block or one
+ * past the end.
+ */
+static void _complete_file_backed(async_reader_st* ar, async_completion_st* completion)
+{
+	async_cmd_st* cmd = NULL;
+
+	for (int i = 0; i < ar->depth; i++) {
+		if (ar->cmds[i].pack_id != 0 && (cmd == NULL || ar->cmds[i].pack_id < cmd->pack_id)) {
+			cmd = &ar->cmds[i];
+		}
+	}
+
+	size_t length = (size_t)cmd->len * ar->block_size;
+	off_t offset = cmd->lba * ar->block_size;
+
+	memset(&completion->senseinfo, 0, sizeof(struct sense_info_t));
+
+	if (ar->source != NULL) {
+		if (ar->source->clock != NULL) {
+			ar->source->timeout = ar->timeout / 1000.0;
+		}
+
+		int error = ar->source->read(ar->source, cmd->buf, offset, length, &completion->senseinfo);
+
+		completion->result = (error != 0);
+		completion->resid = error ? length : 0;
+
+		_complete_cmd(ar, cmd, completion);
+
+		return;
+	}
+
+	size_t done = 0;
+	int error = 0;
+
+	while (done < length) {
+		ssize_t ret = pread(ar->fd, cmd->buf + done, length - done, offset + done);
+
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (ret <= 0) {
+			error = (ret == 0) ? ERANGE : errno;
+
+			break;
+		}
+
+		done += ret;
+	}
+
+	completion->result = (error != 0);
+	completion->resid = length - done;
+
+	if (error) {
+		struct sense_info_t* si = &completion->senseinfo;
+
+		si->is_fixed = true;
+		si->is_current = true;
+
+		if (error == ERANGE) {
+			si->sense_key = SENSE_KEY_ILLEGAL_REQUEST;
+			si->asc = ASC_LBA_OUT_OF_RANGE;
+		} else {
+			si->sense_key = SENSE_KEY_MEDIUM_ERROR;
+			si->asc = ASC_UNRECOVERED_READ_ERROR;
+		}
+
+		si->information_valid = true;
+		si->information = cmd->lba + done / ar->block_size;
+	}
+
+	_complete_cmd(ar, cmd, completion);
+}
+
+/**
+ * Collect one completed read.
+ *
+ * @param ar Async reader
+ * @param completion Set to the read that completed, its status and sense
+ * @param wait Wait for a read to complete if none has yet
+ * @return 1 if a completion was collected, 0 if none was ready (or none in
+ *         flight), -1 on failure (ar->error_msg set)
+ */
+int async_read_complete(async_reader_st* ar, async_completion_st* completion, int wait)
+{
+	if (ar->in_flight == 0) {
+		return 0;
+	}
+
+	if (ar->file_backed) {
+		_complete_file_backed(ar, completion);
+
+		return 1;
+	}
+
+	struct sg_io_hdr hdr;
+
+	while (1) {
+		memset(&hdr, 0, sizeof(sg_io_hdr_t));
+
+		hdr.interface_id = 'S';
+		hdr.pack_id = -1; // Whichever finished first
+
+		ssize_t ret = read(ar->fd, &hdr, sizeof(sg_io_hdr_t));
+
+		if (ret != -1) {
+			break;
+		}
+
+		if (errno == EINTR) {
+			continue;
+		}
+
+		if (errno == EAGAIN) {
+			if (!wait) {
+				return 0;
+			}
+
+			struct pollfd pfd;
+
+			pfd.fd = ar->fd;
+			pfd.events = POLLIN;
+
+			poll(&pfd, 1, -1);
+
+			continue;
+		}
+
+		ERR("Unable to collect read from %s: %s\n", ar->dev, strerror(errno));
+
+		return -1;
+	}
+
+	async_cmd_st* cmd = (async_cmd_st*)hdr.usr_ptr;
+
+	if (cmd == NULL || cmd < ar->cmds || cmd >= ar->cmds + ar->depth || cmd->pack_id != hdr.pack_id) {
+		ERR("Completion with unknown pack_id %d from %s\n", hdr.pack_id, ar->dev);
+
+		return -1;
+	}
+
+	memset(&completion->senseinfo, 0, sizeof(struct sense_info_t));
+
+	if (hdr.sb_len_wr > 0) {
+		scsi_parse_sense(cmd->sense, hdr.sb_len_wr, &completion->senseinfo);
+	}
+
+	// RECOVERED ERROR (1) means the data made it after the drive retried.
+
+	completion->result = ((hdr.info & SG_INFO_OK_MASK) != SG_INFO_OK || completion->senseinfo.sense_key > 1);
+	completion->resid = hdr.resid;
+
+	_complete_cmd(ar, cmd, completion);
+
+	return 1;
+}
@@ -0,0 +1,101 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "block_source.h"
+
+#include <scsicmd/scsicmd.h>
+
+#include <stdint.h>
+#include <time.h>
+
+// Keeps several READ (16) commands in flight on an sg device using the sg
+// driver's asynchronous write()/read() interface.  Commands are tagged with
+// a pack_id and completions are collected in whatever order the device
+// finishes them, each with its own sense data.
+//
+// If the device isn't an sg device (an image file, say) the reader serves
+// the same calls with pread(), reporting errors as the sense data a disk
+// would return, so the callers can be exercised without a failing drive.
+// The same goes for a block source, which supplies its own sense data.
+
+#define ASYNC_SENSE_LEN 64
+
+typedef struct async_cmd_st {
+	int pack_id; // 0 when the slot is free
+
+	uint64_t lba;
+	uint32_t len;
+	unsigned char* buf;
+	void* user; // Caller's tag, handed back on completion
+
+	unsigned char cmd[16];
+	unsigned char sense[ASYNC_SENSE_LEN];
+
+	double submitted; // Seconds, on the source's clock if it keeps one
+} async_cmd_st;
+
+typedef struct async_completion_st {
+	uint64_t lba;
+	uint32_t len;
+	unsigned char* buf;
+	void* user;
+
+	int result; // 0 if every block was read
+	int resid; // Bytes not transferred
+	double seconds; // From submission to completion
+
+	struct sense_info_t senseinfo;
+} async_completion_st;
+
+typedef struct async_reader_st {
+	char* dev;
+	int fd;
+	int file_backed; // Stand-in: not an sg device
+	block_source_st* source; // Stand-in reading from a block source (if set)
+
+	uint32_t block_size;
+	unsigned int timeout; // Milliseconds per command
+
+	async_cmd_st* cmds;
+	int depth; // Commands allowed in flight
+	int in_flight;
+
+	int next_pack_id;
+
+	int error;
+	char error_msg[4096];
+} async_reader_st;
+
+int init_async_reader(async_reader_st* ar, const char* dev, int depth, int block_size);
+
+int init_async_reader_source(async_reader_st* ar, block_source_st* source, int depth, int block_size);
+
+void cleanup_async_reader(async_reader_st* ar);
+
+int async_read_submit(async_reader_st* ar, uint64_t lba, uint32_t len, unsigned char* buf, void* user);
+
+int async_read_complete(async_reader_st* ar, async_completion_st* completion, int wait);
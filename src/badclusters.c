@@ -25,6 +25,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "badclusters.h"
 #include "dd.h"
+#include "overlay.h"
 
 void cleanup_bad_cluster_hashes(dd_ctx* dd)
 {
@@ -56,6 +57,7 @@ void add_bad_cluster(dd_ctx* dd, __uint32_t mft_index, __uint64_t cluster)
 		bad_cluster_list = (bad_cluster_st*)malloc(sizeof(bad_cluster_st));
 
 		bad_cluster_list->id = cluster;
+		bad_cluster_list->kind = BAD_CLUSTER_DATA;
 
 		HASH_ADD(hh, dd->bad_clusters, id, sizeof(__uint64_t), bad_cluster_list);
 	}
@@ -71,6 +73,7 @@ void add_bad_cluster(dd_ctx* dd, __uint32_t mft_index, __uint64_t cluster)
 
 		bad_cluster_list = (bad_cluster_st*)malloc(sizeof(bad_cluster_st));
 		bad_cluster_list->id = cluster;
+		bad_cluster_list->kind = BAD_CLUSTER_DATA;
 
 		HASH_ADD(hh, bad_clusters_by_mft_index->bad_clusters, id, sizeof(__uint64_t), bad_cluster_list);
 
@@ -82,6 +85,7 @@ void add_bad_cluster(dd_ctx* dd, __uint32_t mft_index, __uint64_t cluster)
 			bad_cluster_list = (bad_cluster_st*)malloc(sizeof(bad_cluster_st));
 
 			bad_cluster_list->id = cluster;
+			bad_cluster_list->kind = BAD_CLUSTER_DATA;
 
 			HASH_ADD(hh, bad_clusters_by_mft_index->bad_clusters, id, sizeof(__uint64_t), bad_cluster_list);
 		}
@@ -89,6 +93,66 @@ void add_bad_cluster(dd_ctx* dd, __uint32_t mft_index, __uint64_t cluster)
 }
 
 
+/**
+ * Add a bad cluster that holds part of a directory's index (INDX records
+ * or the index bitmap), so recovery can put it ahead of file data.
+ *
+ * @param dd DD context struct
+ * @param mft_index MFT index of the directory
+ * @param cluster Cluster number
+ */
+void add_bad_index_cluster(dd_ctx* dd, __uint32_t mft_index, __uint64_t cluster)
+{
+	add_bad_cluster(dd, mft_index, cluster);
+
+	bad_cluster_st *bad_cluster;
+
+	HASH_FIND(hh, dd->bad_clusters, &cluster, sizeof(__uint64_t), bad_cluster);
+
+	bad_cluster->kind = BAD_CLUSTER_INDEX;
+}
+
+/**
+ * Move the bad clusters found by another DD context (an MFT scan thread's)
+ * into this one, emptying its hashes.
+ *
+ * @param dd DD context struct to add to
+ * @param from DD context struct to take from
+ */
+void merge_bad_clusters(dd_ctx* dd, dd_ctx* from)
+{
+	bad_cluster_st *current_bad_cluster;
+	bad_cluster_st *bad_cluster_tmp;
+
+	bad_cluster_by_mft_index_st *current_bad_clusters_by_mft_index;
+	bad_cluster_by_mft_index_st *bad_clusters_by_mft_index_tmp;
+
+	HASH_ITER(hh, from->bad_clusters_by_mft_index, current_bad_clusters_by_mft_index, bad_clusters_by_mft_index_tmp) {
+		HASH_ITER(hh, current_bad_clusters_by_mft_index->bad_clusters, current_bad_cluster, bad_cluster_tmp) {
+			bad_cluster_st *global;
+
+			HASH_FIND(hh, from->bad_clusters, &current_bad_cluster->id, sizeof(__uint64_t), global);
+
+			if (global != NULL && global->kind == BAD_CLUSTER_INDEX) {
+				add_bad_index_cluster(dd, current_bad_clusters_by_mft_index->id, current_bad_cluster->id);
+			} else {
+				add_bad_cluster(dd, current_bad_clusters_by_mft_index->id, current_bad_cluster->id);
+			}
+
+			HASH_DEL(current_bad_clusters_by_mft_index->bad_clusters, current_bad_cluster);
+			free(current_bad_cluster);
+		}
+
+		HASH_DEL(from->bad_clusters_by_mft_index, current_bad_clusters_by_mft_index);
+		free(current_bad_clusters_by_mft_index);
+	}
+
+	HASH_ITER(hh, from->bad_clusters, current_bad_cluster, bad_cluster_tmp) {
+		HASH_DEL(from->bad_clusters, current_bad_cluster);
+		free(current_bad_cluster);
+	}
+}
+
 /**
  * Taking a sorted list of bad clusters, print a list of byte regions
  * that can be used with ddrescue.
@@ -181,3 +245,58 @@ void dump_bad_clusters(dd_ctx* dd)
 
 	print_byte_regions_from_clusters(dd, dd->bad_clusters);
 }
+
+/**
+ * Whether a cluster can be read whole: from a whole copy in the overlay,
+ * or from the image where the mapfile marks it read.
+ */
+static int _cluster_readable(dd_ctx* dd, __uint64_t cluster)
+{
+	if (dd->overlay.layer_count > 0 && (overlay_cluster_version(dd, cluster) & OVERLAY_VERSION_WHOLE)) {
+		return 1;
+	}
+
+	return cluster_in_image(dd, cluster);
+}
+
+/**
+ * Scan handler adding the clusters of an in-use record's data that can't
+ * be read to the bad cluster list, under the record.
+ */
+static void _bad_cluster_handler(dd_ctx* dd, record_handler_ctx* rh)
+{
+	if (!(rh->flags & MFT_RECORD_IN_USE)) {
+		return;
+	}
+
+	for (int i = 0; i < rh->data_run.entry_count; i++) {
+		data_run_entry* entry = &rh->data_run.entry[i];
+
+		if (entry->sparse) {
+			continue;
+		}
+
+		for (__uint64_t j = 0; j < entry->count; j++) {
+			if (!_cluster_readable(dd, entry->cluster + j)) {
+				add_bad_cluster(dd, rh->mft_index, entry->cluster + j);
+			}
+		}
+	}
+}
+
+/**
+ * Add a stage auditing every file's data to an MFT pipeline: clusters the
+ * image and overlay can't serve go on the bad cluster list, as
+ * data_run_complete() would put them, so recovery can be planned without
+ * walking the directories first.
+ *
+ * @param dd DD context struct (NTFS, mapfile and overlay open)
+ * @param pipeline Pipeline to add the stage to
+ * @return 0 on success
+ */
+int add_bad_cluster_stage(dd_ctx* dd, mft_pipeline_st* pipeline)
+{
+	add_mft_stage(pipeline, &_bad_cluster_handler, NULL, NULL);
+
+	return 0;
+}
@@ -26,10 +26,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 
 #include "dd.h"
+#include "mft_pipeline.h"
 
 void cleanup_bad_cluster_hashes(dd_ctx* dd);
 
 void add_bad_cluster(dd_ctx* dd, __uint32_t mft_index, __uint64_t cluster);
 
+void add_bad_index_cluster(dd_ctx* dd, __uint32_t mft_index, __uint64_t cluster);
+
+void merge_bad_clusters(dd_ctx* dd, dd_ctx* from);
+
 void dump_bad_clusters(dd_ctx* dd);
 
+int add_bad_cluster_stage(dd_ctx* dd, mft_pipeline_st* pipeline);
+
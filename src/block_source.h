@@ -0,0 +1,57 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <scsicmd/scsicmd.h>
+
+#include <sys/types.h>
+
+// Something other than a device node that the device and async readers can
+// read blocks from (see simdev.h.)  A source may be called from several
+// threads at once, and a read may block for as long as the source likes.
+
+typedef struct block_source_st {
+	/**
+	 * Read length bytes at offset into buf.
+	 *
+	 * @return 0 on success, or an errno value with *sense set to what a
+	 *         disk would have reported
+	 */
+	int (*read)(struct block_source_st* source, unsigned char* buf, off_t offset, size_t length, struct sense_info_t* sense);
+
+	/**
+	 * Seconds on the source's own clock, for a source that keeps one (NULL
+	 * to time reads by the host's clock.)  A source with a clock times its
+	 * reads out itself: one that would take longer than timeout seconds on
+	 * that clock fails with ETIMEDOUT once they've passed, and the readers
+	 * don't set deadlines of their own.
+	 */
+	double (*clock)(struct block_source_st* source);
+
+	double timeout; // Set by the reader using the source (0 for no limit)
+
+	void* param;
+} block_source_st;
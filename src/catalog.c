@@ -0,0 +1,1199 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "catalog.h"
+#include "mft_pipeline.h"
+#include "overlay.h"
+#include "badclusters.h"
+#include "crc32c.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ERR(...) \
+	if (dd->error == 0) { \
+		memset(dd->error_msg, 0, 4096); \
+		dd->error = 1; \
+	} \
+	dd->error = 1; \
+	snprintf(dd->error_msg + strlen(dd->error_msg), 4096 - strlen(dd->error_msg), __VA_ARGS__);
+
+// Catalog files start with this header, followed by each of the catalog's
+// arrays in the order _catalog_sections() lists them, every one starting
+// on an 8-byte boundary so it can be used where it's mapped.
+
+#define CATALOG_MAGIC "EDDCATLG"
+#define CATALOG_VERSION 2
+
+#define CATALOG_SECTIONS 21
+
+typedef struct catalog_file_header_st {
+	char magic[8];
+	__uint32_t version;
+	__uint32_t run_entry_size; // sizeof(data_run_entry)
+	__uint32_t image_key;
+	__uint32_t mapfile_key;
+
+	__uint64_t count;
+	__uint64_t records;
+	__uint64_t names_size;
+	__uint64_t runs_count;
+	__uint64_t links_count;
+	__uint64_t child_count;
+	__uint64_t mft_clusters;
+
+	__uint64_t section[CATALOG_SECTIONS]; // File position of each array
+} catalog_file_header_st;
+
+typedef struct catalog_section_st {
+	void** data;
+	__uint64_t size; // Bytes
+} catalog_section_st;
+
+#define ALIGN8(n) (((n) + 7) & ~(__uint64_t)7)
+
+static int _is_mapped(mft_catalog_st* catalog, void* data)
+{
+	return catalog->map != NULL && (char*)data >= (char*)catalog->map && (char*)data <= (char*)catalog->map + catalog->map_size;
+}
+
+static void _free_array(mft_catalog_st* catalog, void* data)
+{
+	if (!_is_mapped(catalog, data)) {
+		free(data);
+	}
+}
+
+/**
+ * Resize a pool, moving it out of the catalog file's mapping if it's
+ * still there.
+ */
+static void* _resize_pool(mft_catalog_st* catalog, void* pool, size_t used, size_t alloc)
+{
+	if (!_is_mapped(catalog, pool)) {
+		return realloc(pool, alloc);
+	}
+
+	void* copy = malloc(alloc);
+
+	memcpy(copy, pool, used);
+
+	return copy;
+}
+
+static __uint64_t _append_runs(mft_catalog_st* catalog, data_run_st* data_run)
+{
+	__uint64_t first = catalog->runs_count;
+
+	if (data_run->entry_count == 0) {
+		return first;
+	}
+
+	if (catalog->runs_count + data_run->entry_count > catalog->runs_alloc) {
+		catalog->runs_alloc = (catalog->runs_alloc == 0) ? 65536 : catalog->runs_alloc * 2;
+
+		if (catalog->runs_alloc < catalog->runs_count + data_run->entry_count) {
+			catalog->runs_alloc = catalog->runs_count + data_run->entry_count;
+		}
+
+		catalog->runs = (data_run_entry*)_resize_pool(catalog, catalog->runs, sizeof(data_run_entry) * catalog->runs_count, sizeof(data_run_entry) * catalog->runs_alloc);
+	}
+
+	memcpy(catalog->runs + catalog->runs_count, data_run->entry, sizeof(data_run_entry) * data_run->entry_count);
+
+	catalog->runs_count += data_run->entry_count;
+
+	return first;
+}
+
+static __uint32_t _append_name(mft_catalog_st* catalog, const char* name)
+{
+	size_t length = strlen(name) + 1;
+
+	// Offset 0 holds an empty name, for names that don't fit.
+
+	if (catalog->names_size + length > UINT32_MAX) {
+		return 0;
+	}
+
+	if (catalog->names_size + length > catalog->names_alloc) {
+		catalog->names_alloc = (catalog->names_alloc == 0) ? 1 << 20 : catalog->names_alloc * 2;
+
+		if (catalog->names_alloc < catalog->names_size + length) {
+			catalog->names_alloc = catalog->names_size + length;
+		}
+
+		catalog->names = (char*)_resize_pool(catalog, catalog->names, catalog->names_size, catalog->names_alloc);
+	}
+
+	__uint32_t offset = catalog->names_size;
+
+	memcpy(catalog->names + offset, name, length);
+
+	catalog->names_size += length;
+
+	return offset;
+}
+
+static void _append_link(mft_catalog_st* catalog, __uint32_t record, record_link_st* link)
+{
+	if (catalog->links_count == catalog->links_alloc) {
+		catalog->links_alloc = (catalog->links_alloc == 0) ? 1024 : catalog->links_alloc * 2;
+
+		catalog->links = (catalog_link_st*)_resize_pool(catalog, catalog->links, sizeof(catalog_link_st) * catalog->links_count, sizeof(catalog_link_st) * catalog->links_alloc);
+	}
+
+	catalog_link_st* entry = catalog->links + catalog->links_count++;
+
+	entry->record = record;
+	entry->parent = link->parent_mft_index;
+	entry->name = _append_name(catalog, link->name);
+	entry->parent_seq = link->parent_sequence_num;
+	entry->reserved = 0;
+}
+
+/**
+ * Scan handler storing each record in the catalog (rh->param.)  Records
+ * arrive one at a time, in order.
+ */
+static void _catalog_handler(dd_ctx* dd, record_handler_ctx* rh)
+{
+	mft_catalog_st* catalog = (mft_catalog_st*)rh->param;
+
+	__uint64_t i = rh->mft_index;
+
+	if (i >= catalog->count) {
+		return;
+	}
+
+	catalog->flags[i] = CATALOG_PRESENT;
+
+	if (rh->flags & MFT_RECORD_IN_USE) {
+		catalog->flags[i] |= CATALOG_IN_USE;
+	}
+
+	if (rh->flags & MFT_RECORD_DIRECTORY) {
+		catalog->flags[i] |= CATALOG_DIRECTORY;
+	}
+
+	catalog->seq[i] = rh->sequence_num;
+	catalog->parent[i] = rh->parent_mft_index;
+	catalog->parent_seq[i] = rh->parent_sequence_num;
+	catalog->name[i] = _append_name(catalog, rh->name);
+
+	// Keep one further name for each other directory the record is linked
+	// from; a directory lists a record only once.
+
+	for (int k = 0; k < rh->link_count; k++) {
+		int listed = (rh->links[k].parent_mft_index == rh->parent_mft_index);
+
+		for (int l = 0; l < k && !listed; l++) {
+			listed = (rh->links[l].parent_mft_index == rh->links[k].parent_mft_index);
+		}
+
+		if (!listed) {
+			_append_link(catalog, i, &rh->links[k]);
+		}
+	}
+	catalog->attributes[i] = rh->attributes;
+	catalog->filesize[i] = rh->filesize;
+
+	catalog->date_created[i] = rh->date_created;
+	catalog->date_modified[i] = rh->date_modified;
+	catalog->date_accessed[i] = rh->date_accessed;
+
+	catalog->run[i] = _append_runs(catalog, &rh->data_run);
+	catalog->run_count[i] = rh->data_run.entry_count;
+	catalog->run_size[i] = rh->data_run.size;
+
+	catalog->dir_run[i] = _append_runs(catalog, &rh->dir_data_run);
+	catalog->dir_run_count[i] = rh->dir_data_run.entry_count;
+
+	catalog->records++;
+}
+
+/**
+ * Whether a name places a record in directory parent: the directory must
+ * have been read and still be the one the name refers to.  NTFS bumps a
+ * record's sequence number when it's freed, so the names in a deleted
+ * directory refer to the number before that.
+ */
+static int _is_child(mft_catalog_st* catalog, __uint64_t id, __uint32_t parent, __uint16_t parent_seq)
+{
+	if (parent >= catalog->count || parent == id || !(catalog->flags[parent] & CATALOG_PRESENT)) {
+		return 0;
+	}
+
+	if (parent_seq == catalog->seq[parent]) {
+		return 1;
+	}
+
+	return !(catalog->flags[parent] & CATALOG_IN_USE) && (__uint16_t)(parent_seq + 1) == catalog->seq[parent];
+}
+
+/**
+ * Group records and links by parent directory (a counting sort over the
+ * parent column, then the links.)
+ */
+static void _build_children(mft_catalog_st* catalog)
+{
+	_free_array(catalog, catalog->child_start);
+	_free_array(catalog, catalog->child);
+
+	catalog->child_start = (__uint64_t*)calloc(catalog->count + 1, sizeof(__uint64_t));
+
+	// Count each directory's children, then turn the counts into start
+	// positions.  A record isn't its own child (the root lists itself.)
+
+	for (__uint64_t i = 0; i < catalog->count; i++) {
+		if ((catalog->flags[i] & CATALOG_PRESENT) && _is_child(catalog, i, catalog->parent[i], catalog->parent_seq[i])) {
+			catalog->child_start[catalog->parent[i] + 1]++;
+		}
+	}
+
+	for (__uint64_t n = 0; n < catalog->links_count; n++) {
+		catalog_link_st* link = catalog->links + n;
+
+		if (_is_child(catalog, link->record, link->parent, link->parent_seq)) {
+			catalog->child_start[link->parent + 1]++;
+		}
+	}
+
+	for (__uint64_t i = 0; i < catalog->count; i++) {
+		catalog->child_start[i + 1] += catalog->child_start[i];
+	}
+
+	catalog->child = (__uint32_t*)malloc(sizeof(__uint32_t) * (catalog->child_start[catalog->count] + 1));
+
+	__uint64_t* fill = (__uint64_t*)malloc(sizeof(__uint64_t) * (catalog->count + 1));
+
+	memcpy(fill, catalog->child_start, sizeof(__uint64_t) * (catalog->count + 1));
+
+	for (__uint64_t i = 0; i < catalog->count; i++) {
+		if ((catalog->flags[i] & CATALOG_PRESENT) && _is_child(catalog, i, catalog->parent[i], catalog->parent_seq[i])) {
+			catalog->child[fill[catalog->parent[i]]++] = i;
+		}
+	}
+
+	for (__uint64_t n = 0; n < catalog->links_count; n++) {
+		catalog_link_st* link = catalog->links + n;
+
+		if (_is_child(catalog, link->record, link->parent, link->parent_seq)) {
+			catalog->child[fill[link->parent]++] = catalog->count + n;
+		}
+	}
+
+	free(fill);
+}
+
+static __uint64_t _records_per_cluster(dd_ctx* dd)
+{
+	return NTFS.mft_records_per_cluster;
+}
+
+static __uint64_t _mft_clusters(dd_ctx* dd)
+{
+	return NTFS.mft_run_start[NTFS.mft_data_run.entry_count];
+}
+
+/**
+ * Identify the volume: its geometry, where its MFT lies and its serial
+ * number.
+ */
+static __uint32_t _image_key(dd_ctx* dd)
+{
+	__uint32_t key = crc32c(0, &dd->disc_size, sizeof(dd->disc_size));
+
+	key = crc32c(key, &NTFS.partition_offset, sizeof(__uint64_t));
+	key = crc32c(key, &NTFS_HEADER.bytes_per_sector, sizeof(__uint16_t));
+	key = crc32c(key, &NTFS_HEADER.sectors_per_cluster, sizeof(__uint8_t));
+	key = crc32c(key, &NTFS_HEADER.mft_cluster, sizeof(__uint64_t));
+	key = crc32c(key, &NTFS_HEADER.mft_size, sizeof(__uint64_t));
+
+	for (int i = 0; i < NTFS.mft_data_run.entry_count; i++) {
+		key = crc32c(key, &NTFS.mft_data_run.entry[i].cluster, sizeof(__uint64_t));
+		key = crc32c(key, &NTFS.mft_data_run.entry[i].count, sizeof(__uint32_t));
+	}
+
+	unsigned char* cluster = (unsigned char*)malloc(NTFS_CLUSTER_SIZE);
+
+	if (NTFS_CLUSTER_SIZE >= 0x50 && read_cluster(dd, cluster, 0) == 0) {
+		key = crc32c(key, cluster + 0x48, 8);
+	}
+
+	free(cluster);
+
+	return key;
+}
+
+static __uint32_t _mapfile_key(dd_ctx* dd)
+{
+	__uint32_t key = 0;
+
+	for (safe_region_st* region = dd->safe_regions; region != NULL; region = region->next) {
+		key = crc32c(key, &region->start, sizeof(__uint64_t));
+		key = crc32c(key, &region->length, sizeof(__uint64_t));
+	}
+
+	return key;
+}
+
+// The mapfile's safe regions, sorted and merged, for looking up many
+// clusters at once.
+
+typedef struct safe_span_st {
+	__uint64_t start;
+	__uint64_t end;
+} safe_span_st;
+
+static int _compare_spans(const void* a, const void* b)
+{
+	__uint64_t start_a = ((const safe_span_st*)a)->start;
+	__uint64_t start_b = ((const safe_span_st*)b)->start;
+
+	return (start_a > start_b) - (start_a < start_b);
+}
+
+static safe_span_st* _safe_spans(dd_ctx* dd, __uint64_t* count)
+{
+	*count = 0;
+
+	for (safe_region_st* region = dd->safe_regions; region != NULL; region = region->next) {
+		(*count)++;
+	}
+
+	safe_span_st* spans = (safe_span_st*)malloc(sizeof(safe_span_st) * (*count + 1));
+
+	__uint64_t n = 0;
+
+	for (safe_region_st* region = dd->safe_regions; region != NULL; region = region->next) {
+		spans[n].start = region->start;
+		spans[n].end = region->start + region->length;
+		n++;
+	}
+
+	qsort(spans, n, sizeof(safe_span_st), &_compare_spans);
+
+	*count = 0;
+
+	for (__uint64_t i = 0; i < n; i++) {
+		if (*count > 0 && spans[i].start <= spans[*count - 1].end) {
+			if (spans[i].end > spans[*count - 1].end) {
+				spans[*count - 1].end = spans[i].end;
+			}
+		} else {
+			spans[(*count)++] = spans[i];
+		}
+	}
+
+	return spans;
+}
+
+static int _spans_cover(safe_span_st* spans, __uint64_t count, __uint64_t start, __uint64_t end)
+{
+	// Find the last span starting at or before start.
+
+	__uint64_t low = 0;
+	__uint64_t high = count;
+
+	while (low < high) {
+		__uint64_t mid = low + (high - low) / 2;
+
+		if (spans[mid].start <= start) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low > 0 && spans[low - 1].end >= end;
+}
+
+/**
+ * Work out where each MFT cluster would be read from now (see
+ * CATALOG_CLUSTER_SAFE.)
+ *
+ * @param dd DD context struct
+ * @param states One entry per MFT cluster, filled in
+ * @param old If not NULL, states from when the mapfile was last the same
+ *        as now; CATALOG_CLUSTER_SAFE is copied from them rather than
+ *        looked up
+ */
+static void _cluster_states(dd_ctx* dd, __uint64_t* states, __uint64_t* old)
+{
+	safe_span_st* spans = NULL;
+	__uint64_t span_count = 0;
+
+	if (old == NULL) {
+		spans = _safe_spans(dd, &span_count);
+	}
+
+	__uint64_t k = 0;
+
+	for (int i = 0; i < NTFS.mft_data_run.entry_count; i++) {
+		for (__uint64_t j = 0; j < NTFS.mft_data_run.entry[i].count; j++, k++) {
+			__uint64_t cluster_pos = NTFS.mft_data_run.entry[i].cluster + j;
+
+			__uint64_t state = (dd->overlay.layer_count > 0) ? overlay_cluster_version(dd, cluster_pos) : 0;
+
+			if (old != NULL) {
+				state |= old[k] & CATALOG_CLUSTER_SAFE;
+			} else {
+				__uint64_t start = NTFS.partition_offset + NTFS_CLUSTER_SIZE * cluster_pos;
+
+				if (_spans_cover(spans, span_count, start, start + NTFS_CLUSTER_SIZE)) {
+					state |= CATALOG_CLUSTER_SAFE;
+				}
+			}
+
+			states[k] = state;
+		}
+	}
+
+	free(spans);
+}
+
+/**
+ * Reduce a cluster state to the copy of the cluster that would be read: a
+ * whole copy in the overlay, else the image if the mapfile marks the
+ * cluster as read, else any partial copy in the overlay.
+ */
+static __uint64_t _source(__uint64_t state)
+{
+	if (state & OVERLAY_VERSION_WHOLE) {
+		return state & ~CATALOG_CLUSTER_SAFE;
+	}
+
+	if (state & CATALOG_CLUSTER_SAFE) {
+		return CATALOG_CLUSTER_SAFE;
+	}
+
+	return state;
+}
+
+/**
+ * Add what a walk from the catalog would never read to the bad cluster
+ * list, as reading the records and indexes themselves would: MFT clusters
+ * that can be read whole from neither the image nor the overlay, owned by
+ * $MFT, and the clusters of each directory's index that can't, owned by
+ * the directory.  Recovery then puts them ahead of file data.
+ */
+static void _add_bad_clusters(dd_ctx* dd, mft_catalog_st* catalog)
+{
+	__uint64_t k = 0;
+
+	for (int i = 0; i < NTFS.mft_data_run.entry_count; i++) {
+		for (__uint64_t j = 0; j < NTFS.mft_data_run.entry[i].count; j++, k++) {
+			if (!(catalog->cluster_state[k] & (CATALOG_CLUSTER_SAFE | OVERLAY_VERSION_WHOLE))) {
+				add_bad_cluster(dd, 0, NTFS.mft_data_run.entry[i].cluster + j);
+			}
+		}
+	}
+
+	__uint64_t span_count;
+
+	safe_span_st* spans = _safe_spans(dd, &span_count);
+
+	for (__uint64_t i = 0; i < catalog->count; i++) {
+		if ((catalog->flags[i] & (CATALOG_PRESENT | CATALOG_IN_USE | CATALOG_DIRECTORY)) != (CATALOG_PRESENT | CATALOG_IN_USE | CATALOG_DIRECTORY)) {
+			continue;
+		}
+
+		for (__uint32_t r = 0; r < catalog->dir_run_count[i]; r++) {
+			data_run_entry* entry = catalog->runs + catalog->dir_run[i] + r;
+
+			if (entry->sparse) {
+				continue;
+			}
+
+			for (__uint64_t j = 0; j < entry->count; j++) {
+				__uint64_t cluster_pos = entry->cluster + j;
+				__uint64_t start = NTFS.partition_offset + NTFS_CLUSTER_SIZE * cluster_pos;
+
+				if (dd->overlay.layer_count > 0 && (overlay_cluster_version(dd, cluster_pos) & OVERLAY_VERSION_WHOLE)) {
+					continue;
+				}
+
+				if (!_spans_cover(spans, span_count, start, start + NTFS_CLUSTER_SIZE)) {
+					add_bad_index_cluster(dd, i, cluster_pos);
+				}
+			}
+		}
+	}
+
+	free(spans);
+}
+
+/**
+ * Discard a catalog that never became dd->catalog.
+ */
+static void _discard_catalog(dd_ctx* dd, mft_catalog_st* catalog)
+{
+	mft_catalog_st* current = dd->catalog;
+
+	dd->catalog = catalog;
+	free_catalog(dd);
+
+	dd->catalog = current;
+}
+
+/**
+ * Pipeline stage finish for add_catalog_stage(): index the children, add
+ * the MFT and index clusters that couldn't be read to the bad cluster list
+ * and make the catalog dd->catalog, replacing any catalog built before, or
+ * discard it if the scan failed.
+ */
+static void _finish_catalog(dd_ctx* dd, mft_stage_st* stage, int failed)
+{
+	mft_catalog_st* catalog = (mft_catalog_st*)stage->param;
+
+	stage->param = NULL;
+
+	if (failed) {
+		_discard_catalog(dd, catalog);
+
+		return;
+	}
+
+	_build_children(catalog);
+
+	_add_bad_clusters(dd, catalog);
+
+	catalog->dirty = 1;
+
+	free_catalog(dd);
+
+	dd->catalog = catalog;
+}
+
+/**
+ * Add a stage building the catalog to an MFT pipeline, so the catalog can
+ * be built by a scan that serves other handlers too.  The catalog becomes
+ * dd->catalog once the pipeline has run.
+ *
+ * @param dd DD context struct (NTFS open)
+ * @param pipeline Pipeline to add the stage to
+ * @return 0 on success, nonzero on failure
+ */
+int add_catalog_stage(dd_ctx* dd, mft_pipeline_st* pipeline)
+{
+	mft_catalog_st* catalog = (mft_catalog_st*)malloc(sizeof(mft_catalog_st));
+
+	memset(catalog, 0, sizeof(mft_catalog_st));
+
+	catalog->mft_clusters = _mft_clusters(dd);
+	catalog->count = catalog->mft_clusters * _records_per_cluster(dd);
+
+	__uint64_t n = catalog->count;
+
+	catalog->flags = (__uint8_t*)calloc(n, sizeof(__uint8_t));
+	catalog->seq = (__uint16_t*)calloc(n, sizeof(__uint16_t));
+	catalog->parent = (__uint32_t*)calloc(n, sizeof(__uint32_t));
+	catalog->parent_seq = (__uint16_t*)calloc(n, sizeof(__uint16_t));
+	catalog->name = (__uint32_t*)calloc(n, sizeof(__uint32_t));
+	catalog->attributes = (__uint32_t*)calloc(n, sizeof(__uint32_t));
+	catalog->filesize = (__uint64_t*)calloc(n, sizeof(__uint64_t));
+	catalog->date_created = (__uint64_t*)calloc(n, sizeof(__uint64_t));
+	catalog->date_modified = (__uint64_t*)calloc(n, sizeof(__uint64_t));
+	catalog->date_accessed = (__uint64_t*)calloc(n, sizeof(__uint64_t));
+	catalog->run = (__uint64_t*)calloc(n, sizeof(__uint64_t));
+	catalog->run_count = (__uint32_t*)calloc(n, sizeof(__uint32_t));
+	catalog->run_size = (__uint64_t*)calloc(n, sizeof(__uint64_t));
+	catalog->dir_run = (__uint64_t*)calloc(n, sizeof(__uint64_t));
+	catalog->dir_run_count = (__uint32_t*)calloc(n, sizeof(__uint32_t));
+
+	catalog->cluster_state = (__uint64_t*)calloc(catalog->mft_clusters + 1, sizeof(__uint64_t));
+
+	if (n > 0 && (catalog->flags == NULL || catalog->filesize == NULL || catalog->dir_run_count == NULL)) {
+		ERR("Unable to allocate catalog of %lu MFT records\n", n);
+
+		_discard_catalog(dd, catalog);
+
+		return 1;
+	}
+
+	_append_name(catalog, "");
+
+	// Note where each cluster will be read from before reading it.
+
+	_cluster_states(dd, catalog->cluster_state, NULL);
+
+	catalog->image_key = _image_key(dd);
+	catalog->mapfile_key = _mapfile_key(dd);
+
+	int i = add_mft_stage(pipeline, &_catalog_handler, NULL, catalog);
+
+	pipeline->stage[i].finish = &_finish_catalog;
+
+	// Deleted files are listed too.
+
+	pipeline->scan.include_free = 1;
+
+	return 0;
+}
+
+/**
+ * Build the catalog with one scan of the MFT (replacing any catalog built
+ * before.)  Once built, open_dir(), restore_ntfs() and data_run_complete()
+ * answer from it.
+ *
+ * @param dd DD context struct (NTFS open)
+ * @return 0 on success, nonzero on failure
+ */
+int build_catalog(dd_ctx* dd)
+{
+	mft_pipeline_st pipeline;
+
+	init_mft_pipeline(&pipeline);
+
+	if (add_catalog_stage(dd, &pipeline)) {
+		cleanup_mft_pipeline(&pipeline);
+
+		return 1;
+	}
+
+	int result = run_mft_pipeline(dd, &pipeline);
+
+	cleanup_mft_pipeline(&pipeline);
+
+	return (result != 0) ? 2 : 0;
+}
+
+void free_catalog(dd_ctx* dd)
+{
+	mft_catalog_st* catalog = dd->catalog;
+
+	if (catalog == NULL) {
+		return;
+	}
+
+	_free_array(catalog, catalog->flags);
+	_free_array(catalog, catalog->seq);
+	_free_array(catalog, catalog->parent);
+	_free_array(catalog, catalog->parent_seq);
+	_free_array(catalog, catalog->name);
+	_free_array(catalog, catalog->attributes);
+	_free_array(catalog, catalog->filesize);
+	_free_array(catalog, catalog->date_created);
+	_free_array(catalog, catalog->date_modified);
+	_free_array(catalog, catalog->date_accessed);
+	_free_array(catalog, catalog->run);
+	_free_array(catalog, catalog->run_count);
+	_free_array(catalog, catalog->run_size);
+	_free_array(catalog, catalog->dir_run);
+	_free_array(catalog, catalog->dir_run_count);
+
+	_free_array(catalog, catalog->names);
+	_free_array(catalog, catalog->runs);
+	_free_array(catalog, catalog->links);
+
+	_free_array(catalog, catalog->child_start);
+	_free_array(catalog, catalog->child);
+
+	_free_array(catalog, catalog->cluster_state);
+
+	if (catalog->map != NULL) {
+		munmap(catalog->map, catalog->map_size);
+	}
+
+	free(catalog);
+
+	dd->catalog = NULL;
+}
+
+/**
+ * List the catalog's arrays in file order.
+ *
+ * @return Number of sections (CATALOG_SECTIONS)
+ */
+static int _catalog_sections(mft_catalog_st* catalog, catalog_section_st* sections, __uint64_t child_count)
+{
+	__uint64_t n = catalog->count;
+	int i = 0;
+
+#define SECTION(array, bytes) \
+	sections[i].data = (void**)&(array); \
+	sections[i].size = (bytes); \
+	i++;
+
+	SECTION(catalog->flags, n * sizeof(__uint8_t));
+	SECTION(catalog->seq, n * sizeof(__uint16_t));
+	SECTION(catalog->parent, n * sizeof(__uint32_t));
+	SECTION(catalog->parent_seq, n * sizeof(__uint16_t));
+	SECTION(catalog->name, n * sizeof(__uint32_t));
+	SECTION(catalog->attributes, n * sizeof(__uint32_t));
+	SECTION(catalog->filesize, n * sizeof(__uint64_t));
+	SECTION(catalog->date_created, n * sizeof(__uint64_t));
+	SECTION(catalog->date_modified, n * sizeof(__uint64_t));
+	SECTION(catalog->date_accessed, n * sizeof(__uint64_t));
+	SECTION(catalog->run, n * sizeof(__uint64_t));
+	SECTION(catalog->run_count, n * sizeof(__uint32_t));
+	SECTION(catalog->run_size, n * sizeof(__uint64_t));
+	SECTION(catalog->dir_run, n * sizeof(__uint64_t));
+	SECTION(catalog->dir_run_count, n * sizeof(__uint32_t));
+	SECTION(catalog->names, catalog->names_size);
+	SECTION(catalog->runs, catalog->runs_count * sizeof(data_run_entry));
+	SECTION(catalog->links, catalog->links_count * sizeof(catalog_link_st));
+	SECTION(catalog->child_start, (n + 1) * sizeof(__uint64_t));
+	SECTION(catalog->child, child_count * sizeof(__uint32_t));
+	SECTION(catalog->cluster_state, catalog->mft_clusters * sizeof(__uint64_t));
+
+#undef SECTION
+
+	return i;
+}
+
+/**
+ * Save the catalog, replacing filename once it's completely written.
+ *
+ * @param dd DD context struct
+ * @param filename Catalog file
+ * @return 0 on success, nonzero on failure
+ */
+int save_catalog(dd_ctx* dd, const char* filename)
+{
+	mft_catalog_st* catalog = dd->catalog;
+
+	if (catalog == NULL) {
+		ERR("No catalog to save\n");
+
+		return 1;
+	}
+
+	catalog_file_header_st header;
+
+	memset(&header, 0, sizeof(catalog_file_header_st));
+
+	memcpy(header.magic, CATALOG_MAGIC, 8);
+	header.version = CATALOG_VERSION;
+	header.run_entry_size = sizeof(data_run_entry);
+	header.image_key = catalog->image_key;
+	header.mapfile_key = catalog->mapfile_key;
+
+	header.count = catalog->count;
+	header.records = catalog->records;
+	header.names_size = catalog->names_size;
+	header.runs_count = catalog->runs_count;
+	header.links_count = catalog->links_count;
+	header.child_count = catalog->child_start[catalog->count];
+	header.mft_clusters = catalog->mft_clusters;
+
+	catalog_section_st sections[CATALOG_SECTIONS];
+
+	int section_count = _catalog_sections(catalog, sections, header.child_count);
+
+	__uint64_t pos = ALIGN8(sizeof(catalog_file_header_st));
+
+	for (int i = 0; i < section_count; i++) {
+		header.section[i] = pos;
+		pos += ALIGN8(sections[i].size);
+	}
+
+	char* tmp_filename = (char*)malloc(strlen(filename) + 5);
+
+	strcpy(tmp_filename, filename);
+	strcat(tmp_filename, ".tmp");
+
+	FILE* file = fopen(tmp_filename, "wb");
+
+	if (file == NULL) {
+		ERR("Unable to open catalog %s for writing: %s\n", tmp_filename, strerror(errno));
+
+		free(tmp_filename);
+		return 2;
+	}
+
+	static const char padding[8] = { 0 };
+
+	int failed = (fwrite(&header, sizeof(catalog_file_header_st), 1, file) != 1);
+
+	failed |= (fwrite(padding, 1, ALIGN8(sizeof(catalog_file_header_st)) - sizeof(catalog_file_header_st), file) != ALIGN8(sizeof(catalog_file_header_st)) - sizeof(catalog_file_header_st));
+
+	for (int i = 0; i < section_count && !failed; i++) {
+		if (sections[i].size > 0) {
+			failed |= (fwrite(*sections[i].data, 1, sections[i].size, file) != sections[i].size);
+		}
+
+		failed |= (fwrite(padding, 1, ALIGN8(sections[i].size) - sections[i].size, file) != ALIGN8(sections[i].size) - sections[i].size);
+	}
+
+	if (failed || fflush(file) || fsync(fileno(file))) {
+		ERR("Unable to write catalog %s: %s\n", tmp_filename, strerror(errno));
+
+		fclose(file);
+		unlink(tmp_filename);
+
+		free(tmp_filename);
+		return 3;
+	}
+
+	fclose(file);
+
+	if (rename(tmp_filename, filename)) {
+		ERR("Unable to rename catalog %s to %s: %s\n", tmp_filename, filename, strerror(errno));
+
+		free(tmp_filename);
+		return 4;
+	}
+
+	free(tmp_filename);
+
+	catalog->dirty = 0;
+
+	return 0;
+}
+
+/**
+ * Read again the records in MFT clusters that would now be read from
+ * somewhere other than when the catalog was built (clusters recovered to
+ * the overlay since, or marked read in a newer mapfile.)
+ *
+ * @return Number of MFT clusters read again
+ */
+static __uint64_t _refresh_catalog(dd_ctx* dd, mft_catalog_st* catalog)
+{
+	__uint32_t mapfile_key = _mapfile_key(dd);
+
+	__uint64_t* states = (__uint64_t*)malloc(sizeof(__uint64_t) * (catalog->mft_clusters + 1));
+
+	_cluster_states(dd, states, (mapfile_key == catalog->mapfile_key) ? catalog->cluster_state : NULL);
+
+	__uint64_t records_per_cluster = _records_per_cluster(dd);
+	__uint64_t refreshed = 0;
+	__uint64_t k = 0;
+
+	__uint8_t* forgotten = (__uint8_t*)calloc(catalog->mft_clusters + 1, sizeof(__uint8_t));
+	__uint64_t links_before = catalog->links_count;
+
+	for (int i = 0; i < NTFS.mft_data_run.entry_count; i++) {
+		for (__uint64_t j = 0; j < NTFS.mft_data_run.entry[i].count; j++, k++) {
+			if (_source(states[k]) == _source(catalog->cluster_state[k])) {
+				continue;
+			}
+
+			// Forget the cluster's records, then read them again.
+
+			for (__uint64_t r = k * records_per_cluster; r < (k + 1) * records_per_cluster && r < catalog->count; r++) {
+				if (catalog->flags[r] & CATALOG_PRESENT) {
+					catalog->records--;
+				}
+
+				catalog->flags[r] = 0;
+			}
+
+			forgotten[k] = 1;
+
+			record_handler_ctx rh;
+			memset(&rh, 0, sizeof(record_handler_ctx));
+
+			rh.param = catalog;
+
+			read_mft_record(dd, NTFS.mft_data_run.entry[i].cluster + j, &_catalog_handler, &rh);
+
+			refreshed++;
+		}
+	}
+
+	// Drop the links the forgotten records had before; reading them again
+	// added them anew.
+
+	if (refreshed > 0) {
+		__uint64_t kept = 0;
+
+		for (__uint64_t n = 0; n < catalog->links_count; n++) {
+			if (n < links_before && forgotten[catalog->links[n].record / records_per_cluster]) {
+				continue;
+			}
+
+			catalog->links[kept++] = catalog->links[n];
+		}
+
+		catalog->links_count = kept;
+	}
+
+	free(forgotten);
+
+	if (refreshed > 0 || mapfile_key != catalog->mapfile_key) {
+		catalog->dirty = 1;
+	}
+
+	_free_array(catalog, catalog->cluster_state);
+
+	catalog->cluster_state = states;
+	catalog->mapfile_key = mapfile_key;
+
+	if (refreshed > 0) {
+		_build_children(catalog);
+	}
+
+	_add_bad_clusters(dd, catalog);
+
+	return refreshed;
+}
+
+/**
+ * Map a catalog saved by save_catalog() (replacing any catalog in dd),
+ * then bring it up to date with the overlay and mapfile.
+ *
+ * @param dd DD context struct (NTFS, mapfile and overlay open)
+ * @param filename Catalog file
+ * @return 0 on success, 1 if there's no catalog file or it's for another
+ *         volume or version, 2 on failure
+ */
+int load_catalog(dd_ctx* dd, const char* filename)
+{
+	free_catalog(dd);
+
+	int fd = open(filename, O_RDONLY);
+
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			return 1;
+		}
+
+		ERR("Unable to open catalog %s: %s\n", filename, strerror(errno));
+
+		return 2;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(catalog_file_header_st)) {
+		close(fd);
+
+		return 1;
+	}
+
+	// Map privately and writable, so records read again can be updated in
+	// place without touching the file.
+
+	void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		ERR("Unable to map catalog %s: %s\n", filename, strerror(errno));
+
+		return 2;
+	}
+
+	catalog_file_header_st* header = (catalog_file_header_st*)map;
+
+	if (memcmp(header->magic, CATALOG_MAGIC, 8) || header->version != CATALOG_VERSION ||
+			header->run_entry_size != sizeof(data_run_entry) || header->image_key != _image_key(dd) ||
+			header->mft_clusters != _mft_clusters(dd) || header->count != header->mft_clusters * _records_per_cluster(dd)) {
+		munmap(map, st.st_size);
+
+		return 1;
+	}
+
+	mft_catalog_st* catalog = (mft_catalog_st*)malloc(sizeof(mft_catalog_st));
+
+	memset(catalog, 0, sizeof(mft_catalog_st));
+
+	catalog->map = map;
+	catalog->map_size = st.st_size;
+
+	catalog->count = header->count;
+	catalog->records = header->records;
+	catalog->names_size = catalog->names_alloc = header->names_size;
+	catalog->runs_count = catalog->runs_alloc = header->runs_count;
+	catalog->links_count = catalog->links_alloc = header->links_count;
+	catalog->mft_clusters = header->mft_clusters;
+	catalog->image_key = header->image_key;
+	catalog->mapfile_key = header->mapfile_key;
+
+	catalog_section_st sections[CATALOG_SECTIONS];
+
+	int section_count = _catalog_sections(catalog, sections, header->child_count);
+
+	for (int i = 0; i < section_count; i++) {
+		if (header->section[i] % 8 || header->section[i] > (__uint64_t)st.st_size || sections[i].size > st.st_size - header->section[i]) {
+			ERR("Catalog %s is truncated or corrupt\n", filename);
+
+			dd->catalog = catalog;
+			free_catalog(dd);
+
+			return 2;
+		}
+
+		*sections[i].data = (char*)map + header->section[i];
+	}
+
+	dd->catalog = catalog;
+
+	catalog->refreshed = _refresh_catalog(dd, catalog);
+
+	return 0;
+}
+
+/**
+ * Load the catalog saved in filename, or build it if there's none for
+ * this volume, saving it whenever it's built or brought up to date.
+ *
+ * @param dd DD context struct (NTFS, mapfile and overlay open)
+ * @param filename Catalog file
+ * @return 0 on success, nonzero on failure (the catalog may still be
+ *         usable if it couldn't be saved)
+ */
+int open_catalog(dd_ctx* dd, const char* filename)
+{
+	if (load_catalog(dd, filename) != 0 && build_catalog(dd) != 0) {
+		return 1;
+	}
+
+	if (dd->catalog->dirty && save_catalog(dd, filename)) {
+		return 2;
+	}
+
+	return 0;
+}
+
+/**
+ * Fill in a record handler context from the catalog, as read_mft_record()
+ * would for the record.  Names and data runs point into the catalog.
+ * rh->param and rh->result are left alone; no links or bitmap are given.
+ *
+ * @param dd DD context struct
+ * @param mft_index MFT index
+ * @param rh Record handler context to fill in
+ * @return 0 on success, 1 if the catalog doesn't hold the record
+ */
+int catalog_record(dd_ctx* dd, __uint64_t mft_index, record_handler_ctx* rh)
+{
+	mft_catalog_st* catalog = dd->catalog;
+
+	if (catalog == NULL || mft_index >= catalog->count || !(catalog->flags[mft_index] & CATALOG_PRESENT)) {
+		return 1;
+	}
+
+	rh->mft_index = mft_index;
+	rh->name = catalog->names + catalog->name[mft_index];
+	rh->flags = 0;
+	rh->sequence_num = catalog->seq[mft_index];
+
+	if (catalog->flags[mft_index] & CATALOG_IN_USE) {
+		rh->flags |= MFT_RECORD_IN_USE;
+	}
+
+	if (catalog->flags[mft_index] & CATALOG_DIRECTORY) {
+		rh->flags |= MFT_RECORD_DIRECTORY;
+	}
+
+	rh->parent_mft_index = catalog->parent[mft_index];
+	rh->parent_sequence_num = catalog->parent_seq[mft_index];
+	rh->attributes = catalog->attributes[mft_index];
+
+	rh->links = NULL;
+	rh->link_count = 0;
+
+	rh->date_created = catalog->date_created[mft_index];
+	rh->date_modified = catalog->date_modified[mft_index];
+	rh->date_accessed = catalog->date_accessed[mft_index];
+
+	rh->filesize = catalog->filesize[mft_index];
+
+	memset(&rh->data_run, 0, sizeof(data_run_st));
+
+	rh->data_run.entry = catalog->runs + catalog->run[mft_index];
+	rh->data_run.entry_count = catalog->run_count[mft_index];
+	rh->data_run.size = catalog->run_size[mft_index];
+
+	memset(&rh->dir_data_run, 0, sizeof(data_run_st));
+
+	rh->dir_data_run.entry = catalog->runs + catalog->dir_run[mft_index];
+	rh->dir_data_run.entry_count = catalog->dir_run_count[mft_index];
+
+	memset(&rh->bitmap, 0, sizeof(bitmap_st));
+
+	return 0;
+}
+
+/**
+ * List a directory from the catalog (see open_dir().)  Files are listed in
+ * MFT index order, followed by files hard linked into the directory under
+ * a further name; records not in use are marked deleted.  Dates are the
+ * record's $STANDARD_INFORMATION dates rather than the index's copy of
+ * $FILE_NAME.
+ *
+ * @param dd DD context struct
+ * @param mft_index MFT index of directory
+ * @return Directory, to be closed with close_dir()
+ */
+NTFS_DIR* catalog_open_dir(dd_ctx* dd, __uint64_t mft_index)
+{
+	mft_catalog_st* catalog = dd->catalog;
+
+	file_name_st* files = NULL;
+
+	if (mft_index < catalog->count) {
+		for (__uint64_t i = catalog->child_start[mft_index]; i < catalog->child_start[mft_index + 1]; i++) {
+			__uint32_t id = catalog->child[i];
+			__uint32_t name_offset;
+
+			if (id < catalog->count) {
+				name_offset = catalog->name[id];
+			} else {
+				name_offset = catalog->links[id - catalog->count].name;
+				id = catalog->links[id - catalog->count].record;
+			}
+
+			file_name_st* file = (file_name_st*)malloc(sizeof(file_name_st));
+
+			memset(file, 0, sizeof(file_name_st));
+
+			file->id = id;
+
+			const char* name = catalog->names + name_offset;
+
+			file->ascii_name = (char*)malloc(strlen(name) + 1);
+			strcpy(file->ascii_name, name);
+
+			file->date_accessed = catalog->date_accessed[id];
+			file->date_created = catalog->date_created[id];
+			file->date_modified = catalog->date_modified[id];
+
+			file->filesize = catalog->filesize[id];
+			file->attributes = catalog->attributes[id];
+			file->deleted = !(catalog->flags[id] & CATALOG_IN_USE);
+
+			HASH_ADD_INT(files, id, file);
+		}
+	}
+
+	NTFS_DIR* dir = (NTFS_DIR*)malloc(sizeof(NTFS_DIR));
+
+	dir->files = files;
+	dir->current_file = dir->files;
+
+	return dir;
+}
@@ -0,0 +1,139 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "dd.h"
+#include "mft_pipeline.h"
+
+// What a walk of the volume needs from every MFT record, gathered by one
+// MFT scan so directory listings, restores and completeness checks don't
+// go back to the MFT.  Fields are kept column by column, indexed by MFT
+// index; names and data runs are packed into shared pools that the
+// columns point into.
+//
+// Catalogs can be saved and mapped back in on later runs (see
+// open_catalog().)  The file records where each MFT cluster was read from
+// (the image, as the mapfile had it, or a copy in the overlay), so after
+// recovery only the records in clusters read from somewhere new are read
+// again.  MFT clusters and directory index clusters that can't be read are
+// added to the bad cluster list whenever the catalog is built or loaded,
+// since walks from the catalog never read them.
+//
+// Each record is listed under the parent of every one of its names, so a
+// file hard linked from several directories appears in each of them.  The
+// names other than the one read_mft_record() reports are kept as links.
+
+#define CATALOG_PRESENT 0x01 // Record was read
+#define CATALOG_IN_USE 0x02 // MFT_RECORD_IN_USE
+#define CATALOG_DIRECTORY 0x04 // MFT_RECORD_DIRECTORY
+
+// Where an MFT cluster was read from: an overlay_cluster_version(), with
+// CATALOG_CLUSTER_SAFE set if the mapfile marks the cluster as read.
+
+#define CATALOG_CLUSTER_SAFE ((__uint64_t)1 << 61)
+
+// A further name for a record, in another directory.
+
+typedef struct catalog_link_st {
+	__uint32_t record; // MFT index
+	__uint32_t parent; // Parent directory's MFT index
+	__uint32_t name; // Offset into names
+	__uint16_t parent_seq;
+	__uint16_t reserved;
+} catalog_link_st;
+
+typedef struct mft_catalog_st {
+	__uint64_t count; // MFT indexes covered
+
+	// One entry per MFT index.
+
+	__uint8_t* flags; // CATALOG_*
+	__uint16_t* seq; // Record header's sequence number
+	__uint32_t* parent; // Parent directory's MFT index
+	__uint16_t* parent_seq;
+	__uint32_t* name; // Offset into names
+	__uint32_t* attributes; // $FILE_NAME flags
+	__uint64_t* filesize;
+	__uint64_t* date_created;
+	__uint64_t* date_modified;
+	__uint64_t* date_accessed;
+	__uint64_t* run; // First of the record's $DATA runs in runs
+	__uint32_t* run_count;
+	__uint64_t* run_size; // Size of $DATA in bytes
+	__uint64_t* dir_run; // First of the record's $I30 index runs in runs
+	__uint32_t* dir_run_count;
+
+	char* names; // Pool of NUL-terminated names
+	__uint64_t names_size;
+	__uint64_t names_alloc;
+
+	data_run_entry* runs; // Pool of data runs
+	__uint64_t runs_count;
+	__uint64_t runs_alloc;
+
+	catalog_link_st* links; // Pool of further names
+	__uint64_t links_count;
+	__uint64_t links_alloc;
+
+	// The entries listed in directory d are
+	// child[child_start[d]] .. child[child_start[d + 1] - 1].  An entry
+	// below count is an MFT index; entry count + n is links[n].
+
+	__uint64_t* child_start;
+	__uint32_t* child;
+
+	__uint64_t records; // Records read
+
+	__uint64_t mft_clusters;
+	__uint64_t* cluster_state; // CATALOG_CLUSTER_SAFE | overlay version, per MFT cluster
+
+	__uint32_t image_key; // Identifies the volume the catalog was built from
+	__uint32_t mapfile_key; // Identifies the mapfile's safe regions
+
+	int dirty; // Changed since built or loaded, and not yet saved
+	__uint64_t refreshed; // MFT clusters read again when loaded
+
+	// Set when the catalog was loaded from a file; arrays inside the mapping
+	// are never freed or resized.
+
+	void* map;
+	size_t map_size;
+} mft_catalog_st;
+
+int add_catalog_stage(dd_ctx* dd, mft_pipeline_st* pipeline);
+int build_catalog(dd_ctx* dd);
+
+void free_catalog(dd_ctx* dd);
+
+int save_catalog(dd_ctx* dd, const char* filename);
+
+int load_catalog(dd_ctx* dd, const char* filename);
+
+int open_catalog(dd_ctx* dd, const char* filename);
+
+int catalog_record(dd_ctx* dd, __uint64_t mft_index, record_handler_ctx* rh);
+
+NTFS_DIR* catalog_open_dir(dd_ctx* dd, __uint64_t mft_index);
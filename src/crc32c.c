@@ -0,0 +1,215 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+
+static __uint32_t _table[8][256];
+static pthread_once_t _table_once = PTHREAD_ONCE_INIT;
+
+static void _build_table()
+{
+	for (int i = 0; i < 256; i++) {
+		__uint32_t crc = i;
+
+		for (int j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+		}
+
+		_table[0][i] = crc;
+	}
+
+	for (int i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++) {
+			_table[t][i] = (_table[t - 1][i] >> 8) ^ _table[0][_table[t - 1][i] & 0xff];
+		}
+	}
+}
+
+static __uint32_t _crc32c_sw(__uint32_t crc, const unsigned char* data, size_t length)
+{
+	// Scan and writer threads can both get here first.
+
+	pthread_once(&_table_once, _build_table);
+
+	// Eight bytes per step through the sliced tables.
+
+	while (length >= 8) {
+		__uint64_t word;
+
+		memcpy(&word, data, 8);
+
+		word ^= crc;
+
+		crc = _table[7][word & 0xff] ^
+				_table[6][(word >> 8) & 0xff] ^
+				_table[5][(word >> 16) & 0xff] ^
+				_table[4][(word >> 24) & 0xff] ^
+				_table[3][(word >> 32) & 0xff] ^
+				_table[2][(word >> 40) & 0xff] ^
+				_table[1][(word >> 48) & 0xff] ^
+				_table[0][word >> 56];
+
+		data += 8;
+		length -= 8;
+	}
+
+	while (length > 0) {
+		crc = (crc >> 8) ^ _table[0][(crc ^ *data) & 0xff];
+
+		data++;
+		length--;
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static __uint32_t _crc32c_hw(__uint32_t crc, const unsigned char* data, size_t length)
+{
+	__uint64_t crc64 = crc;
+
+	while (length >= 8) {
+		__uint64_t word;
+
+		memcpy(&word, data, 8);
+
+		crc64 = _mm_crc32_u64(crc64, word);
+
+		data += 8;
+		length -= 8;
+	}
+
+	crc = (__uint32_t)crc64;
+
+	while (length > 0) {
+		crc = _mm_crc32_u8(crc, *data);
+
+		data++;
+		length--;
+	}
+
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static void _crc32c_blocks_hw(const unsigned char* data, size_t block_size, size_t num_blocks, __uint32_t* crcs)
+{
+	size_t i = 0;
+
+	// Three independent dependency chains keep the crc32 unit busy.
+
+	for (; i + 3 <= num_blocks && block_size % 8 == 0; i += 3) {
+		const unsigned char* a = data + block_size * i;
+		const unsigned char* b = a + block_size;
+		const unsigned char* c = b + block_size;
+
+		__uint64_t crc_a = 0xffffffff;
+		__uint64_t crc_b = 0xffffffff;
+		__uint64_t crc_c = 0xffffffff;
+
+		for (size_t pos = 0; pos < block_size; pos += 8) {
+			__uint64_t word_a;
+			__uint64_t word_b;
+			__uint64_t word_c;
+
+			memcpy(&word_a, a + pos, 8);
+			memcpy(&word_b, b + pos, 8);
+			memcpy(&word_c, c + pos, 8);
+
+			crc_a = _mm_crc32_u64(crc_a, word_a);
+			crc_b = _mm_crc32_u64(crc_b, word_b);
+			crc_c = _mm_crc32_u64(crc_c, word_c);
+		}
+
+		crcs[i] = ~(__uint32_t)crc_a;
+		crcs[i + 1] = ~(__uint32_t)crc_b;
+		crcs[i + 2] = ~(__uint32_t)crc_c;
+	}
+
+	for (; i < num_blocks; i++) {
+		crcs[i] = ~_crc32c_hw(0xffffffff, data + block_size * i, block_size);
+	}
+}
+
+static int _have_hw()
+{
+	static int have_hw = -1;
+
+	if (have_hw == -1) {
+		__builtin_cpu_init();
+
+		have_hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+	}
+
+	return have_hw;
+}
+
+#else
+
+static int _have_hw()
+{
+	return 0;
+}
+
+#endif
+
+__uint32_t crc32c(__uint32_t crc, const void* data, size_t length)
+{
+	crc = ~crc;
+
+#if defined(__x86_64__)
+	if (_have_hw()) {
+		return ~_crc32c_hw(crc, (const unsigned char*)data, length);
+	}
+#endif
+
+	return ~_crc32c_sw(crc, (const unsigned char*)data, length);
+}
+
+void crc32c_blocks(const void* data, size_t block_size, size_t num_blocks, __uint32_t* crcs)
+{
+#if defined(__x86_64__)
+	if (_have_hw()) {
+		_crc32c_blocks_hw((const unsigned char*)data, block_size, num_blocks, crcs);
+
+		return;
+	}
+#endif
+
+	for (size_t i = 0; i < num_blocks; i++) {
+		crcs[i] = crc32c(0, (const unsigned char*)data + block_size * i, block_size);
+	}
+}
@@ -29,9 +29,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "badclusters.h"
 
 #include "hexdump.h"
+#include "fixup.h"
 
 #include "overlay.h"
 
+#include "mft_scan.h"
+
+#include "catalog.h"
+
 #include "elog.h"
 
 #include <unistd.h>
@@ -93,6 +98,10 @@ int cleanup_dd(dd_ctx* dd)
 
 	cleanup_bad_cluster_hashes(dd);
 
+	free_catalog(dd);
+
+	cleanup_arena(&dd->arena);
+
 	if (dd->reader.dev != NULL) {
 		cleanup_reader(&dd->reader);
 	}
@@ -132,6 +141,60 @@ static void mft_record_handler_read_mft(dd_ctx *dd, record_handler_ctx *rh)
 	}
 }
 
+typedef struct mft_run_pos_st {
+	__uint64_t cluster;
+	int run;
+} mft_run_pos_st;
+
+static int _compare_mft_runs(const void* a, const void* b)
+{
+	__uint64_t cluster_a = ((const mft_run_pos_st*)a)->cluster;
+	__uint64_t cluster_b = ((const mft_run_pos_st*)b)->cluster;
+
+	return (cluster_a > cluster_b) - (cluster_a < cluster_b);
+}
+
+/**
+ * Set up the tables get_mft_index() and get_mft_cluster() search: where
+ * each MFT extent starts within the MFT, and the extents in order of where
+ * they lie on disc.
+ */
+static void _index_mft_runs(dd_ctx* dd)
+{
+	int count = NTFS.mft_data_run.entry_count;
+
+	NTFS.mft_records_per_cluster = NTFS_CLUSTER_SIZE / NTFS_HEADER.mft_size;
+
+	if (NTFS.mft_records_per_cluster == 0) {
+		NTFS.mft_records_per_cluster = 1;
+	}
+
+	free(NTFS.mft_run_start);
+	free(NTFS.mft_run_by_cluster);
+
+	NTFS.mft_run_start = (__uint64_t*)malloc(sizeof(__uint64_t) * (count + 1));
+	NTFS.mft_run_by_cluster = (int*)malloc(sizeof(int) * (count + 1));
+
+	mft_run_pos_st* pos = (mft_run_pos_st*)malloc(sizeof(mft_run_pos_st) * (count + 1));
+
+	NTFS.mft_run_start[0] = 0;
+
+	for (int i = 0; i < count; i++) {
+		NTFS.mft_run_start[i + 1] = NTFS.mft_run_start[i] + NTFS.mft_data_run.entry[i].count;
+
+		pos[i].cluster = NTFS.mft_data_run.entry[i].cluster;
+		pos[i].run = i;
+	}
+
+	qsort(pos, count, sizeof(mft_run_pos_st), &_compare_mft_runs);
+
+	for (int i = 0; i < count; i++) {
+		NTFS.mft_run_by_cluster[i] = pos[i].run;
+	}
+
+	free(pos);
+}
+
 int open_ntfs(dd_ctx* dd, const char *filename, __uint64_t partition_offset) {
 
 	NTFS.partition_offset = partition_offset;
@@ -200,6 +263,8 @@ int open_ntfs(dd_ctx* dd, const char *filename, __uint64_t partition_offset) {
 		return 1;
 	}
 
+	_index_mft_runs(dd);
+
 
 
 
@@ -217,6 +282,12 @@ void close_ntfs(dd_ctx* dd)
 
 		free(NTFS.mft_data_run.entry);
 		memset(&NTFS.mft_data_run, 0, sizeof(data_run_st));
+
+		free(NTFS.mft_run_start);
+		free(NTFS.mft_run_by_cluster);
+
+		NTFS.mft_run_start = NULL;
+		NTFS.mft_run_by_cluster = NULL;
 	}
 
 	if (NTFS.mft_bitmap.length != 0) {
@@ -237,31 +308,49 @@ void close_ntfs(dd_ctx* dd)
  * @return 1 if cluster exists and is "valid", 0 otherwise
  */
 int _cluster_is_safe(dd_ctx *dd, __uint64_t cluster_pos) {
-	if (dd->overlay.overlay_file != NULL) {
+	if (dd->overlay.layer_count > 0) {
 		if (overlay_has_cluster(dd, cluster_pos)) {
 			return 1;
 		}
 	}
 
-	dd->safe_region_pos = dd->safe_regions;
+	safe_region_st* region = dd->safe_regions;
 
-	while (dd->safe_region_pos != NULL) {
-		if (dd->safe_region_pos->start <= CLUSTER_TO_BYTE(cluster_pos) &&
-				dd->safe_region_pos->start + dd->safe_region_pos->length >= CLUSTER_TO_BYTE(cluster_pos + 1)) {
+	while (region != NULL) {
+		if (region->start <= CLUSTER_TO_BYTE(cluster_pos) &&
+				region->start + region->length >= CLUSTER_TO_BYTE(cluster_pos + 1)) {
 
 			return 1;
 		}
-		dd->safe_region_pos = dd->safe_region_pos->next;
+		region = region->next;
 	}
 
 	return 0;
 }
 
+/**
+ * Test whether a cluster can be read straight from the image: the mapfile
+ * marks it read and it has no copy in the overlay.
+ *
+ * @param dd DD context structure
+ * @param cluster_pos Cluster position to test
+ *
+ * @return 1 if so, 0 otherwise
+ */
+int cluster_in_image(dd_ctx *dd, __uint64_t cluster_pos)
+{
+	if (dd->overlay.layer_count > 0 && overlay_has_cluster(dd, cluster_pos)) {
+		return 0;
+	}
+
+	return _cluster_is_safe(dd, cluster_pos);
+}
+
 int read_cluster(dd_ctx *dd, unsigned char* cluster, __uint64_t cluster_pos)
 {
 	// Attempt to read cluster from overlay first.
 
-	if (dd->overlay.overlay_file != NULL) {
+	if (dd->overlay.layer_count > 0) {
 		int result = read_cluster_from_overlay(dd, cluster, cluster_pos);
 
 		if (result == 0) {
@@ -288,11 +377,10 @@ int read_cluster(dd_ctx *dd, unsigned char* cluster, __uint64_t cluster_pos)
 		return 1;
 	}
 
-	// Perform read.
-
-	fseek(NTFS.disc, NTFS.partition_offset + NTFS_CLUSTER_SIZE * cluster_pos, SEEK_SET);
+	// Perform read.  pread() leaves the stream's position alone, so scan
+	// threads can read at the same time.
 
-	fread(cluster, NTFS_CLUSTER_SIZE, 1, NTFS.disc);
+	pread(fileno(NTFS.disc), cluster, NTFS_CLUSTER_SIZE, NTFS.partition_offset + NTFS_CLUSTER_SIZE * cluster_pos);
 
 	// Check that cluster is in a "read" area of the dump.
 	// (This is done after the read deliberately for now, but should be moved before the read after testing.)
@@ -304,38 +392,198 @@ int read_cluster(dd_ctx *dd, unsigned char* cluster, __uint64_t cluster_pos)
 	return 0;
 }
 
+/**
+ * Read a cluster as read_cluster() does, but when it can't be read whole,
+ * fill in whatever sectors of it were recovered to the overlay (see
+ * write_partial_cluster().)
+ *
+ * @param dd DD context struct
+ * @param cluster Cluster buffer
+ * @param cluster_pos Cluster number
+ * @param mask Set to the 512-byte sectors of cluster that are good (all of
+ *             them on success)
+ * @return 0 on success, 1 if the cluster is only partly or not at all
+ *         available, 2 on overlay read failure
+ */
+int read_cluster_sectors(dd_ctx *dd, unsigned char* cluster, __uint64_t cluster_pos, __uint64_t* mask)
+{
+	int result = read_cluster(dd, cluster, cluster_pos);
+
+	*mask = 0;
+
+	if (result == 0) {
+		*mask = SECTOR_MASK_FULL(NTFS_CLUSTER_SIZE / OVERLAY_SECTOR_SIZE);
+	} else if (result == 1 && dd->overlay.layer_count > 0) {
+		*mask = read_partial_cluster(dd, cluster, cluster_pos);
+	}
+
+	return result;
+}
+
+/**
+ * Read a run of clusters straight from the image with one read.  This
+ * only works if the mapfile marks the whole run as read and none of it is
+ * in the overlay (whose copies take precedence); otherwise read the
+ * clusters one at a time.
+ *
+ * @param dd DD context struct
+ * @param buf Buffer of at least count clusters
+ * @param cluster_pos First cluster number
+ * @param count Number of clusters
+ * @return 0 on success, 1 if the run can't be read in one go, 2 on read
+ *         failure
+ */
+int read_image_run(dd_ctx *dd, unsigned char* buf, __uint64_t cluster_pos, __uint64_t count)
+{
+	__uint64_t start = CLUSTER_TO_BYTE(cluster_pos);
+	__uint64_t length = (__uint64_t)NTFS_CLUSTER_SIZE * count;
+
+	if (start + length > dd->disc_size) {
+		return 1;
+	}
+
+	safe_region_st* region = dd->safe_regions;
+
+	while (region != NULL && !(region->start <= start && region->start + region->length >= start + length)) {
+		region = region->next;
+	}
+
+	if (region == NULL) {
+		return 1;
+	}
+
+	if (dd->overlay.layer_count > 0) {
+		for (__uint64_t i = 0; i < count; i++) {
+			if (overlay_has_cluster(dd, cluster_pos + i)) {
+				return 1;
+			}
+		}
+	}
+
+	// Large reads can come back short; carry on from where they stop.
+
+	__uint64_t done = 0;
+
+	while (done < length) {
+		ssize_t result = pread(fileno(NTFS.disc), buf + done, length - done, start + done);
+
+		if (result <= 0) {
+			ERR("Read of %lu clusters at cluster %lu failed: %s\n", count, cluster_pos, (result < 0) ? strerror(errno) : "end of file");
+
+			return 2;
+		}
+
+		done += result;
+	}
+
+	return 0;
+}
+
+/**
+ * Test whether length bytes at offset in a cluster lie wholly in the
+ * sectors of mask.
+ */
+static int _sectors_good(__uint64_t mask, __uint64_t offset, __uint64_t length)
+{
+	if (length == 0) {
+		return 1;
+	}
+
+	__uint64_t first = offset / OVERLAY_SECTOR_SIZE;
+	__uint64_t last = (offset + length - 1) / OVERLAY_SECTOR_SIZE;
+
+	if (last >= 64) {
+		return 0;
+	}
+
+	__uint64_t needed = SECTOR_MASK_FULL(last - first + 1) << first;
+
+	return (mask & needed) == needed;
+}
+
 // [TODO] Detect when MFT index out of bounds, return UINT64_MAX
 
+/**
+ * Find the MFT index of a record from the cluster holding it.
+ *
+ * @param dd DD context struct
+ * @param cluster Cluster in the MFT
+ * @param mft_rec Record's position within the cluster
+ * @return MFT index (for a cluster outside the MFT, as if the cluster
+ *         followed the MFT's last one)
+ */
 __uint64_t get_mft_index(dd_ctx *dd, __uint64_t cluster, __uint8_t mft_rec) {
-	__uint64_t cluster_count = 0;
+	int count = NTFS.mft_data_run.entry_count;
 
-	for (int i = 0; i < NTFS.mft_data_run.entry_count; i++) {
-		if (cluster >= NTFS.mft_data_run.entry[i].cluster && cluster <= NTFS.mft_data_run.entry[i].cluster + NTFS.mft_data_run.entry[i].count) {
-			cluster_count += cluster - NTFS.mft_data_run.entry[i].cluster;
-			break;
+	if (NTFS.mft_run_start == NULL) {
+		return mft_rec;
+	}
+
+	// Find the last extent starting at or before cluster.
+
+	int low = 0;
+	int high = count;
+
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+
+		if (NTFS.mft_data_run.entry[NTFS.mft_run_by_cluster[mid]].cluster <= cluster) {
+			low = mid + 1;
 		} else {
-			cluster_count += NTFS.mft_data_run.entry[i].count;
+			high = mid;
 		}
 	}
 
-	return cluster_count * (NTFS_CLUSTER_SIZE / NTFS.ntfs_header.mft_size) + mft_rec;
-}
+	__uint64_t cluster_count = NTFS.mft_run_start[count];
+
+	if (low > 0) {
+		int i = NTFS.mft_run_by_cluster[low - 1];
+
+		if (cluster < NTFS.mft_data_run.entry[i].cluster + NTFS.mft_data_run.entry[i].count) {
+			cluster_count = NTFS.mft_run_start[i] + (cluster - NTFS.mft_data_run.entry[i].cluster);
+		}
+	}
 
-// [TODO] Test thoroughly, especially edge cases.
+	return cluster_count * NTFS.mft_records_per_cluster + mft_rec;
+}
 
+/**
+ * Find the cluster holding an MFT record.
+ *
+ * @param dd DD context struct
+ * @param mft_index MFT index
+ * @return Cluster, or UINT64_MAX if the index is past the end of the MFT
+ */
 __uint64_t get_mft_cluster(dd_ctx *dd, __uint64_t mft_index) {
-	__uint64_t total_count = 0;
+	int count = NTFS.mft_data_run.entry_count;
+
+	if (NTFS.mft_run_start == NULL) {
+		return UINT64_MAX;
+	}
+
+	__uint64_t mft_cluster = mft_index / NTFS.mft_records_per_cluster;
 
-	for (int i = 0; i < NTFS.mft_data_run.entry_count; i++) {
-		if (NTFS.mft_data_run.entry[i].count * 4 - 1 < mft_index - total_count) {
-//			printf("count %u, mft_index: %lu, total_count: %lu\n", mft_data_run.entry[i].count, mft_index, total_count);
-			total_count += NTFS.mft_data_run.entry[i].count * 4;
+	if (mft_cluster >= NTFS.mft_run_start[count]) {
+		return UINT64_MAX;
+	}
+
+	// Find the extent holding the cluster: the last whose start is at or
+	// before it.
+
+	int low = 0;
+	int high = count;
+
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+
+		if (NTFS.mft_run_start[mid + 1] <= mft_cluster) {
+			low = mid + 1;
 		} else {
-			return NTFS.mft_data_run.entry[i].cluster + ((mft_index - total_count) / 4);
+			high = mid;
 		}
 	}
 
-	return UINT64_MAX;
+	return NTFS.mft_data_run.entry[low].cluster + (mft_cluster - NTFS.mft_run_start[low]);
 }
 
 int bitmap_is_set(dd_ctx *dd, bitmap_st *bitmap, int pos)
@@ -358,6 +606,98 @@ int bitmap_is_set(dd_ctx *dd, bitmap_st *bitmap, int pos)
 	return bitmap->data[byte_pos] & (1 << bit_pos);
 }
 
+/**
+ * Test whether the MFT bitmap was read, so records it marks free can be
+ * skipped.
+ */
+static int _mft_bitmap_usable(dd_ctx *dd)
+{
+	return NTFS.mft_bitmap.used && NTFS.mft_bitmap.valid && NTFS.mft_bitmap.length > 0;
+}
+
+/**
+ * Read the MFT bitmap's bits for up to 64 consecutive records, a word at a
+ * time.  Records past the end of the bitmap, or any record if the bitmap
+ * couldn't be read, count as in use.
+ *
+ * @param dd DD context struct
+ * @param first_index MFT index of the first record
+ * @param count Number of records (1 to 64)
+ * @return Bit n set if record first_index + n is in use
+ */
+__uint64_t mft_bitmap_bits(dd_ctx *dd, __uint64_t first_index, int count)
+{
+	__uint64_t mask = (count >= 64) ? ~(__uint64_t)0 : ((__uint64_t)1 << count) - 1;
+
+	if (!_mft_bitmap_usable(dd)) {
+		return mask;
+	}
+
+	const unsigned char* data = (const unsigned char*)NTFS.mft_bitmap.data;
+	__uint64_t length = NTFS.mft_bitmap.length;
+
+	__uint64_t byte_pos = first_index / 8;
+	int shift = first_index % 8;
+
+	__uint64_t bits;
+
+	if (byte_pos + 9 <= length) {
+		__uint64_t high = data[byte_pos + 8];
+
+		memcpy(&bits, data + byte_pos, 8);
+
+		bits >>= shift;
+
+		if (shift > 0) {
+			bits |= high << (64 - shift);
+		}
+	} else {
+		// Near the end of the bitmap, a byte at a time.
+
+		unsigned char bytes[9];
+
+		for (int i = 0; i < 9; i++) {
+			bytes[i] = (byte_pos + i < length) ? data[byte_pos + i] : 0xff;
+		}
+
+		memcpy(&bits, bytes, 8);
+
+		bits >>= shift;
+
+		if (shift > 0) {
+			bits |= (__uint64_t)bytes[8] << (64 - shift);
+		}
+	}
+
+	return bits & mask;
+}
+
+/**
+ * Find the first record in use, by the MFT bitmap, from a given MFT index
+ * on, skipping free records 64 at a time.
+ *
+ * @param dd DD context struct
+ * @param from MFT index to start at
+ * @param end MFT index to stop at
+ * @return MFT index of the record, or end if there's none before it
+ */
+__uint64_t mft_bitmap_next(dd_ctx *dd, __uint64_t from, __uint64_t end)
+{
+	while (from < end) {
+		__uint64_t bits = mft_bitmap_bits(dd, from, 64);
+
+		if (bits != 0) {
+			from += __builtin_ctzll(bits);
+
+			return (from < end) ? from : end;
+		}
+
+		from += 64;
+	}
+
+	return end;
+}
+
 typedef struct mft_attr_header {
 	__uint32_t code;
 	__uint32_t size;
@@ -417,7 +757,7 @@ static __uint16_t _read_mft_attribute_header(dd_ctx *dd, unsigned char* cluster,
 	if (attr_header->name_size == 0) {
 		attr_header->name = NULL;
 	} else {
-		attr_header->name = (char*)malloc(attr_header->name_size * 2 + 2);
+		attr_header->name = (char*)arena_alloc(&dd->arena, attr_header->name_size * 2 + 2);
 
 		memset(attr_header->name, 0, attr_header->name_size * 2 + 2);
 		memcpy(attr_header->name, cluster + attr_pos + attr_header->name_offset, attr_header->name_size * 2);
@@ -503,7 +843,7 @@ static int _read_mft_data_run(dd_ctx* dd, unsigned char* cluster, data_run_st* d
 		int data_run_pos = initial_data_run_pos;
 
 		if (data_run_step == 1) {
-			data_run->entry = (data_run_entry*)malloc(sizeof(data_run_entry) * data_run_count);
+			data_run->entry = (data_run_entry*)arena_alloc(&dd->arena, sizeof(data_run_entry) * data_run_count);
 			data_run->entry_count = data_run_count;
 			data_run->size = data_run_size;
 
@@ -576,65 +916,142 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 {
 	//printf("Starting to read MFT at %lu", partition_offset + cluster_size * start_cluster);
 
+	arena_mark_st cluster_mark = arena_mark(&dd->arena);
+
 	unsigned char* cluster;
 
-	cluster = (unsigned char*)malloc(NTFS_CLUSTER_SIZE);
+	cluster = (unsigned char*)arena_alloc(&dd->arena, NTFS_CLUSTER_SIZE);
+
+	__uint64_t good_sectors;
 
-	if (read_cluster(dd, cluster, start_cluster) == 1) {
+	if (read_cluster_sectors(dd, cluster, start_cluster, &good_sectors) == 1 && good_sectors == 0) {
 		elog(LOG_READ_MFT_RECORD, "BAD CLUSTER %lu\n", start_cluster);
 
 		// [TODO] Exit here if unable to read cluster?
 //		return 1;
 	}
 
-	int mft_count = NTFS_CLUSTER_SIZE / NTFS_HEADER.mft_size;
+	int result = parse_mft_cluster(dd, cluster, start_cluster, good_sectors, handler, rh);
 
-	int sectors_per_mft = NTFS_HEADER.mft_size / NTFS_HEADER.bytes_per_sector;
+	arena_release(&dd->arena, cluster_mark);
+
+	return result;
+}
+
+/**
+ * Parse the MFT records in a cluster already read into memory, passing
+ * each through the callback (see read_mft_record().)  The cluster is fixed
+ * up in place.
+ *
+ * @param dd DD context struct
+ * @param cluster Cluster data
+ * @param start_cluster Cluster number
+ * @param good_sectors Sectors of the cluster that were read (see
+ *        read_cluster_sectors(); 0 to parse all of it regardless)
+ * @param handler Callback
+ * @param rh Record handler context passed to the callback (NULL for one
+ *        of its own)
+ * @return 0 on success, nonzero if any record couldn't be parsed
+ */
+int parse_mft_cluster(dd_ctx *dd, unsigned char* cluster, __uint64_t start_cluster, __uint64_t good_sectors, MFTRecordHandler handler, record_handler_ctx *rh)
+{
+	// Everything read from the cluster is allocated from dd->arena and
+	// given back when each record (or the cluster) is done with, so
+	// handlers that keep any of it must copy it (see copy_record().)
+
+	arena_mark_st cluster_mark = arena_mark(&dd->arena);
+
+	record_handler_ctx own_rh;
+
+	if (rh == NULL) {
+		memset(&own_rh, 0, sizeof(record_handler_ctx));
+
+		rh = &own_rh;
+	}
+
+	int mft_count = NTFS_CLUSTER_SIZE / NTFS_HEADER.mft_size;
 
 	__uint16_t mft_offset = 0;
 
+	int failed = 0;
+
+	__uint64_t first_index = 0;
+
+	if (dd->mft_skip_free) {
+		first_index = get_mft_index(dd, start_cluster, 0);
+	}
+
 	for (int mft_rec = 0; mft_rec < mft_count; mft_rec++) {
 
+		// Skip records the MFT bitmap marks free, when the scan asks to.
+
+		if (dd->mft_skip_free && (mft_bitmap_bits(dd, first_index + mft_rec, 1) & 1) == 0) {
+			mft_offset += NTFS_HEADER.mft_size;
+			continue;
+		}
+
 		elog(LOG_READ_MFT_RECORD, "mft rec %d cluster %lu\n", mft_rec, start_cluster);
 		if (LOG_READ_MFT_RECORD) {
 //			hexdump(cluster + mft_offset, NTFS_HEADER.mft_size);
 		}
 
-		// Find and apply fix-ups.
+		// In a partly recovered cluster, only records whose sectors were all
+		// recovered can be read.
 
-		__uint16_t fix_up_offset;
-		__uint16_t fix_up_count;
-		__uint16_t fix_up_value;
+		if (good_sectors != 0 && !_sectors_good(good_sectors, mft_offset, NTFS_HEADER.mft_size)) {
+			elog(LOG_READ_MFT_RECORD, "mft rec %d cluster %lu not recovered\n", mft_rec, start_cluster);
 
-		memcpy(&fix_up_offset, cluster + mft_offset + 4, 2);
-		memcpy(&fix_up_count, cluster + mft_offset + 6, 2);
-		memcpy(&fix_up_value, cluster + mft_offset + fix_up_offset, 2);
+			mft_offset += NTFS_HEADER.mft_size;
+			continue;
+		}
 
-		if (fix_up_count < sectors_per_mft) {
-			ERR("Failed to find expected number of fix up records at cluster %lu\n", start_cluster);
+		// Skip anything that isn't a record (never used, or marked bad.)
 
-			return 1;
+		if (memcmp(cluster + mft_offset, "FILE", 4) != 0) {
+			elog(LOG_READ_MFT_RECORD, "mft rec %d cluster %lu has no FILE signature\n", mft_rec, start_cluster);
+
+			mft_offset += NTFS_HEADER.mft_size;
+			continue;
 		}
 
-		for (int mft_sector = 0; mft_sector < sectors_per_mft; mft_sector++) {
-			if (memcmp(cluster + mft_offset + (512 * (mft_sector + 1)) - 2, &fix_up_value, 2)) {
-				ERR("Cluster %lu contains invalid fix up placeholder (bad sector?)\n", start_cluster);
+		// Find and apply fix-ups.  A record with a stride that fails is
+		// skipped; the rest of the cluster is still read.
 
-				return 1;
-			}
+		__uint64_t record_strides = SECTOR_MASK_FULL(NTFS_HEADER.mft_size / FIXUP_STRIDE);
 
-			memcpy(cluster + mft_offset + (512 * (mft_sector + 1)) - 2,
-					cluster + mft_offset + fix_up_offset + 2 + (mft_sector * 2),
-					2);
+		if (apply_fixups(cluster + mft_offset, NTFS_HEADER.mft_size, record_strides) != record_strides) {
+			ERR("MFT record %d in cluster %lu has invalid fix ups (bad sector?)\n", mft_rec, start_cluster);
+
+			failed = 1;
+
+			mft_offset += NTFS_HEADER.mft_size;
+			continue;
+		}
+
+		// Skip records the scan's filter rules out before reading anything
+		// else from them.
+
+		if (dd->mft_filter != NULL && !mft_filter_record(dd->mft_filter, cluster + mft_offset, NTFS_HEADER.mft_size)) {
+			mft_offset += NTFS_HEADER.mft_size;
+			continue;
 		}
 
 		__uint16_t mft_flags;
+		__uint16_t mft_sequence_num;
 
 		memcpy(&mft_flags, cluster + mft_offset + 22, 2);
+		memcpy(&mft_sequence_num, cluster + mft_offset + 16, 2);
+
+		arena_mark_st record_mark = arena_mark(&dd->arena);
 
 		// Fields for the callback.
 
 		char* filename[4] = { NULL, NULL, NULL, NULL };
+		__uint32_t parent_mft_index[4];
+		__uint16_t parent_sequence_num[4];
+		__uint32_t file_attributes[4];
+		record_link_st links[MFT_RECORD_MAX_LINKS];
+		int link_count = 0;
 		__uint64_t si_date_created = 0;
 		__uint64_t si_date_modified = 0;
 		__uint64_t si_date_accessed = 0;
@@ -648,15 +1065,6 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 		memset(&data_run, 0, sizeof(data_run));
 		memset(&dir_data_run, 0, sizeof(dir_data_run));
 
-
-
-		int allocated_rh = 0;
-
-		if (rh == NULL) {
-			rh = (record_handler_ctx*)malloc(sizeof(record_handler_ctx));
-			allocated_rh = 1;
-		}
-
 		memset(&(rh->bitmap), 0, sizeof(bitmap_st));
 
 
@@ -687,6 +1095,8 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 
 			if (num_attr > 20) {
 				printf("In weeds at %lu index %d\n", start_cluster, mft_rec);
+
+				arena_release(&dd->arena, cluster_mark);
 				return 1;
 			}
 
@@ -718,12 +1128,26 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 
 					name_size = cluster[attr_data_pos + 64];
 
-					filename[namespace] = (char*)malloc(name_size + 1);
+					filename[namespace] = (char*)arena_alloc(&dd->arena, name_size + 1);
 					filename[namespace][name_size] = '\0';
 
 					for (int i = 0; i < name_size; i++) {
 						filename[namespace][i] = cluster[attr_data_pos + 66 + (i * 2)];
 					}
+
+					memcpy(&parent_mft_index[namespace], cluster + attr_data_pos, 4);
+					memcpy(&parent_sequence_num[namespace], cluster + attr_data_pos + 6, 2);
+					memcpy(&file_attributes[namespace], cluster + attr_data_pos + 56, 4);
+
+					// Note every link to the file; DOS names only shadow a
+					// Win32 name in the same directory.
+
+					if (namespace != 2 && link_count < MFT_RECORD_MAX_LINKS) {
+						links[link_count].name = filename[namespace];
+						links[link_count].parent_mft_index = parent_mft_index[namespace];
+						links[link_count].parent_sequence_num = parent_sequence_num[namespace];
+						link_count++;
+					}
 				}
 
 				// Read modified date/time.
@@ -818,7 +1242,7 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 								// Mark cluster missing, indicate bitmap cannot be fully read.
 								int mft_index = get_mft_index(dd, start_cluster, mft_rec);
 
-								add_bad_cluster(dd, mft_index, bitmap_data_run.entry[i].cluster + j);
+								add_bad_index_cluster(dd, mft_index, bitmap_data_run.entry[i].cluster + j);
 								data_run_complete = 0;
 							}
 						}
@@ -835,16 +1259,21 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 
 						rh->bitmap.length = attr_header.nr_data_size;
 
-						rh->bitmap.data = (char*)malloc(rh->bitmap.length);
+						rh->bitmap.data = (char*)arena_alloc(&dd->arena, rh->bitmap.length);
 
 						int bytes_left = rh->bitmap.length;
 						int bitmap_pos = 0;
 
-						unsigned char *bitmap_cluster = (unsigned char*)malloc(NTFS_CLUSTER_SIZE);
+						unsigned char *bitmap_cluster = (unsigned char*)arena_alloc(&dd->arena, NTFS_CLUSTER_SIZE);
 
 						for (int i = 0; i < bitmap_data_run.entry_count; i++) {
 							for (__uint64_t j = 0; j < bitmap_data_run.entry[i].count; j++) {
-								read_cluster(dd, bitmap_cluster, bitmap_data_run.entry[i].cluster + j);
+								// Count the records of a cluster that can't be read as in
+								// use, so a scan skipping free records still reads them.
+
+								if (read_cluster(dd, bitmap_cluster, bitmap_data_run.entry[i].cluster + j) != 0) {
+									memset(bitmap_cluster, 0xff, NTFS_CLUSTER_SIZE);
+								}
 
 								int bytes_to_copy = NTFS_CLUSTER_SIZE;
 
@@ -858,8 +1287,6 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 							}
 						}
 
-						free(bitmap_cluster);
-
 						rh->bitmap.valid = 1;
 
 					} else {
@@ -875,7 +1302,7 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 
 					rh->bitmap.length = attr_header.r_data_size;
 
-					rh->bitmap.data = (char*)malloc(rh->bitmap.length);
+					rh->bitmap.data = (char*)arena_alloc(&dd->arena, rh->bitmap.length);
 
 					memcpy(rh->bitmap.data, cluster + attr_data_pos, rh->bitmap.length);
 				}
@@ -886,26 +1313,18 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 //			// Ensure next attr_header.code is available for while() test
 //			memcpy(&attr_header.code, cluster + mft_offset + attr_pos, 4);
 
-			if (attr_header.name != NULL) {
-				free(attr_header.name);
-				attr_header.name = NULL;
-			}
-
 			attr_data_pos = _read_mft_attribute_header(dd, cluster, &attr_header, mft_offset + attr_pos);
 		}
 
-		if (attr_header.name != NULL) {
-			free(attr_header.name);
-			attr_header.name = NULL;
-		}
-
 		// Send MFT details to callback.
 
 		char* filename_to_send = NULL;
 		int namespace_priority[4] = { 1, 0, 2, 3 };
+		int namespace_to_send = 0;
 
 		for (int i = 0; i < 4; i++) {
-			filename_to_send = filename[namespace_priority[i]];
+			namespace_to_send = namespace_priority[i];
+			filename_to_send = filename[namespace_to_send];
 
 			if (filename_to_send != NULL) {
 				break;
@@ -922,6 +1341,15 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 
 			rh->mft_index = mft_index;
 			rh->name = filename_to_send;
+			rh->flags = mft_flags;
+			rh->sequence_num = mft_sequence_num;
+
+			rh->parent_mft_index = parent_mft_index[namespace_to_send];
+			rh->parent_sequence_num = parent_sequence_num[namespace_to_send];
+			rh->attributes = file_attributes[namespace_to_send];
+
+			rh->links = links;
+			rh->link_count = link_count;
 
 			rh->date_created = si_date_created;
 			rh->date_modified = si_date_modified;
@@ -933,69 +1361,121 @@ int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handl
 			rh->dir_data_run = dir_data_run;
 
 			(*handler)(dd, rh);
+		} else {
+			// [TODO] Error, expected filename and didn't find one.
+		}
 
-			if (rh->bitmap.used == 1 && rh->bitmap.valid == 1) {
-				free(rh->bitmap.data);
-			}
+		arena_release(&dd->arena, record_mark);
 
-			if (data_run.entry_count > 0) {
-				free(data_run.entry);
+		mft_offset += NTFS_HEADER.mft_size;
+	}
 
-				data_run.entry_count = 0;
-			}
+	arena_release(&dd->arena, cluster_mark);
 
-			if (dir_data_run.entry_count > 0) {
-				free(dir_data_run.entry);
+	return failed;
+}
 
-				dir_data_run.entry_count = 0;
-			}
-		} else {
-			// [TODO] Error, expected filename and didn't find one.
-		}
+/**
+ * Copy a record passed to an MFTRecordHandler, for handlers that keep it
+ * past the call (what read_mft_record() passes is only valid during it.)
+ *
+ * @param copy Copy to fill in
+ * @param rh Record to copy
+ * @param arena Arena to allocate the copy's names, data runs and bitmap
+ *        from, or NULL to malloc() them (free with free_record_copy())
+ */
+void copy_record(record_handler_ctx* copy, const record_handler_ctx* rh, arena_st* arena)
+{
+	memcpy(copy, rh, sizeof(record_handler_ctx));
 
-		for (int i = 0; i < 4; i++) {
-			if (filename[i] != NULL) {
-				free(filename[i]);
-			}
-		}
+	size_t name_size = strlen(rh->name) + 1;
+	size_t data_run_size = sizeof(data_run_entry) * rh->data_run.entry_count;
+	size_t dir_data_run_size = sizeof(data_run_entry) * rh->dir_data_run.entry_count;
+	size_t bitmap_size = (rh->bitmap.used == 1 && rh->bitmap.valid == 1) ? rh->bitmap.length : 0;
+
+	copy->name = (arena != NULL) ? (char*)arena_alloc(arena, name_size) : (char*)malloc(name_size);
+	memcpy((char*)copy->name, rh->name, name_size);
+
+	copy->links = NULL;
+	copy->data_run.entry = NULL;
+	copy->dir_data_run.entry = NULL;
+	copy->bitmap.data = NULL;
 
-		if (allocated_rh > 0) {
-			free(rh);
+	if (rh->link_count > 0) {
+		size_t links_size = sizeof(record_link_st) * rh->link_count;
 
-			rh = NULL;
+		copy->links = (arena != NULL) ? (record_link_st*)arena_alloc(arena, links_size) : (record_link_st*)malloc(links_size);
+		memcpy(copy->links, rh->links, links_size);
+
+		for (int i = 0; i < rh->link_count; i++) {
+			size_t link_name_size = strlen(rh->links[i].name) + 1;
+
+			copy->links[i].name = (arena != NULL) ? (char*)arena_alloc(arena, link_name_size) : (char*)malloc(link_name_size);
+			memcpy((char*)copy->links[i].name, rh->links[i].name, link_name_size);
 		}
+	}
 
-		mft_offset += NTFS_HEADER.mft_size;
+	if (data_run_size > 0) {
+		copy->data_run.entry = (arena != NULL) ? (data_run_entry*)arena_alloc(arena, data_run_size) : (data_run_entry*)malloc(data_run_size);
+		memcpy(copy->data_run.entry, rh->data_run.entry, data_run_size);
 	}
 
-	return 0;
+	if (dir_data_run_size > 0) {
+		copy->dir_data_run.entry = (arena != NULL) ? (data_run_entry*)arena_alloc(arena, dir_data_run_size) : (data_run_entry*)malloc(dir_data_run_size);
+		memcpy(copy->dir_data_run.entry, rh->dir_data_run.entry, dir_data_run_size);
+	}
+
+	if (bitmap_size > 0) {
+		copy->bitmap.data = (arena != NULL) ? (char*)arena_alloc(arena, bitmap_size) : (char*)malloc(bitmap_size);
+		memcpy(copy->bitmap.data, rh->bitmap.data, bitmap_size);
+	}
+}
+
+/**
+ * Free a record copied by copy_record() without an arena.
+ */
+void free_record_copy(record_handler_ctx* copy)
+{
+	free((char*)copy->name);
+
+	for (int i = 0; i < copy->link_count; i++) {
+		free((char*)copy->links[i].name);
+	}
+
+	free(copy->links);
+	free(copy->data_run.entry);
+	free(copy->dir_data_run.entry);
+	free(copy->bitmap.data);
+
+	copy->name = NULL;
+	copy->links = NULL;
+	copy->link_count = 0;
+	copy->data_run.entry = NULL;
+	copy->dir_data_run.entry = NULL;
+	copy->bitmap.data = NULL;
 }
 
 /**
  * Walk through MFT from start to finish, passing each record through the
- * callback in mft_record_handler.
+ * callback in mft_record_handler.  Records are parsed on several threads
+ * but reach the callback one at a time, in MFT index order (see
+ * mft_scan.h.)
  *
  * @param dd DD context struct
  * @param mft_record_handler Callback function (with MFTRecordHandler
  *        interface) that will receive details of every successfully read MFT
  *        record
- * @return 0 (return could probably be made void...)
+ * @return 0 on success, nonzero if the scan couldn't be started
  */
 int read_mft(dd_ctx* dd, MFTRecordHandler mft_record_handler)
 {
 	printf("Read $MFT, entry count %u\n", NTFS.mft_data_run.entry_count);
 
-	for (int i = 0; i < NTFS.mft_data_run.entry_count; i++) {
-//		printf("Reading data run %d, cluster %lu, count %u\n", i, mft_data_run.entry[i].cluster, mft_data_run.entry[i].count);
-		for (__uint64_t j = 0; j < NTFS.mft_data_run.entry[i].count; j++) {
-			if (read_mft_record(dd, NTFS.mft_data_run.entry[i].cluster + j, mft_record_handler, NULL)) {
-				MARK_FAILED_CLUSTER(NTFS.mft_data_run.entry[i].cluster + j);
-				//return 1;
-			}
-		}
-	}
+	mft_scan_st scan;
 
-	return 0;
+	init_mft_scan(&scan, mft_record_handler, NULL);
+
+	return scan_mft(dd, &scan);
 }
 
 typedef struct restore_ntfs_st {
@@ -1004,6 +1484,10 @@ typedef struct restore_ntfs_st {
 	file_name_st* fileinfo;
 } restore_ntfs_st;
 
+// Largest run of overlay clusters copied with one read during a restore.
+
+#define RESTORE_RUN_CLUSTERS 256
+
 // [TODO] Return result in rh->result.
 /**
  * Callback function for read_mft_record() that attempts to restore a file
@@ -1038,8 +1522,50 @@ static void mft_record_handler_restore_ntfs(dd_ctx *dd, record_handler_ctx *rh)
 
 		FILE* fil = fopen(out_filename, "wb");
 
+		unsigned char* run_buf = NULL;
+
 		for (int i = 0; i < rh->data_run.entry_count; i++) {
 			for (__uint64_t j = 0; j < rh->data_run.entry[i].count; j++) {
+
+				// Copy runs of recovered clusters out of the overlay with a
+				// single read each.
+
+				__uint64_t run = 0;
+
+				if (dd->overlay.layer_count > 0) {
+					run = overlay_run_length(dd, rh->data_run.entry[i].cluster + j);
+
+					if (run > rh->data_run.entry[i].count - j) {
+						run = rh->data_run.entry[i].count - j;
+					}
+
+					if (run > RESTORE_RUN_CLUSTERS) {
+						run = RESTORE_RUN_CLUSTERS;
+					}
+				}
+
+				if (run > 1) {
+					if (run_buf == NULL) {
+						run_buf = (unsigned char*)malloc(NTFS_CLUSTER_SIZE * RESTORE_RUN_CLUSTERS);
+					}
+
+					if (read_run_from_overlay(dd, run_buf, rh->data_run.entry[i].cluster + j, run) == 0) {
+						__uint64_t size = run * NTFS_CLUSTER_SIZE;
+
+						if (rh->data_run.size - num_written < size) {
+							size = rh->data_run.size - num_written;
+						}
+
+						fwrite(run_buf, size, 1, fil);
+
+						num_written += size;
+
+						j += run - 1;
+
+						continue;
+					}
+				}
+
 				if (read_cluster(dd, cluster, rh->data_run.entry[i].cluster + j)) {
 					printf("BAD CLUSTER IN RESTORE\n");
 					MARK_FAILED_CLUSTER(rh->data_run.entry[i].cluster + j);
@@ -1060,6 +1586,8 @@ static void mft_record_handler_restore_ntfs(dd_ctx *dd, record_handler_ctx *rh)
 			}
 		}
 
+		free(run_buf);
+
 		fclose(fil);
 
 		struct utimbuf ut;
@@ -1095,6 +1623,16 @@ int restore_ntfs(dd_ctx* dd, const char* path, file_name_st* file)
 
 	rh.param = &param;
 
+	// Take the record from the catalog when there is one.
+
+	if (catalog_record(dd, file->id, &rh) == 0) {
+		mft_record_handler_restore_ntfs(dd, &rh);
+
+		free(param.filename);
+
+		return 0;
+	}
+
 	// [TODO] Verify cluster exists from get_mft_cluster.
 
 	read_mft_record(dd, get_mft_cluster(dd, file->id), &mft_record_handler_restore_ntfs, &rh);
@@ -1108,19 +1646,24 @@ int read_dir_cluster(dd_ctx* dd, file_name_st** files, __uint64_t* dir_pos, bitm
 	// be smaller (like with MFT entries.)
 
 	int index_record_size = NTFS_CLUSTER_SIZE;
-	int sectors_per_entry = index_record_size / NTFS_HEADER.bytes_per_sector;
 
 	unsigned char* cluster;
 
 	cluster = (unsigned char*)malloc(NTFS_CLUSTER_SIZE);
 
-	if (read_cluster(dd, cluster, cluster_pos)) {
-		// Unable to read directory cluster
+	__uint64_t good_sectors;
 
-		add_bad_cluster(dd, mft_index, cluster_pos);
+	if (read_cluster_sectors(dd, cluster, cluster_pos, &good_sectors)) {
+		// Unable to read all of directory cluster.  It stays on the bad
+		// cluster list so the rest can be recovered, but if its header was
+		// recovered, the entries in the sectors that were can be read.
 
-		free(cluster);
-		return 1;
+		add_bad_index_cluster(dd, mft_index, cluster_pos);
+
+		if (!(good_sectors & 1)) {
+			free(cluster);
+			return 1;
+		}
 	}
 
 	if (memcmp(cluster, "INDX", 4) != 0) {
@@ -1130,34 +1673,22 @@ int read_dir_cluster(dd_ctx* dd, file_name_st** files, __uint64_t* dir_pos, bitm
 		return 1;
 	}
 
-	// Find and apply fix-ups.
+	// Find and apply fix-ups.  Entries in strides that fail are treated
+	// like those in sectors that weren't recovered.
 
-	__uint16_t fix_up_offset;
-	__uint16_t fix_up_count;
-	__uint16_t fix_up_value;
+	__uint64_t fixed = apply_fixups(cluster, index_record_size, good_sectors);
 
-	memcpy(&fix_up_offset, cluster + 4, 2);
-	memcpy(&fix_up_count, cluster + 6, 2);
-	memcpy(&fix_up_value, cluster + fix_up_offset, 2);
-
-	if (fix_up_count < sectors_per_entry) {
+	if (fixed == 0) {
 		ERR("Failed to find expected number of fix up records at cluster %lu\n", cluster_pos);
 
 		free(cluster);
 		return 1;
 	}
 
-	for (int index_sector = 0; index_sector < sectors_per_entry; index_sector++) {
-		if (memcmp(cluster + (512 * (index_sector + 1)) - 2, &fix_up_value, 2)) {
-			ERR("Cluster %lu contains invalid fix up placeholder (bad sector?)\n", cluster_pos);
-
-			free(cluster);
-			return 1;
-		}
+	if (fixed != good_sectors) {
+		ERR("Cluster %lu contains invalid fix up placeholder (bad sector?)\n", cluster_pos);
 
-		memcpy(cluster + (512 * (index_sector + 1)) - 2,
-				cluster + fix_up_offset + 2 + (index_sector * 2),
-				2);
+		good_sectors = fixed;
 	}
 
 	__uint32_t index_values_offset;
@@ -1176,6 +1707,11 @@ int read_dir_cluster(dd_ctx* dd, file_name_st** files, __uint64_t* dir_pos, bitm
 		__uint16_t index_value_size;
 		__uint16_t index_entry_flags;
 
+		if (!_sectors_good(good_sectors, index_values_offset, 16)) {
+			// Rest of entries lie in sectors not recovered.
+			break;
+		}
+
 		memcpy(&file_mft_index, cluster + index_values_offset, 4);
 		memcpy(&file_sequence_number, cluster + index_values_offset + 6, 2);
 		memcpy(&index_entry_size, cluster + index_values_offset + 8, 2);
@@ -1218,6 +1754,10 @@ int read_dir_cluster(dd_ctx* dd, file_name_st** files, __uint64_t* dir_pos, bitm
 		}
 
 
+		if (!_sectors_good(good_sectors, index_values_offset, index_entry_size)) {
+			break;
+		}
+
 		ntfs_file_name_st file_name;
 
 		_read_file_name(dd, cluster, &file_name, index_values_offset + 16);
@@ -1283,6 +1823,8 @@ int read_dir_cluster(dd_ctx* dd, file_name_st** files, __uint64_t* dir_pos, bitm
 		current_file->date_created = file_name.date_created;
 		current_file->date_modified = file_name.date_modified;
 
+		current_file->filesize = file_name.filesize;
+
 		// Add record to hash table if new.
 
 		if (new_hash_entry) {
@@ -1343,6 +1885,10 @@ static void mft_record_handler_read_dir(dd_ctx *dd, record_handler_ctx *rh)
 
 NTFS_DIR* open_dir(dd_ctx* dd, __uint64_t mft_index)
 {
+	if (dd->catalog != NULL) {
+		return catalog_open_dir(dd, mft_index);
+	}
+
 	record_handler_ctx rh;
 	memset(&rh, 0, sizeof(record_handler_ctx));
 
@@ -1473,6 +2019,12 @@ int data_run_complete(dd_ctx* dd, __uint64_t mft_index)
 		//printf("CLUSTER %lu UNSAFE\n", cluster_pos);
 	}
 
+	if (catalog_record(dd, mft_index, &rh) == 0) {
+		mft_record_handler_data_run_check(dd, &rh);
+
+		return complete;
+	}
+
 	read_mft_record(dd, cluster_pos, &mft_record_handler_data_run_check, &rh);
 
 	return complete;
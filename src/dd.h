@@ -34,6 +34,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <uthash-master/utarray.h>
 
 #include "reader.h"
+#include "arena.h"
 
 
 typedef struct data_run_entry {
@@ -94,6 +95,12 @@ typedef struct ntfs_struct {
 
 	data_run_st mft_data_run;
 
+	// Lookups over mft_data_run, set up by open_ntfs().
+
+	__uint64_t mft_records_per_cluster;
+	__uint64_t* mft_run_start; // MFT clusters before each extent, then the total
+	int* mft_run_by_cluster; // Extents in order of position on disc
+
 	bitmap_st mft_bitmap;
 } ntfs_st;
 
@@ -113,8 +120,12 @@ typedef struct failed_cluster_st {
 
 // New bad cluster tracker
 
+#define BAD_CLUSTER_DATA 0
+#define BAD_CLUSTER_INDEX 1 // Directory index (INDX) or index bitmap
+
 typedef struct bad_cluster_st {
 	__uint64_t id; // cluster
+	int kind; // BAD_CLUSTER_* (global list only)
 
 	UT_hash_handle hh;
 } bad_cluster_st;
@@ -130,21 +141,71 @@ typedef struct bad_cluster_by_mft_index_st {
 
 // Overlay
 
-typedef struct cluster_index_st {
-	__uint64_t id; // cluster number
-	__uint64_t file_pos; // position of cluster in overlay
+typedef struct overlay_extent_st {
+	__uint64_t start; // first cluster number
+	__uint64_t count; // number of clusters
+	__uint64_t file_pos; // position of first cluster in overlay
+	int layer; // overlay layer holding the clusters (merged index only)
+} overlay_extent_st;
+
+typedef struct extent_list_st {
+	overlay_extent_st* extent; // Sorted by start cluster, never overlapping.
+	__uint64_t count;
+	__uint64_t alloc;
+} extent_list_st;
+
+// Clusters recovered only in part are kept apart from whole ones, with a
+// mask of the 512-byte sectors that were read (bit n for sector n, so
+// clusters of up to 64 sectors.)
+
+#define OVERLAY_SECTOR_SIZE 512
+
+#define SECTOR_MASK_FULL(sectors) ((sectors) >= 64 ? ~(__uint64_t)0 : ((__uint64_t)1 << (sectors)) - 1)
+
+typedef struct partial_cluster_st {
+	__uint64_t id; // cluster
+	__uint64_t mask; // sectors read
+	__uint64_t file_pos; // position of the cluster's record in the partial file
 
 	UT_hash_handle hh;
-} cluster_index_st;
+} partial_cluster_st;
+
+typedef struct overlay_layer_st {
+	char* name;
+	int frozen; // Read-only snapshot; recoveries go to a layer above it.
 
-typedef struct overlay_ctx_st {
 	FILE* overlay_file;
 
 	char* overlay_filename;
 	char* index_filename;
 	char* index_tmp_filename;
+	char* frozen_filename;
+	char* crc_filename;
+	char* partial_filename;
+
+	extent_list_st index;
+
+	FILE* crc_file;
+	__uint32_t* crc; // CRC32C of each cluster, in overlay file order.
+	__uint64_t crc_count;
+	__uint64_t crc_alloc;
+
+	FILE* partial_file; // Opened on first use
+	partial_cluster_st* partial;
+} overlay_layer_st;
+
+typedef struct overlay_ctx_st {
+	overlay_layer_st* layers; // Bottom layer first; the last layer is the top.
+	int layer_count;
+
+	extent_list_st index; // Topmost copy of every cluster across all layers.
+
+	int no_verify; // Skip checksum verification of clusters read from the overlay.
 
-	cluster_index_st *index;
+	int scrub_layer; // Position of scrub_overlay() between calls.
+	__uint64_t scrub_slot;
+
+	struct overlay_writer_st* writer; // Set while an overlay writer is running.
 } overlay_ctx;
 
 
@@ -174,6 +235,15 @@ typedef struct dd_ctx {
 
 	overlay_ctx overlay;
 	reader_ctx reader;
+
+	struct recovery_ctx_st* recovery; // Set between init_recovery() and cleanup_recovery().
+
+	struct mft_catalog_st* catalog; // Set by build_catalog().
+
+	const struct mft_filter_st* mft_filter; // Records parse_mft_cluster() passes on (NULL for all); set by scan_mft()
+	int mft_skip_free; // parse_mft_cluster() skips records the MFT bitmap marks free; set by scan_mft()
+
+	arena_st arena; // Scratch memory for read_mft_record()
 } dd_ctx;
 
 
@@ -206,9 +276,34 @@ typedef struct dd_ctx {
 	dd->failed_cluster_pos->cluster = cluster_fail; \
 	dd->failed_cluster_pos->next = NULL;
 
+// One of a record's $FILE_NAME attributes; a file hard linked from
+// several directories has one per link.
+
+typedef struct record_link_st {
+	const char* name;
+	__uint32_t parent_mft_index;
+	__uint16_t parent_sequence_num;
+} record_link_st;
+
+// Most $FILE_NAME attributes listed for one record.
+
+#define MFT_RECORD_MAX_LINKS 16
+
 typedef struct record_handler_ctx {
 	__uint64_t mft_index;
 	const char* name;
+	__uint16_t flags; // Record header flags (MFT_RECORD_*)
+	__uint16_t sequence_num; // Record header's sequence number
+
+	__uint32_t parent_mft_index; // From the $FILE_NAME name was taken from
+	__uint16_t parent_sequence_num;
+	__uint32_t attributes;
+
+	// Every $FILE_NAME other than DOS names, including the one name was
+	// taken from.
+
+	record_link_st* links;
+	int link_count;
 
 	__uint64_t date_created;
 	__uint64_t date_modified;
@@ -225,6 +320,9 @@ typedef struct record_handler_ctx {
 	void* result;
 } record_handler_ctx;
 
+#define MFT_RECORD_IN_USE 0x0001
+#define MFT_RECORD_DIRECTORY 0x0002
+
 typedef void (*MFTRecordHandler)(dd_ctx *dd, record_handler_ctx *rh);
 
 /* Hash table stuff for handling directories */
@@ -244,6 +342,8 @@ typedef struct file_name_st {
 	__uint64_t date_created;
 	__uint64_t date_modified;
 
+	__uint64_t filesize;
+
 	int deleted;
 
 	__uint32_t attributes;
@@ -269,6 +369,9 @@ int cleanup_dd(dd_ctx* dd);
 
 int open_ntfs(dd_ctx* dd, const char *filename, __uint64_t partition_offset);
 int read_mft_record(dd_ctx *dd, __uint64_t start_cluster, MFTRecordHandler handler, record_handler_ctx *rh);
+int parse_mft_cluster(dd_ctx *dd, unsigned char* cluster, __uint64_t start_cluster, __uint64_t good_sectors, MFTRecordHandler handler, record_handler_ctx *rh);
+void copy_record(record_handler_ctx* copy, const record_handler_ctx* rh, arena_st* arena);
+void free_record_copy(record_handler_ctx* copy);
 int read_mft(dd_ctx* dd, MFTRecordHandler record_handler);
 int restore_ntfs(dd_ctx* dd, const char* path, file_name_st* file);
 
@@ -281,5 +384,13 @@ void close_ntfs(dd_ctx* dd);
 
 int read_cluster(dd_ctx *dd, unsigned char* cluster, __uint64_t cluster_pos);
 
+int read_cluster_sectors(dd_ctx *dd, unsigned char* cluster, __uint64_t cluster_pos, __uint64_t* mask);
+int cluster_in_image(dd_ctx *dd, __uint64_t cluster_pos);
+int read_image_run(dd_ctx *dd, unsigned char* buf, __uint64_t cluster_pos, __uint64_t count);
+
+__uint64_t get_mft_index(dd_ctx *dd, __uint64_t cluster, __uint8_t mft_rec);
+__uint64_t mft_bitmap_bits(dd_ctx *dd, __uint64_t first_index, int count);
+__uint64_t mft_bitmap_next(dd_ctx *dd, __uint64_t from, __uint64_t end);
+
 int data_run_complete(dd_ctx* dd, __uint64_t mft_index);
 
@@ -0,0 +1,472 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+
+#include "device_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define IO_IDLE 0
+#define IO_QUEUED 1
+#define IO_DONE 2
+#define IO_STOP 3
+
+#define ERR(...) \
+	snprintf(reader->error_msg, 4096, __VA_ARGS__);
+
+static void _free_io_thread(device_io_thread_st* io)
+{
+	if (io->fd != -1) {
+		close(io->fd);
+	}
+
+	pthread_mutex_destroy(&io->lock);
+	pthread_cond_destroy(&io->cond);
+
+	free(io);
+}
+
+static int _pread_full(int fd, unsigned char* buf, off_t offset, size_t length)
+{
+	size_t done = 0;
+
+	while (done < length) {
+		ssize_t result = pread(fd, buf + done, length - done, offset + done);
+
+		if (result == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return errno;
+		}
+
+		if (result == 0) {
+			return EIO;
+		}
+
+		done += result;
+	}
+
+	return 0;
+}
+
+static void* _io_thread(void* param)
+{
+	device_io_thread_st* io = (device_io_thread_st*)param;
+
+	pthread_mutex_lock(&io->lock);
+
+	while (1) {
+		while (io->state != IO_QUEUED && io->state != IO_STOP) {
+			pthread_cond_wait(&io->cond, &io->lock);
+		}
+
+		if (io->state == IO_STOP) {
+			break;
+		}
+
+		unsigned char* buf = io->buf;
+		off_t offset = io->offset;
+		size_t length = io->length;
+
+		pthread_mutex_unlock(&io->lock);
+
+		int error;
+
+		struct sense_info_t sense;
+
+		memset(&sense, 0, sizeof(struct sense_info_t));
+
+		if (io->source != NULL) {
+			error = io->source->read(io->source, buf, offset, length, &sense);
+		} else {
+			error = _pread_full(io->fd, buf, offset, length);
+		}
+
+		pthread_mutex_lock(&io->lock);
+
+		if (io->abandoned) {
+			// Nobody is waiting any more; the buffer and the thread are
+			// ours to free.
+
+			pthread_mutex_unlock(&io->lock);
+
+			free(buf);
+			_free_io_thread(io);
+
+			return NULL;
+		}
+
+		io->result = error ? -1 : 0;
+		io->error = error;
+		io->sense = sense;
+		io->state = IO_DONE;
+
+		pthread_cond_broadcast(&io->cond);
+	}
+
+	pthread_mutex_unlock(&io->lock);
+
+	return NULL;
+}
+
+static device_io_thread_st* _start_io_thread(device_reader_st* reader)
+{
+	device_io_thread_st* io = (device_io_thread_st*)malloc(sizeof(device_io_thread_st));
+
+	memset(io, 0, sizeof(device_io_thread_st));
+
+	io->fd = -1;
+	io->source = reader->source;
+
+	if (io->source == NULL) {
+		io->fd = dup(reader->fd);
+	}
+
+	if (io->source == NULL && io->fd == -1) {
+		ERR("Unable to dup() device descriptor: %s\n", strerror(errno));
+
+		free(io);
+
+		return NULL;
+	}
+
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->cond, &attr);
+
+	pthread_condattr_destroy(&attr);
+
+	io->state = IO_IDLE;
+
+	if (pthread_create(&io->thread, NULL, &_io_thread, io)) {
+		ERR("Unable to start device I/O thread\n");
+
+		_free_io_thread(io);
+
+		return NULL;
+	}
+
+	return io;
+}
+
+/**
+ * Open the device and start an I/O thread.
+ *
+ * @param reader Reader to initialize
+ * @param device Device to read from
+ * @param buf_size Size of the largest read (and of device_reader_alloc()
+ *                 buffers)
+ * @param timeout Seconds before a read is abandoned (0 or less for 30)
+ * @return 0 on success, nonzero on failure (reader->error_msg set)
+ */
+int start_device_reader(device_reader_st* reader, const char* device, size_t buf_size, double timeout)
+{
+	memset(reader, 0, sizeof(device_reader_st));
+
+	reader->buf_size = buf_size;
+	reader->timeout = (timeout > 0) ? timeout : 30;
+
+	// Not every filesystem takes O_DIRECT (image files on tmpfs, for one);
+	// fall back to cached reads.
+
+	reader->direct = 1;
+	reader->fd = open(device, O_RDONLY | O_DIRECT);
+
+	if (reader->fd == -1 && errno == EINVAL) {
+		reader->direct = 0;
+		reader->fd = open(device, O_RDONLY);
+	}
+
+	if (reader->fd == -1) {
+		ERR("Unable to open %s: %s\n", device, strerror(errno));
+
+		return 1;
+	}
+
+	// Image files don't have a logical sector size.
+
+	int sector_size;
+
+	reader->sector_size = 512;
+
+	if (ioctl(reader->fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0) {
+		reader->sector_size = sector_size;
+	}
+
+	reader->io = _start_io_thread(reader);
+
+	if (reader->io == NULL) {
+		close(reader->fd);
+
+		return 2;
+	}
+
+	reader->dev = (char*)malloc(strlen(device) + 1);
+	strcpy(reader->dev, device);
+
+	return 0;
+}
+
+/**
+ * Start an I/O thread reading from a block source rather than a device.
+ * The source must outlive any parked I/O threads.
+ *
+ * @param reader Reader to initialize
+ * @param source Block source
+ * @param buf_size Size of the largest read
+ * @param timeout Seconds before a read is abandoned (0 or less for 30)
+ * @return 0 on success, nonzero on failure (reader->error_msg set)
+ */
+int start_device_reader_source(device_reader_st* reader, block_source_st* source, size_t buf_size, double timeout)
+{
+	memset(reader, 0, sizeof(device_reader_st));
+
+	reader->buf_size = buf_size;
+	reader->timeout = (timeout > 0) ? timeout : 30;
+
+	reader->fd = -1;
+	reader->source = source;
+	reader->sector_size = 512;
+
+	reader->io = _start_io_thread(reader);
+
+	if (reader->io == NULL) {
+		return 2;
+	}
+
+	return 0;
+}
+
+/**
+ * Allocate a buffer suitably aligned for the device, buf_size bytes long.
+ *
+ * @param reader Device reader
+ * @return Buffer to free() when done, or NULL on failure
+ */
+unsigned char* device_reader_alloc(device_reader_st* reader)
+{
+	void* buf;
+
+	if (posix_memalign(&buf, DEVICE_READ_ALIGN, reader->buf_size)) {
+		return NULL;
+	}
+
+	return (unsigned char*)buf;
+}
+
+/**
+ * Seconds on the clock the reader times reads by: the block source's if it
+ * keeps one, else the host's.  Only the difference between two readings
+ * means anything.
+ *
+ * @param reader Device reader
+ * @return Seconds
+ */
+double device_reader_time(device_reader_st* reader)
+{
+	if (reader->source != NULL && reader->source->clock != NULL) {
+		return reader->source->clock(reader->source);
+	}
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Read from the device, waiting no longer than the reader's timeout.
+ *
+ * If the read times out, the parked I/O thread keeps *buf (it may yet be
+ * written to) and *buf is replaced with a new buffer from
+ * device_reader_alloc().
+ *
+ * @param reader Device reader
+ * @param buf Aligned buffer to read into (may be replaced, see above)
+ * @param offset Device offset (a multiple of the sector size)
+ * @param length Bytes to read (a multiple of the sector size)
+ * @return 0 on success, -1 on a read error (errno set), -2 on timeout
+ *         (errno set to ETIMEDOUT), -3 if a replacement buffer or I/O
+ *         thread couldn't be had (reader->error_msg set; a missing I/O
+ *         thread is started again by the next read)
+ */
+int device_read(device_reader_st* reader, unsigned char** buf, off_t offset, size_t length)
+{
+	// A timed out read may have failed to start the thread replacing it.
+
+	if (reader->io == NULL) {
+		reader->io = _start_io_thread(reader);
+
+		if (reader->io == NULL) {
+			return -3;
+		}
+	}
+
+	device_io_thread_st* io = reader->io;
+
+	// A source with its own clock times the read out itself, on that clock
+	// (see block_source.h), so a simulated freeze costs simulated time.
+
+	int own_deadline = (reader->source == NULL || reader->source->clock == NULL);
+
+	if (!own_deadline) {
+		reader->source->timeout = reader->timeout;
+	}
+
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	deadline.tv_sec += (time_t)reader->timeout;
+	deadline.tv_nsec += (long)((reader->timeout - (time_t)reader->timeout) * 1e9);
+
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	reader->reads++;
+
+	pthread_mutex_lock(&io->lock);
+
+	io->buf = *buf;
+	io->offset = offset;
+	io->length = length;
+	io->state = IO_QUEUED;
+
+	pthread_cond_broadcast(&io->cond);
+
+	while (io->state != IO_DONE) {
+		if (!own_deadline) {
+			pthread_cond_wait(&io->cond, &io->lock);
+		} else if (pthread_cond_timedwait(&io->cond, &io->lock, &deadline) == ETIMEDOUT && io->state != IO_DONE) {
+			break;
+		}
+	}
+
+	if (io->state == IO_DONE) {
+		int result = io->result;
+		int error = io->error;
+
+		reader->sense = io->sense;
+
+		io->state = IO_IDLE;
+
+		pthread_mutex_unlock(&io->lock);
+
+		if (!own_deadline && error == ETIMEDOUT) {
+			reader->timeouts++;
+
+			result = -2;
+		}
+
+		errno = error;
+
+		return result;
+	}
+
+	// Give up on the request and park the thread.  It frees itself, the
+	// buffer and its descriptor if the read ever returns.
+
+	io->abandoned = 1;
+
+	pthread_mutex_unlock(&io->lock);
+
+	memset(&reader->sense, 0, sizeof(struct sense_info_t));
+
+	pthread_detach(io->thread);
+
+	reader->timeouts++;
+
+	reader->io = _start_io_thread(reader);
+
+	*buf = device_reader_alloc(reader);
+
+	if (*buf == NULL) {
+		ERR("Unable to allocate read buffer\n");
+
+		return -3;
+	}
+
+	if (reader->io == NULL) {
+		return -3;
+	}
+
+	errno = ETIMEDOUT;
+
+	return -2;
+}
+
+/**
+ * Stop the current I/O thread and close the device.  Parked threads are left
+ * to finish (or not) on their own.
+ *
+ * @param reader Device reader
+ */
+void stop_device_reader(device_reader_st* reader)
+{
+	device_io_thread_st* io = reader->io;
+
+	if (io != NULL) {
+		pthread_mutex_lock(&io->lock);
+
+		io->state = IO_STOP;
+
+		pthread_cond_broadcast(&io->cond);
+		pthread_mutex_unlock(&io->lock);
+
+		pthread_join(io->thread, NULL);
+
+		_free_io_thread(io);
+
+		reader->io = NULL;
+	}
+
+	if (reader->fd != -1) {
+		close(reader->fd);
+
+		reader->fd = -1;
+	}
+
+	free(reader->dev);
+
+	reader->dev = NULL;
+}
@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "block_source.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+
+// Reads from the device on a separate I/O thread so a read that never comes
+// back can't hang recovery.  Each read has a deadline; when it passes, the
+// request is abandoned, the thread left waiting in the kernel is parked
+// (detached, keeping the request's buffer and its own descriptor) and a new
+// I/O thread takes over.  The device is opened with O_DIRECT where
+// possible, so reads bypass the page cache and buffers must be aligned.
+// Reads can come from a block source instead of a device.
+
+#define DEVICE_READ_ALIGN 4096
+
+typedef struct device_io_thread_st {
+	pthread_t thread;
+
+	pthread_mutex_t lock; // Guards everything below
+	pthread_cond_t cond;
+
+	int fd; // Own descriptor, closed by whoever frees the thread (-1 with a source)
+	block_source_st* source;
+
+	int state; // IO_IDLE, IO_QUEUED, IO_DONE or IO_STOP (device_reader.c)
+	int abandoned; // Set by the reader when the deadline passes
+
+	unsigned char* buf;
+	off_t offset;
+	size_t length;
+
+	int result;
+	int error; // errno on failure
+	struct sense_info_t sense; // From a block source
+} device_io_thread_st;
+
+typedef struct device_reader_st {
+	char* dev;
+	int fd;
+	int direct; // Opened with O_DIRECT
+
+	block_source_st* source; // Read from this instead of dev (if set)
+
+	size_t buf_size; // Size of replacement buffers (see device_read())
+	double timeout; // Seconds before a read is abandoned
+	size_t sector_size; // Smallest read the device takes
+
+	device_io_thread_st* io; // Current I/O thread
+
+	struct sense_info_t sense; // Last read's sense data (block sources only)
+
+	__uint64_t reads;
+	__uint64_t timeouts; // Reads abandoned, and threads parked (or timed out by the source)
+
+	char error_msg[4096];
+} device_reader_st;
+
+int start_device_reader(device_reader_st* reader, const char* device, size_t buf_size, double timeout);
+
+int start_device_reader_source(device_reader_st* reader, block_source_st* source, size_t buf_size, double timeout);
+
+unsigned char* device_reader_alloc(device_reader_st* reader);
+
+double device_reader_time(device_reader_st* reader);
+
+int device_read(device_reader_st* reader, unsigned char** buf, off_t offset, size_t length);
+
+void stop_device_reader(device_reader_st* reader);
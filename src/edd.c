@@ -29,7 +29,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "mapfile.h"
 #include "reader.h"
 #include "overlay.h"
+#include "recover.h"
+#include "scheduler.h"
+#include "priority.h"
+#include "planner.h"
 #include "badclusters.h"
+#include "catalog.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -214,7 +219,7 @@ void dump_failed_clusters(dd_ctx *dd)
 	printf("%lX - %lX\n", 0x346500000 + (first * cluster_size), 0x346500000 + (last * cluster_size));
 }
 
-void walk_dir(dd_ctx* dd, __uint32_t mft_index, const char* path) {
+void walk_dir(dd_ctx* dd, priority_ctx* prio, __uint32_t mft_index, const char* path) {
 	NTFS_DIR* dir = open_dir(dd, mft_index);
 	NTFS_FILE* file;
 
@@ -226,7 +231,10 @@ void walk_dir(dd_ctx* dd, __uint32_t mft_index, const char* path) {
 
 	while (file = read_dir_file(dd, dir)) {
 		if (file->attributes & 0x10000000) {
-			if (strcmp(file->ascii_name, ".") && strcmp(file->ascii_name, "..")) {
+			// Deleted directories aren't walked; their records may since
+			// have been reused for something else.
+
+			if (!file->deleted && strcmp(file->ascii_name, ".") && strcmp(file->ascii_name, "..")) {
 				//printf("GOING TO WALK %s\n", file->ascii_name);
 
 				char* new_path = (char*)malloc(strlen(path) + strlen(file->ascii_name) + 2);
@@ -243,7 +251,7 @@ void walk_dir(dd_ctx* dd, __uint32_t mft_index, const char* path) {
 				utime(new_path, &ut);
 
 
-				walk_dir(dd, file->id, new_path);
+				walk_dir(dd, prio, file->id, new_path);
 
 				free(new_path);
 			}
@@ -255,6 +263,8 @@ void walk_dir(dd_ctx* dd, __uint32_t mft_index, const char* path) {
 		if (!file->deleted) {
 			printf("%s%10d | %s\n", is_dir, file->id, file->ascii_name);
 
+			rank_file(prio, path, file);
+
 			if (!(file->attributes & 0x10000000)) {
 				restore_ntfs(dd, path, file);
 			}
@@ -314,6 +324,15 @@ int main() {
 
 	open_overlay(&dd, "../data/overlay");
 
+	// Later passes go in their own layers above earlier ones, e.g.:
+	//
+	// freeze_overlay_layer(&dd, 0);
+	// push_overlay_layer(&dd, "../data/overlay-pass2", "pass 2");
+
+	// Check every overlay cluster against its stored checksum:
+	//
+	// printf("%ld overlay clusters failed verification\n", verify_overlay(&dd));
+
 	//recover_to_overlay(&dd, "/dev/sdc", 36874441, 1);
 
 //	unsigned char cluster[4096];
@@ -323,58 +342,143 @@ int main() {
 //	printf("%s", dd.error_msg);
 //	hexdump(cluster, 4096);
 
-	walk_dir(&dd, 167, "/tmp/ernie/Users/Ernie/");
+	// Read the whole MFT once up front; the walk below then lists
+	// directories and restores files without going back to it.  The same
+	// scan notes the clusters every file is missing and lists every record.
+	// Later runs load the saved catalog, reading again only MFT clusters
+	// recovered since.
+
+	if (load_catalog(&dd, "../data/catalog") != 0) {
+		mft_pipeline_st pipeline;
+
+		init_mft_pipeline(&pipeline);
+
+		if (add_catalog_stage(&dd, &pipeline) == 0) {
+			add_bad_cluster_stage(&dd, &pipeline);
+			add_mft_stage(&pipeline, &mft_record_handler, NULL, NULL);
+
+			if (run_mft_pipeline(&dd, &pipeline)) {
+				printf("%s", dd.error_msg);
+			}
+		}
+
+		cleanup_mft_pipeline(&pipeline);
+	}
+
+	if (dd.catalog != NULL && dd.catalog->dirty && save_catalog(&dd, "../data/catalog")) {
+		printf("%s", dd.error_msg);
+	}
+
+	priority_ctx prio;
+
+	init_priorities(&prio);
+
+	// Files to recover ahead of the rest, e.g.:
+	//
+	// recovery_criteria_st criteria = { .extension = "xls", .path_prefix = "/tmp/ernie/Users/Ernie/Documents/", .priority = 10 };
+	//
+	// add_recovery_criteria(&prio, &criteria);
+
+	walk_dir(&dd, &prio, 167, "/tmp/ernie/Users/Ernie/");
 //
 	dump_bad_clusters(&dd);
 
 	// Attempt to rescue bad clusters
 
-	bad_cluster_st *current_bad_cluster;
-	bad_cluster_st *bad_cluster_tmp;
-
 	dd.error_msg[0] = '\0';
 
-	HASH_ITER(hh, dd.bad_clusters, current_bad_cluster, bad_cluster_tmp) {
-		printf("Recovering %lu", current_bad_cluster->id);
-//		if (current_bad_cluster->id * 4096 > 0x57D0000000) {
-			if (recover_to_overlay(&dd, "/dev/sdc", current_bad_cluster->id, 1)) {
-				printf("%s", dd.error_msg);
-				save_index(&dd);
-				close_overlay(&dd);
-				close_ntfs(&dd);
-				cleanup_dd(&dd);
-				exit(0);
-			}
-//		}
+	scheduler_ctx sched;
+
+	init_scheduler(&sched);
+
+//	sched.time_budget = 4 * 3600;
+
+	// Recover in the order that completes the most files soonest.  (Or,
+	// by priority alone: scheduler_add_bad_clusters(&dd, &sched, &prio);)
+
+	planner_ctx planner;
+
+	init_planner(&dd, &planner, &prio);
+	build_plan(&planner);
+	print_yield_curve(&planner, 20);
+
+	scheduler_add_plan(&dd, &sched, &planner);
+
+	// Pick up where the last run left off.
+
+	journal_st journal;
+
+	if (open_journal(&journal, "../data/overlay.jnl")) {
+		printf("%s", journal.error_msg);
+	} else {
+		scheduler_apply_journal(&sched, &journal);
 	}
 
-	save_index(&dd);
+	// Every device read is logged.  Zones the log shows to be slow or
+	// failing are left for the scheduler's later passes.
 
-	close_overlay(&dd);
+	telemetry_summary_st summary;
 
-	close_ntfs(&dd);
+	if (summarize_telemetry("../data/overlay.tel", 1 << 30, &summary, dd.line_error_msg) == 0) {
+		print_telemetry_summary(&summary);
 
+		scheduler_avoid_slow_zones(&dd, &sched, &summary, 0.5, 0.5);
 
-	cleanup_dd(&dd);
+		cleanup_telemetry_summary(&summary);
+	}
 
-	exit(0);
+	// Scheduler settings can be tried out first against a simulated
+	// failing drive built from a good image, recovering into a scratch
+	// overlay, e.g.:
+	//
+	// benchmark_scheduler(&dd, &sched, "../data/good.img", "../data/faults.txt", 1, 120, NULL);
 
+	telemetry_st tel;
 
+	if (open_telemetry(&tel, "../data/overlay.tel")) {
+		printf("Unable to open telemetry log\n");
+	}
 
+	// A read that hasn't come back in 30 seconds is abandoned.
 
-	if (read_mft(&dd, &mft_record_handler)) {
+	if (init_recovery(&dd, HDD, sched.range_clusters, 30)) {
 		printf("%s", dd.error_msg);
+	} else {
+		dd.recovery->telemetry = &tel;
 
-		close_ntfs(&dd);
+		if (run_scheduler(&dd, &sched) > 1) {
+			printf("%s", dd.error_msg);
+		}
+	}
 
-		return 1;
+	cleanup_scheduler(&sched);
+
+	if (cleanup_recovery(&dd)) {
+		printf("%s", dd.error_msg);
 	}
 
+	close_telemetry(&tel);
+	close_journal(&journal);
+
+	// What the clusters still missing would buy:
+
+	planner_sync_overlay(&dd, &planner);
+	build_plan(&planner);
+	print_yield_curve(&planner, 20);
+
+	cleanup_planner(&planner);
+	cleanup_priorities(&prio);
+
+	save_index(&dd);
+
+	close_overlay(&dd);
+
 	close_ntfs(&dd);
 
+
 	cleanup_dd(&dd);
 
-	return 0;
+	exit(0);
 
 	struct reader_ctx_struct reader;
 
@@ -386,7 +490,7 @@ int main() {
 		return 1;
 	}
 
-	uint32_t max_lba;
+	uint64_t max_lba;
 	uint32_t block_size;
 
 	if (get_capacity(&reader, &max_lba, &block_size)) {
@@ -397,7 +501,7 @@ int main() {
 		return 1;
 	}
 
-	printf("Max LBA: %d, block size: %d\n", max_lba, block_size);
+	printf("Max LBA: %lu, block size: %u\n", max_lba, block_size);
 
 
 	int ret = read_blocks(&reader, 20000000, 100);
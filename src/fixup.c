@@ -0,0 +1,91 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "fixup.h"
+
+#include <string.h>
+
+/**
+ * Check a FILE or INDX record's update sequence and put back the original
+ * last two bytes of each stride that passes.  Strides that fail (or that
+ * weren't read) are left as they are, so the caller can use whatever of
+ * the record is good.
+ *
+ * Strides are checked and fixed in one pass: with 2 (FILE) to 8 (INDX)
+ * strides per record, gathering the trailers into a vector to compare them
+ * together costs more than it saves.
+ *
+ * @param record Record, fixed up in place
+ * @param record_size Size of the record in bytes (a multiple of
+ *        FIXUP_STRIDE, up to 64 strides)
+ * @param sectors Mask of the strides holding data read from disc (bit n
+ *        for stride n); only these are checked
+ * @return Mask of the strides that passed and were fixed up; 0 if the
+ *         update sequence array is missing or malformed
+ */
+__uint64_t apply_fixups(unsigned char* record, size_t record_size, __uint64_t sectors)
+{
+	int strides = record_size / FIXUP_STRIDE;
+
+	if (strides == 0 || strides > 64 || !(sectors & 1)) {
+		return 0;
+	}
+
+	__uint16_t usa_offset;
+	__uint16_t usa_count;
+	__uint16_t usn;
+
+	memcpy(&usa_offset, record + 4, 2);
+	memcpy(&usa_count, record + 6, 2);
+
+	// The array (the number, then one entry per stride; usa_count counts
+	// both) has to lie in the first stride.
+
+	if (usa_count < strides + 1 || usa_offset < 8 || usa_offset + 2 + 2 * strides > FIXUP_STRIDE - 2) {
+		return 0;
+	}
+
+	memcpy(&usn, record + usa_offset, 2);
+
+	const unsigned char* usa = record + usa_offset + 2;
+
+	__uint64_t valid = 0;
+
+	for (int i = 0; i < strides; i++) {
+		unsigned char* trailer = record + FIXUP_STRIDE * (i + 1) - 2;
+
+		__uint16_t value;
+
+		memcpy(&value, trailer, 2);
+
+		if (value == usn && (sectors >> i & 1)) {
+			memcpy(trailer, usa + 2 * i, 2);
+
+			valid |= (__uint64_t)1 << i;
+		}
+	}
+
+	return valid;
+}
@@ -0,0 +1,342 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "journal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ERR(...) \
+	journal->error = 1; \
+	snprintf(journal->error_msg, 4096, __VA_ARGS__);
+
+#define JOURNAL_MAGIC "EDDJ"
+#define JOURNAL_VERSION 1
+
+#define RECORD_BEGIN 1 // Read about to be made
+#define RECORD_END 2 // Read returned
+#define RECORD_SUMMARY 3 // Compacted history of one cluster
+
+typedef struct journal_record_st {
+	__uint64_t start;
+	__uint32_t count;
+	__uint8_t type; // RECORD_*
+	__uint8_t result; // JOURNAL_*
+	__uint8_t failures; // RECORD_SUMMARY only, as are the next two
+	__uint8_t timeouts;
+	float seconds;
+	__uint32_t attempts;
+} journal_record_st;
+
+static journal_entry_st* _get_entry(journal_st* journal, __uint64_t cluster)
+{
+	journal_entry_st* entry;
+
+	HASH_FIND(hh, journal->entries, &cluster, sizeof(__uint64_t), entry);
+
+	if (entry == NULL) {
+		entry = (journal_entry_st*)malloc(sizeof(journal_entry_st));
+
+		memset(entry, 0, sizeof(journal_entry_st));
+
+		entry->id = cluster;
+
+		HASH_ADD(hh, journal->entries, id, sizeof(__uint64_t), entry);
+	}
+
+	return entry;
+}
+
+static void _apply_end(journal_st* journal, __uint64_t start, __uint64_t count, int result, double seconds)
+{
+	for (__uint64_t cluster = start; cluster < start + count; cluster++) {
+		// Clusters read first time are in the overlay; there's nothing to
+		// remember about them.
+
+		if (result == JOURNAL_OK && journal_lookup(journal, cluster) == NULL) {
+			continue;
+		}
+
+		journal_entry_st* entry = _get_entry(journal, cluster);
+
+		entry->attempts++;
+		entry->last_result = result;
+		entry->seconds += seconds / count;
+
+		if (result == JOURNAL_TIMEOUT) {
+			entry->timeouts++;
+		} else if (result == JOURNAL_FAILED && count == 1) {
+			entry->failures++;
+		}
+	}
+}
+
+static void _write_record(journal_st* journal, journal_record_st* record)
+{
+	if (journal->file == NULL) {
+		return;
+	}
+
+	fwrite(record, sizeof(journal_record_st), 1, journal->file);
+
+	// Out of the process before the read is made, in case it never returns.
+
+	fflush(journal->file);
+}
+
+/**
+ * Replay an existing journal into journal->entries.
+ */
+static int _load_journal(journal_st* journal, FILE* file)
+{
+	char magic[4];
+	__uint32_t version;
+
+	if (fread(magic, 4, 1, file) != 1) {
+		return 0; // Empty
+	}
+
+	if (memcmp(magic, JOURNAL_MAGIC, 4) || fread(&version, sizeof(__uint32_t), 1, file) != 1 || version != JOURNAL_VERSION) {
+		ERR("%s is not a recovery journal\n", journal->filename);
+
+		return 1;
+	}
+
+	journal_record_st record;
+	journal_record_st open_read;
+
+	int read_open = 0;
+
+	while (fread(&record, sizeof(journal_record_st), 1, file) == 1) {
+		if (record.type == RECORD_BEGIN) {
+			open_read = record;
+			read_open = 1;
+		} else if (record.type == RECORD_END) {
+			_apply_end(journal, record.start, record.count, record.result, record.seconds);
+
+			read_open = 0;
+		} else if (record.type == RECORD_SUMMARY) {
+			journal_entry_st* entry = _get_entry(journal, record.start);
+
+			entry->attempts = record.attempts;
+			entry->failures = record.failures;
+			entry->timeouts = record.timeouts;
+			entry->last_result = record.result;
+			entry->seconds = record.seconds;
+		}
+	}
+
+	// A read that began and never ended took the process down with it.
+
+	if (read_open) {
+		_apply_end(journal, open_read.start, open_read.count, JOURNAL_TIMEOUT, 0);
+	}
+
+	return 0;
+}
+
+/**
+ * Open a recovery journal, creating it if it doesn't exist.
+ *
+ * @param journal Journal to initialize
+ * @param filename Journal file
+ * @return 0 on success, nonzero on failure (journal->error_msg set)
+ */
+int open_journal(journal_st* journal, const char* filename)
+{
+	memset(journal, 0, sizeof(journal_st));
+
+	journal->filename = (char*)malloc(strlen(filename) + 1);
+	strcpy(journal->filename, filename);
+
+	FILE* file = fopen(filename, "rb");
+
+	if (file != NULL) {
+		int result = _load_journal(journal, file);
+
+		fclose(file);
+
+		if (result) {
+			return 1;
+		}
+	} else if (errno != ENOENT) {
+		ERR("Unable to open %s: %s\n", filename, strerror(errno));
+
+		return 1;
+	}
+
+	// Compact: write the history out as summaries to a temporary file and
+	// move it over the journal.
+
+	char* tmp_filename = (char*)malloc(strlen(filename) + 5);
+
+	strcpy(tmp_filename, filename);
+	strcat(tmp_filename, ".tmp");
+
+	journal->file = fopen(tmp_filename, "wb");
+
+	if (journal->file == NULL) {
+		ERR("Unable to create %s: %s\n", tmp_filename, strerror(errno));
+
+		free(tmp_filename);
+
+		return 2;
+	}
+
+	__uint32_t version = JOURNAL_VERSION;
+
+	fwrite(JOURNAL_MAGIC, 4, 1, journal->file);
+	fwrite(&version, sizeof(__uint32_t), 1, journal->file);
+
+	journal_entry_st* entry;
+	journal_entry_st* entry_tmp;
+
+	HASH_ITER(hh, journal->entries, entry, entry_tmp) {
+		journal_record_st record;
+
+		memset(&record, 0, sizeof(journal_record_st));
+
+		record.start = entry->id;
+		record.count = 1;
+		record.type = RECORD_SUMMARY;
+		record.result = entry->last_result;
+		record.attempts = entry->attempts;
+		record.failures = (entry->failures < 255) ? entry->failures : 255;
+		record.timeouts = (entry->timeouts < 255) ? entry->timeouts : 255;
+		record.seconds = entry->seconds;
+
+		fwrite(&record, sizeof(journal_record_st), 1, journal->file);
+	}
+
+	if (fflush(journal->file) || fsync(fileno(journal->file)) || rename(tmp_filename, filename)) {
+		ERR("Unable to write %s: %s\n", filename, strerror(errno));
+
+		fclose(journal->file);
+
+		journal->file = NULL;
+
+		free(tmp_filename);
+
+		return 3;
+	}
+
+	free(tmp_filename);
+
+	return 0;
+}
+
+void close_journal(journal_st* journal)
+{
+	journal_entry_st* entry;
+	journal_entry_st* entry_tmp;
+
+	if (journal->file != NULL) {
+		fclose(journal->file);
+
+		journal->file = NULL;
+	}
+
+	HASH_ITER(hh, journal->entries, entry, entry_tmp) {
+		HASH_DEL(journal->entries, entry);
+
+		free(entry);
+	}
+
+	free(journal->filename);
+
+	journal->filename = NULL;
+}
+
+/**
+ * Journal a read about to be made.
+ *
+ * @param journal Journal (NULL to do nothing)
+ * @param start First cluster number
+ * @param count Number of clusters
+ */
+void journal_begin(journal_st* journal, __uint64_t start, __uint64_t count)
+{
+	if (journal == NULL) {
+		return;
+	}
+
+	journal_record_st record;
+
+	memset(&record, 0, sizeof(journal_record_st));
+
+	record.start = start;
+	record.count = count;
+	record.type = RECORD_BEGIN;
+
+	_write_record(journal, &record);
+}
+
+/**
+ * Journal the result of a read.
+ *
+ * @param journal Journal (NULL to do nothing)
+ * @param start First cluster number
+ * @param count Number of clusters
+ * @param result JOURNAL_*
+ * @param seconds Time the read took
+ */
+void journal_end(journal_st* journal, __uint64_t start, __uint64_t count, int result, double seconds)
+{
+	if (journal == NULL) {
+		return;
+	}
+
+	journal_record_st record;
+
+	memset(&record, 0, sizeof(journal_record_st));
+
+	record.start = start;
+	record.count = count;
+	record.type = RECORD_END;
+	record.result = result;
+	record.seconds = seconds;
+
+	_write_record(journal, &record);
+
+	_apply_end(journal, start, count, result, seconds);
+}
+
+/**
+ * History of a cluster.
+ *
+ * @param journal Journal
+ * @param cluster Cluster number
+ * @return Entry, or NULL if the cluster has never been read
+ */
+journal_entry_st* journal_lookup(journal_st* journal, __uint64_t cluster)
+{
+	journal_entry_st* entry;
+
+	HASH_FIND(hh, journal->entries, &cluster, sizeof(__uint64_t), entry);
+
+	return entry;
+}
@@ -0,0 +1,75 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <stdio.h>
+
+#include <uthash-master/uthash.h>
+
+// Per-cluster history of recovery attempts, kept next to the overlay so an
+// interrupted run can resume without repeating reads known to fail.  Every
+// read is journaled before it's made and again when it returns, so a read
+// that never returned (because it hung the drive and edd was killed) shows
+// up next time as a timeout.
+//
+// The file is a header ("EDDJ", version) followed by 24-byte records.  It
+// is compacted to one summary record per cluster each time it's opened.
+
+#define JOURNAL_OK 0
+#define JOURNAL_FAILED 1
+#define JOURNAL_TIMEOUT 2
+
+typedef struct journal_entry_st {
+	__uint64_t id; // cluster
+
+	int attempts; // Reads covering the cluster
+	int failures; // Failed reads of the cluster alone
+	int timeouts; // Reads covering the cluster that timed out (or never returned)
+	int last_result; // JOURNAL_*
+	double seconds; // Device time spent on the cluster (its share of each read)
+
+	UT_hash_handle hh;
+} journal_entry_st;
+
+typedef struct journal_st {
+	char* filename;
+	FILE* file;
+
+	journal_entry_st* entries;
+
+	int error;
+	char error_msg[4096];
+} journal_st;
+
+int open_journal(journal_st* journal, const char* filename);
+
+void close_journal(journal_st* journal);
+
+void journal_begin(journal_st* journal, __uint64_t start, __uint64_t count);
+
+void journal_end(journal_st* journal, __uint64_t start, __uint64_t count, int result, double seconds);
+
+journal_entry_st* journal_lookup(journal_st* journal, __uint64_t cluster);
@@ -0,0 +1,203 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+
+#include "mft_filter.h"
+
+#include <fnmatch.h>
+#include <string.h>
+#include <strings.h>
+
+#define ATTR_STANDARD_INFORMATION 0x10
+#define ATTR_FILE_NAME 0x30
+#define ATTR_END 0xffffffff
+
+// Longest name a $FILE_NAME can hold.
+
+#define FILE_NAME_MAX 255
+
+/**
+ * Set up a filter that passes every record.
+ *
+ * @param filter Filter to initialize
+ */
+void init_mft_filter(mft_filter_st* filter)
+{
+	memset(filter, 0, sizeof(mft_filter_st));
+}
+
+/**
+ * Test whether a time lies within [min, max], either bound 0 for none.
+ */
+static int _in_range(__uint64_t value, __uint64_t min, __uint64_t max)
+{
+	return (min == 0 || value >= min) && (max == 0 || value <= max);
+}
+
+/**
+ * Test a record against a filter.  The record must have had its fix-ups
+ * applied.  Records too damaged to walk pass, so the parser can report
+ * them.
+ *
+ * @param filter Filter
+ * @param record MFT record
+ * @param record_size Size of the record in bytes
+ * @return 1 if the record passes, 0 if not
+ */
+int mft_filter_record(const mft_filter_st* filter, const unsigned char* record, __uint32_t record_size)
+{
+	// Find $STANDARD_INFORMATION, and the last $FILE_NAME of each namespace
+	// (which is the one the parser keeps.)
+
+	const unsigned char* si = NULL;
+	const unsigned char* file_name[4] = { NULL, NULL, NULL, NULL };
+	const unsigned char* last_file_name = NULL;
+
+	__uint16_t attr_pos;
+
+	memcpy(&attr_pos, record + 20, 2);
+
+	for (int num_attr = 0; ; num_attr++) {
+		if (num_attr > 20 || attr_pos + 8 > record_size) {
+			return 1;
+		}
+
+		__uint32_t code;
+		__uint32_t size;
+
+		memcpy(&code, record + attr_pos, 4);
+		memcpy(&size, record + attr_pos + 4, 4);
+
+		if (code == ATTR_END) {
+			break;
+		}
+
+		if (size < 24 || attr_pos + size > record_size) {
+			return 1;
+		}
+
+		if ((code == ATTR_STANDARD_INFORMATION || code == ATTR_FILE_NAME) && record[attr_pos + 8] == 0) {
+			__uint16_t value_offset;
+			__uint32_t value_size;
+
+			memcpy(&value_size, record + attr_pos + 16, 4);
+			memcpy(&value_offset, record + attr_pos + 20, 2);
+
+			const unsigned char* value = record + attr_pos + value_offset;
+
+			if (code == ATTR_STANDARD_INFORMATION) {
+				if (value_size >= 32 && value_offset + 32 <= size) {
+					si = value;
+				}
+			} else if (value_size >= 66 && value_offset + 66 + value[64] * 2 <= size) {
+				if (value[65] <= 3) {
+					file_name[value[65]] = value;
+				}
+
+				last_file_name = value;
+			}
+		}
+
+		attr_pos += size;
+	}
+
+	// The name reported: Win32, POSIX, DOS, then Win32 & DOS.
+
+	int namespace_priority[4] = { 1, 0, 2, 3 };
+
+	const unsigned char* name_attr = NULL;
+
+	for (int i = 0; i < 4 && name_attr == NULL; i++) {
+		name_attr = file_name[namespace_priority[i]];
+	}
+
+	if (name_attr == NULL) {
+		// Not passed to handlers anyway.
+
+		return 0;
+	}
+
+	if (filter->min_size > 0) {
+		__uint64_t filesize;
+
+		memcpy(&filesize, last_file_name + 48, 8);
+
+		if (filesize < filter->min_size) {
+			return 0;
+		}
+	}
+
+	if (filter->created_min != 0 || filter->created_max != 0 || filter->modified_min != 0 || filter->modified_max != 0) {
+		__uint64_t date_created = 0;
+		__uint64_t date_modified = 0;
+
+		if (si != NULL) {
+			memcpy(&date_created, si, 8);
+			memcpy(&date_modified, si + 8, 8);
+		}
+
+		if (!_in_range(date_created, filter->created_min, filter->created_max) ||
+				!_in_range(date_modified, filter->modified_min, filter->modified_max)) {
+			return 0;
+		}
+	}
+
+	if (filter->extensions == NULL && filter->name_pattern == NULL) {
+		return 1;
+	}
+
+	// Narrow the name as the parser does, onto the stack.
+
+	char name[FILE_NAME_MAX + 1];
+	__uint8_t name_size = name_attr[64];
+
+	for (int i = 0; i < name_size; i++) {
+		name[i] = name_attr[66 + i * 2];
+	}
+
+	name[name_size] = '\0';
+
+	if (filter->extensions != NULL) {
+		const char* dot = strrchr(name, '.');
+		const char* ext = (dot != NULL) ? dot + 1 : "";
+
+		int found = 0;
+
+		for (int i = 0; filter->extensions[i] != NULL && !found; i++) {
+			found = (strcasecmp(ext, filter->extensions[i]) == 0);
+		}
+
+		if (!found) {
+			return 0;
+		}
+	}
+
+	if (filter->name_pattern != NULL && fnmatch(filter->name_pattern, name, FNM_CASEFOLD) != 0) {
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,58 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <sys/types.h>
+
+// Declarative record filters, checked by parse_mft_cluster() on each
+// record's raw $STANDARD_INFORMATION and $FILE_NAME attributes before
+// anything else is read from it: records that fail are skipped before
+// their data runs are decoded, their bitmap read or their name copied.
+//
+// A record passes if it meets every predicate set.  Names and sizes are
+// the ones read_mft_record() would report (rh->name, rh->filesize), dates
+// those of $STANDARD_INFORMATION (rh->date_created, rh->date_modified.)
+// Directories are filtered like any other record.
+
+// Unix time to NTFS time (100 ns intervals since 1601), for date ranges.
+
+#define UNIX_TO_NTFS_TIME(t) ((__uint64_t)(t) * 10000000 + 116444736000000000)
+
+typedef struct mft_filter_st {
+	const char** extensions; // NULL-terminated list of extensions (no dot, any case), or NULL for any
+	const char* name_pattern; // fnmatch() pattern (any case), or NULL for any name
+
+	__uint64_t created_min; // NTFS time, 0 for no bound
+	__uint64_t created_max;
+	__uint64_t modified_min;
+	__uint64_t modified_max;
+
+	__uint64_t min_size; // Smallest file size in bytes
+} mft_filter_st;
+
+void init_mft_filter(mft_filter_st* filter);
+
+int mft_filter_record(const mft_filter_st* filter, const unsigned char* record, __uint32_t record_size);
@@ -0,0 +1,162 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "mft_pipeline.h"
+
+#include <string.h>
+
+/**
+ * Set up an empty pipeline with default scan settings (see
+ * init_mft_scan().)
+ *
+ * @param pipeline Pipeline to initialize
+ */
+void init_mft_pipeline(mft_pipeline_st* pipeline)
+{
+	memset(pipeline, 0, sizeof(mft_pipeline_st));
+
+	init_mft_scan(&pipeline->scan, NULL, NULL);
+}
+
+void cleanup_mft_pipeline(mft_pipeline_st* pipeline)
+{
+	free(pipeline->stage);
+
+	pipeline->stage = NULL;
+	pipeline->stage_count = 0;
+	pipeline->stage_alloc = 0;
+}
+
+/**
+ * Add a stage to the pipeline.  Further settings (finish, result,
+ * thread_safe) can be made on pipeline->stage[] at the index returned,
+ * until the next stage is added.
+ *
+ * @param pipeline Pipeline
+ * @param handler Callback receiving each record the filter passes
+ * @param filter Callback choosing the records, or NULL for all of them
+ * @param param Passed to the handler as rh->param, and to the filter
+ * @return Index of the stage
+ */
+int add_mft_stage(mft_pipeline_st* pipeline, MFTRecordHandler handler, MFTRecordFilter filter, void* param)
+{
+	if (pipeline->stage_count == pipeline->stage_alloc) {
+		pipeline->stage_alloc = (pipeline->stage_alloc == 0) ? 4 : pipeline->stage_alloc * 2;
+		pipeline->stage = (mft_stage_st*)realloc(pipeline->stage, sizeof(mft_stage_st) * pipeline->stage_alloc);
+	}
+
+	mft_stage_st* stage = &pipeline->stage[pipeline->stage_count];
+
+	memset(stage, 0, sizeof(mft_stage_st));
+
+	stage->handler = handler;
+	stage->filter = filter;
+	stage->param = param;
+
+	return pipeline->stage_count++;
+}
+
+/**
+ * Scan handler passing each record to every stage whose filter takes it
+ * (rh->param is the pipeline.)
+ */
+static void _fan_out(dd_ctx* dd, record_handler_ctx* rh)
+{
+	mft_pipeline_st* pipeline = (mft_pipeline_st*)rh->param;
+
+	for (int i = 0; i < pipeline->stage_count; i++) {
+		mft_stage_st* stage = &pipeline->stage[i];
+
+		if (stage->filter != NULL && !stage->filter(dd, rh, stage->param)) {
+			continue;
+		}
+
+		rh->param = stage->param;
+		rh->result = stage->result;
+
+		stage->handler(dd, rh);
+
+		if (pipeline->scan.thread_safe) {
+			__sync_fetch_and_add(&stage->records, 1);
+		} else {
+			stage->result = rh->result;
+			stage->records++;
+		}
+	}
+
+	rh->param = pipeline;
+	rh->result = NULL;
+}
+
+/**
+ * Scan the MFT once, passing each record to every stage, then finish each
+ * stage.
+ *
+ * @param dd DD context struct (NTFS open)
+ * @param pipeline Pipeline
+ * @return 0 on success, nonzero on failure (as scan_mft())
+ */
+int run_mft_pipeline(dd_ctx* dd, mft_pipeline_st* pipeline)
+{
+	mft_scan_st* scan = &pipeline->scan;
+
+	// Keep the caller's settings; start the totals afresh.
+
+	scan->handler = &_fan_out;
+	scan->param = pipeline;
+	scan->result = NULL;
+
+	scan->clusters = 0;
+	scan->records = 0;
+	scan->failed = 0;
+	scan->run_reads = 0;
+	scan->skipped = 0;
+
+	scan->thread_safe = 1;
+
+	for (int i = 0; i < pipeline->stage_count; i++) {
+		pipeline->stage[i].records = 0;
+
+		if (!pipeline->stage[i].thread_safe) {
+			scan->thread_safe = 0;
+		}
+	}
+
+	int result = 0;
+
+	if (pipeline->stage_count > 0) {
+		result = scan_mft(dd, scan);
+	}
+
+	for (int i = 0; i < pipeline->stage_count; i++) {
+		mft_stage_st* stage = &pipeline->stage[i];
+
+		if (stage->finish != NULL) {
+			stage->finish(dd, stage, result != 0);
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,75 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "mft_scan.h"
+
+// Runs several record handlers off one MFT scan.  Each stage has its own
+// handler, state (rh->param and rh->result, as scan_mft() gives a single
+// handler) and optional filter, and sees every record its filter passes,
+// in the order the stages were added.  Stages share the record: changes a
+// handler makes to it are seen by the stages after it.
+//
+// The scan delivers records in order unless every stage is thread-safe.
+
+// Return nonzero to pass the record on to the stage's handler.
+
+typedef int (*MFTRecordFilter)(dd_ctx* dd, const record_handler_ctx* rh, void* param);
+
+typedef struct mft_stage_st mft_stage_st;
+
+// Called once the scan is over, failed or not, e.g. to finish or discard
+// what the stage gathered.
+
+typedef void (*MFTStageFinish)(dd_ctx* dd, mft_stage_st* stage, int failed);
+
+struct mft_stage_st {
+	MFTRecordHandler handler;
+	MFTRecordFilter filter; // NULL to take every record
+	MFTStageFinish finish; // NULL if there's nothing to do
+
+	void* param; // rh->param for the handler, and the filter's param
+	void* result; // rh->result, kept between calls (ordered delivery)
+
+	int thread_safe; // Handler and filter may be called from several threads at once
+
+	__uint64_t records; // Records passed to the handler
+};
+
+typedef struct mft_pipeline_st {
+	mft_stage_st* stage;
+	int stage_count;
+	int stage_alloc;
+
+	mft_scan_st scan; // Scan settings (threads, chunk_clusters, filter, include_free, for all stages) and totals
+} mft_pipeline_st;
+
+void init_mft_pipeline(mft_pipeline_st* pipeline);
+void cleanup_mft_pipeline(mft_pipeline_st* pipeline);
+
+int add_mft_stage(mft_pipeline_st* pipeline, MFTRecordHandler handler, MFTRecordFilter filter, void* param);
+
+int run_mft_pipeline(dd_ctx* dd, mft_pipeline_st* pipeline);
@@ -0,0 +1,636 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "mft_scan.h"
+#include "badclusters.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ERR(...) \
+	if (dd->error == 0) { \
+		memset(dd->error_msg, 0, 4096); \
+		dd->error = 1; \
+	} \
+	dd->error = 1; \
+	snprintf(dd->error_msg + strlen(dd->error_msg), 4096 - strlen(dd->error_msg), __VA_ARGS__);
+
+// Chunks parsed ahead of the one next in line, per worker thread, before
+// workers wait for delivery to catch up.
+
+#define REORDER_WINDOW_PER_THREAD 4
+
+typedef struct scan_chunk_st {
+	__uint64_t cluster; // First MFT cluster
+	__uint64_t count;
+} scan_chunk_st;
+
+// Records of one chunk, copied out of read_mft_record() for later delivery.
+
+typedef struct scan_batch_st {
+	record_handler_ctx* record;
+	__uint64_t count;
+	__uint64_t alloc;
+
+	arena_st arena; // Names, data runs and bitmaps of the records
+} scan_batch_st;
+
+typedef struct scan_shared_st {
+	dd_ctx* dd;
+	mft_scan_st* scan;
+
+	scan_chunk_st* chunk;
+	__uint64_t chunk_count;
+
+	pthread_mutex_t lock; // Guards everything below
+	pthread_cond_t cond;
+
+	__uint64_t next_chunk; // Next chunk to be claimed
+
+	scan_batch_st** slot; // Parsed chunks awaiting delivery, by chunk % window
+	__uint64_t window;
+	__uint64_t delivered; // Chunks delivered so far
+	int delivering; // A thread is delivering
+} scan_shared_st;
+
+typedef struct scan_worker_st {
+	scan_shared_st* shared;
+	pthread_t thread;
+
+	dd_ctx* dd; // &own, or the caller's when scanning on the calling thread
+	dd_ctx own;
+
+	scan_batch_st* batch; // Chunk being parsed (ordered delivery)
+
+	unsigned char* buffer; // One chunk of clusters
+
+	__uint64_t clusters;
+	__uint64_t records;
+	__uint64_t failed;
+	__uint64_t run_reads;
+	__uint64_t skipped;
+} scan_worker_st;
+
+/**
+ * Set up a scan with default settings: ordered delivery, one thread per
+ * CPU.
+ *
+ * @param scan Scan settings to initialize
+ * @param handler Callback receiving every record read
+ * @param param Passed to the handler as rh->param
+ */
+void init_mft_scan(mft_scan_st* scan, MFTRecordHandler handler, void* param)
+{
+	memset(scan, 0, sizeof(mft_scan_st));
+
+	scan->handler = handler;
+	scan->param = param;
+}
+
+/**
+ * Call the scan's handler.  Records the handler reads itself (e.g. with
+ * restore_ntfs()) aren't subject to the scan's filter or bitmap.
+ */
+static void _call_handler(dd_ctx* dd, mft_scan_st* scan, record_handler_ctx* rh)
+{
+	const mft_filter_st* filter = dd->mft_filter;
+	int skip_free = dd->mft_skip_free;
+
+	dd->mft_filter = NULL;
+	dd->mft_skip_free = 0;
+
+	scan->handler(dd, rh);
+
+	dd->mft_filter = filter;
+	dd->mft_skip_free = skip_free;
+}
+
+/**
+ * Handler for read_mft_record() that copies each record into the worker's
+ * batch (rh->param is the worker.)
+ */
+static void _capture_record(dd_ctx* dd, record_handler_ctx* rh)
+{
+	scan_worker_st* worker = (scan_worker_st*)rh->param;
+	scan_batch_st* batch = worker->batch;
+
+	if (batch->count == batch->alloc) {
+		batch->alloc = (batch->alloc == 0) ? 64 : batch->alloc * 2;
+		batch->record = (record_handler_ctx*)realloc(batch->record, sizeof(record_handler_ctx) * batch->alloc);
+	}
+
+	record_handler_ctx* record = &batch->record[batch->count++];
+
+	copy_record(record, rh, &batch->arena);
+
+	record->param = NULL;
+}
+
+/**
+ * Handler for read_mft_record() that passes each record straight on to
+ * the scan's handler (rh->param is the worker.)
+ */
+static void _deliver_record(dd_ctx* dd, record_handler_ctx* rh)
+{
+	scan_worker_st* worker = (scan_worker_st*)rh->param;
+	mft_scan_st* scan = worker->shared->scan;
+
+	rh->param = scan->param;
+	rh->result = scan->result;
+
+	_call_handler(dd, scan, rh);
+
+	rh->param = worker;
+
+	worker->records++;
+}
+
+/**
+ * Pass a parsed chunk's records to the scan's handler, then free them.
+ * Only one thread delivers at a time.
+ */
+static void _deliver_batch(scan_shared_st* shared, scan_batch_st* batch)
+{
+	mft_scan_st* scan = shared->scan;
+
+	for (__uint64_t i = 0; i < batch->count; i++) {
+		record_handler_ctx* record = &batch->record[i];
+
+		record->param = scan->param;
+		record->result = scan->result;
+
+		_call_handler(shared->dd, scan, record);
+
+		scan->result = record->result;
+	}
+
+	scan->records += batch->count;
+
+	cleanup_arena(&batch->arena);
+
+	free(batch->record);
+	free(batch);
+}
+
+/**
+ * Parse clusters of a chunk read in one go.
+ */
+static void _parse_run(scan_worker_st* worker, __uint64_t cluster_pos, __uint64_t count, MFTRecordHandler handler, record_handler_ctx* rh)
+{
+	dd_ctx* dd = worker->dd;
+
+	__uint64_t all_sectors = SECTOR_MASK_FULL(NTFS_CLUSTER_SIZE / OVERLAY_SECTOR_SIZE);
+
+	for (__uint64_t i = 0; i < count; i++) {
+		if (parse_mft_cluster(dd, worker->buffer + (size_t)NTFS_CLUSTER_SIZE * i, cluster_pos + i, all_sectors, handler, rh)) {
+			MARK_FAILED_CLUSTER(cluster_pos + i);
+
+			worker->failed++;
+		}
+
+		worker->clusters++;
+	}
+}
+
+/**
+ * Read and parse one cluster by itself.
+ */
+static void _scan_cluster(scan_worker_st* worker, __uint64_t cluster_pos, MFTRecordHandler handler, record_handler_ctx* rh)
+{
+	dd_ctx* dd = worker->dd;
+
+	if (read_mft_record(dd, cluster_pos, handler, rh)) {
+		MARK_FAILED_CLUSTER(cluster_pos);
+
+		worker->failed++;
+	}
+
+	worker->clusters++;
+}
+
+/**
+ * Parse a run of MFT clusters, reading it with one read if possible, or
+ * else as runs of clusters the image can serve, split around those it
+ * can't.
+ */
+static void _scan_run(scan_worker_st* worker, __uint64_t cluster_pos, __uint64_t count, MFTRecordHandler handler, record_handler_ctx* rh)
+{
+	dd_ctx* dd = worker->dd;
+
+	if (read_image_run(dd, worker->buffer, cluster_pos, count) == 0) {
+		worker->run_reads++;
+
+		_parse_run(worker, cluster_pos, count, handler, rh);
+
+		return;
+	}
+
+	__uint64_t i = 0;
+
+	while (i < count) {
+		__uint64_t run = 0;
+
+		while (i + run < count && cluster_in_image(dd, cluster_pos + i + run)) {
+			run++;
+		}
+
+		if (run > 1 && read_image_run(dd, worker->buffer, cluster_pos + i, run) == 0) {
+			worker->run_reads++;
+
+			_parse_run(worker, cluster_pos + i, run, handler, rh);
+		} else {
+			for (__uint64_t j = 0; j < run; j++) {
+				_scan_cluster(worker, cluster_pos + i + j, handler, rh);
+			}
+		}
+
+		i += run;
+
+		if (i < count) {
+			_scan_cluster(worker, cluster_pos + i, handler, rh);
+
+			i++;
+		}
+	}
+}
+
+/**
+ * Parse one chunk of MFT clusters.  Unless the scan includes free
+ * records, only the runs of clusters holding a record the MFT bitmap
+ * marks in use are read.
+ */
+static void _scan_chunk(scan_worker_st* worker, scan_chunk_st* chunk, MFTRecordHandler handler)
+{
+	dd_ctx* dd = worker->dd;
+
+	record_handler_ctx rh;
+
+	memset(&rh, 0, sizeof(record_handler_ctx));
+
+	rh.param = worker;
+
+	if (!dd->mft_skip_free) {
+		_scan_run(worker, chunk->cluster, chunk->count, handler, &rh);
+
+		return;
+	}
+
+	// A chunk lies within one MFT extent, so its records' MFT indexes run
+	// on from its first.
+
+	__uint64_t records_per_cluster = NTFS.mft_records_per_cluster;
+
+	__uint64_t first_index = get_mft_index(dd, chunk->cluster, 0);
+	__uint64_t end_index = first_index + chunk->count * records_per_cluster;
+
+	__uint64_t i = 0;
+
+	while (i < chunk->count) {
+		__uint64_t next = mft_bitmap_next(dd, first_index + i * records_per_cluster, end_index);
+
+		__uint64_t start = (next - first_index) / records_per_cluster;
+
+		worker->skipped += start - i;
+
+		if (start >= chunk->count) {
+			break;
+		}
+
+		// Extend the run over the clusters after it with a record in use.
+
+		__uint64_t end = start + 1;
+
+		while (end < chunk->count) {
+			__uint64_t cluster_index = first_index + end * records_per_cluster;
+
+			if (mft_bitmap_next(dd, cluster_index, cluster_index + records_per_cluster) == cluster_index + records_per_cluster) {
+				break;
+			}
+
+			end++;
+		}
+
+		_scan_run(worker, chunk->cluster + start, end - start, handler, &rh);
+
+		i = end;
+	}
+}
+
+/**
+ * Claim chunks until none are left.  With ordered delivery, each parsed
+ * chunk is put in the reorder buffer, and delivered along with any chunks
+ * queued behind it if it's next in line.
+ */
+static void* _scan_worker(void* arg)
+{
+	scan_worker_st* worker = (scan_worker_st*)arg;
+	scan_shared_st* shared = worker->shared;
+
+	int ordered = !shared->scan->thread_safe;
+
+	for (;;) {
+		pthread_mutex_lock(&shared->lock);
+
+		// Don't run too far ahead of delivery.
+
+		while (ordered && shared->next_chunk < shared->chunk_count &&
+				shared->next_chunk >= shared->delivered + shared->window) {
+			pthread_cond_wait(&shared->cond, &shared->lock);
+		}
+
+		if (shared->next_chunk == shared->chunk_count) {
+			pthread_mutex_unlock(&shared->lock);
+
+			break;
+		}
+
+		__uint64_t seq = shared->next_chunk++;
+
+		pthread_mutex_unlock(&shared->lock);
+
+		if (!ordered) {
+			_scan_chunk(worker, &shared->chunk[seq], &_deliver_record);
+
+			continue;
+		}
+
+		worker->batch = (scan_batch_st*)malloc(sizeof(scan_batch_st));
+
+		memset(worker->batch, 0, sizeof(scan_batch_st));
+
+		_scan_chunk(worker, &shared->chunk[seq], &_capture_record);
+
+		pthread_mutex_lock(&shared->lock);
+
+		shared->slot[seq % shared->window] = worker->batch;
+
+		worker->batch = NULL;
+
+		if (!shared->delivering) {
+			shared->delivering = 1;
+
+			scan_batch_st* batch;
+
+			while ((batch = shared->slot[shared->delivered % shared->window]) != NULL) {
+				shared->slot[shared->delivered % shared->window] = NULL;
+
+				pthread_mutex_unlock(&shared->lock);
+
+				_deliver_batch(shared, batch);
+
+				pthread_mutex_lock(&shared->lock);
+
+				shared->delivered++;
+
+				pthread_cond_broadcast(&shared->cond);
+			}
+
+			shared->delivering = 0;
+		}
+
+		pthread_mutex_unlock(&shared->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * Give a worker its own copy of the DD context.  Everything the parse only
+ * reads (the image, overlay and NTFS details) is shared; what it writes
+ * (error message, bad and failed cluster lists) starts out empty.
+ */
+static void _init_worker_dd(scan_worker_st* worker, dd_ctx* dd)
+{
+	memcpy(&worker->own, dd, sizeof(dd_ctx));
+
+	worker->own.error = 0;
+	worker->own.error_msg[0] = '\0';
+
+	worker->own.bad_clusters = NULL;
+	worker->own.bad_clusters_by_mft_index = NULL;
+
+	worker->own.failed_clusters = NULL;
+	worker->own.failed_cluster_pos = NULL;
+
+	worker->own.recovery = NULL;
+
+	init_arena(&worker->own.arena, 0);
+
+	worker->dd = &worker->own;
+}
+
+/**
+ * Fold what a worker found back into the caller's DD context.
+ */
+static void _merge_worker(dd_ctx* dd, scan_worker_st* worker)
+{
+	if (worker->dd == dd) {
+		return;
+	}
+
+	cleanup_arena(&worker->own.arena);
+
+	merge_bad_clusters(dd, &worker->own);
+
+	if (worker->own.failed_clusters != NULL) {
+		if (dd->failed_clusters == NULL) {
+			dd->failed_clusters = worker->own.failed_clusters;
+		} else {
+			failed_cluster_st* last = dd->failed_clusters;
+
+			while (last->next != NULL) {
+				last = last->next;
+			}
+
+			last->next = worker->own.failed_clusters;
+		}
+
+		dd->failed_cluster_pos = worker->own.failed_cluster_pos;
+	}
+
+	if (worker->own.error) {
+		ERR("%s", worker->own.error_msg);
+	}
+}
+
+/**
+ * Read every record of the MFT, passing each through the scan's handler.
+ *
+ * @param dd DD context struct (NTFS open)
+ * @param scan Scan settings (see init_mft_scan()); counts are filled in
+ * @return 0 on success, nonzero if no worker thread could be started
+ */
+int scan_mft(dd_ctx* dd, mft_scan_st* scan)
+{
+	scan_shared_st shared;
+
+	memset(&shared, 0, sizeof(scan_shared_st));
+
+	shared.dd = dd;
+	shared.scan = scan;
+
+	// Cut the MFT's extents into chunks, on chunk-sized boundaries of the
+	// volume so reads are aligned.
+
+	__uint64_t chunk_clusters = scan->chunk_clusters;
+
+	if (chunk_clusters == 0) {
+		chunk_clusters = MFT_SCAN_CHUNK_BYTES / NTFS_CLUSTER_SIZE;
+	}
+
+	if (chunk_clusters == 0) {
+		chunk_clusters = 1;
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		__uint64_t n = 0;
+
+		for (int i = 0; i < NTFS.mft_data_run.entry_count; i++) {
+			data_run_entry* entry = &NTFS.mft_data_run.entry[i];
+
+			__uint64_t j = 0;
+
+			while (j < entry->count) {
+				__uint64_t count = chunk_clusters - (entry->cluster + j) % chunk_clusters;
+
+				if (count > entry->count - j) {
+					count = entry->count - j;
+				}
+
+				if (pass == 1) {
+					shared.chunk[n].cluster = entry->cluster + j;
+					shared.chunk[n].count = count;
+				}
+
+				j += count;
+				n++;
+			}
+		}
+
+		if (pass == 0) {
+			shared.chunk_count = n;
+			shared.chunk = (scan_chunk_st*)malloc(sizeof(scan_chunk_st) * (n + 1));
+		}
+	}
+
+	int threads = scan->threads;
+
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	if (threads > shared.chunk_count) {
+		threads = (int)shared.chunk_count;
+	}
+
+	if (threads < 1 || dd->overlay.writer != NULL) {
+		threads = 1;
+	}
+
+	shared.window = (__uint64_t)threads * REORDER_WINDOW_PER_THREAD;
+	shared.slot = (scan_batch_st**)malloc(sizeof(scan_batch_st*) * shared.window);
+
+	memset(shared.slot, 0, sizeof(scan_batch_st*) * shared.window);
+
+	pthread_mutex_init(&shared.lock, NULL);
+	pthread_cond_init(&shared.cond, NULL);
+
+	scan_worker_st* worker = (scan_worker_st*)malloc(sizeof(scan_worker_st) * threads);
+
+	memset(worker, 0, sizeof(scan_worker_st) * threads);
+
+	// Workers' contexts are copied from the caller's, filter and all.
+
+	const mft_filter_st* caller_filter = dd->mft_filter;
+	int caller_skip_free = dd->mft_skip_free;
+
+	dd->mft_filter = scan->filter;
+	dd->mft_skip_free = !scan->include_free;
+
+	int started = 0;
+	int result = 0;
+
+	if (threads == 1) {
+		// Scan on the calling thread, with the caller's context.
+
+		worker[0].shared = &shared;
+		worker[0].dd = dd;
+		worker[0].buffer = (unsigned char*)malloc((size_t)NTFS_CLUSTER_SIZE * chunk_clusters);
+
+		_scan_worker(&worker[0]);
+
+		started = 1;
+	} else {
+		for (int i = 0; i < threads; i++) {
+			worker[i].shared = &shared;
+			worker[i].buffer = (unsigned char*)malloc((size_t)NTFS_CLUSTER_SIZE * chunk_clusters);
+
+			_init_worker_dd(&worker[i], dd);
+
+			if (pthread_create(&worker[i].thread, NULL, &_scan_worker, &worker[i])) {
+				break;
+			}
+
+			started++;
+		}
+
+		for (int i = 0; i < started; i++) {
+			pthread_join(worker[i].thread, NULL);
+		}
+
+		if (started == 0) {
+			ERR("Unable to start MFT scan threads\n");
+
+			result = 1;
+		}
+	}
+
+	for (int i = 0; i < started; i++) {
+		_merge_worker(dd, &worker[i]);
+
+		scan->clusters += worker[i].clusters;
+		scan->records += worker[i].records;
+		scan->failed += worker[i].failed;
+		scan->run_reads += worker[i].run_reads;
+		scan->skipped += worker[i].skipped;
+	}
+
+	for (int i = 0; i < threads; i++) {
+		free(worker[i].buffer);
+	}
+
+	dd->mft_filter = caller_filter;
+	dd->mft_skip_free = caller_skip_free;
+
+	pthread_cond_destroy(&shared.cond);
+	pthread_mutex_destroy(&shared.lock);
+
+	free(worker);
+	free(shared.slot);
+	free(shared.chunk);
+
+	return result;
+}
@@ -0,0 +1,82 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "dd.h"
+#include "mft_filter.h"
+
+// Scans the MFT on several threads.  The MFT's extents are cut into chunks
+// of consecutive clusters, which worker threads claim in order and parse
+// with read_mft_record(), each on its own copy of the DD context (its own
+// error message, bad cluster and failed cluster lists, merged back when
+// the scan ends.)
+//
+// Records reach the handler in MFT index order through a reorder buffer:
+// each chunk's records are copied out as it's parsed, and whichever thread
+// finishes the chunk next in line delivers it, and any that queued behind
+// it, one handler call at a time.  A handler that is thread-safe can
+// instead be called straight from the worker threads, records arriving in
+// no particular order.
+//
+// Each chunk is read with one large read where the image can serve all of
+// it, and its records parsed in place; clusters that are in the overlay or
+// not marked read in the mapfile are read one at a time, and the runs
+// between them still in one go.
+//
+// Records the MFT bitmap marks free are skipped unless asked for, and
+// clusters holding nothing else aren't read at all; the bitmap is walked
+// 64 records at a time, so large freed stretches of the MFT cost little.
+// If the bitmap couldn't be read, every record is parsed.
+//
+// A filter given with the scan is checked against each record's raw
+// attributes, so records it rules out are never fully parsed.
+//
+// The overlay index isn't safe to read from several threads while an
+// overlay writer is running, so scans then run on the calling thread.
+
+#define MFT_SCAN_CHUNK_BYTES (4 * 1024 * 1024)
+
+typedef struct mft_scan_st {
+	MFTRecordHandler handler;
+	void* param; // rh->param for every record
+	void* result; // rh->result for every record, kept between calls (ordered delivery)
+
+	int threads; // Worker threads (0 for one per CPU)
+	int thread_safe; // Handler may be called from several threads at once, unordered
+	__uint64_t chunk_clusters; // MFT clusters per work item and read (0 for MFT_SCAN_CHUNK_BYTES worth)
+	const mft_filter_st* filter; // Records to pass on, checked before they're parsed (NULL for all)
+	int include_free; // Also parse records the MFT bitmap marks free (e.g. for deleted files)
+
+	__uint64_t clusters; // Clusters scanned
+	__uint64_t records; // Records passed to the handler
+	__uint64_t failed; // Clusters whose records couldn't all be parsed
+	__uint64_t run_reads; // Reads of several clusters at once
+	__uint64_t skipped; // Clusters not read, every record in them free
+} mft_scan_st;
+
+void init_mft_scan(mft_scan_st* scan, MFTRecordHandler handler, void* param);
+
+int scan_mft(dd_ctx* dd, mft_scan_st* scan);
@@ -28,6 +28,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "overlay.h"
 #include "dd.h"
 #include "reader.h"
+#include "crc32c.h"
+#include "overlay_writer.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -41,147 +43,669 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 	dd->error = 1; \
 	snprintf(dd->error_msg + strlen(dd->error_msg), 4096 - strlen(dd->error_msg), __VA_ARGS__);
 
-void _allocate_filenames(overlay_ctx* overlay, const char* base_filename)
+// Index files start with this header, followed by 24-byte extent records of
+// (start cluster, cluster count, file position); a later record overrides an
+// earlier one for the clusters they share.  Index files without the header
+// hold the original 16-byte (cluster, file position) records.
+
+#define INDEX_MAGIC "EDDX"
+#define INDEX_VERSION 2
+
+#define INDEX_HEADER_SIZE 8
+#define INDEX_RECORD_SIZE OVERLAY_INDEX_RECORD_SIZE
+#define LEGACY_INDEX_RECORD_SIZE 16
+
+// Clusters checked per read by verify_overlay() and when backfilling
+// checksums (8MB with 4K clusters.)
+
+#define VERIFY_CHUNK_CLUSTERS 2048
+
+// Partial files hold one record per write of a partly recovered cluster: a
+// header of (cluster, sector mask, CRC32C of the data, reserved) followed by
+// the whole cluster, unread sectors zeroed.  The last record for a cluster
+// is the current one.
+
+#define PARTIAL_HEADER_SIZE 24
+
+void _allocate_filenames(overlay_layer_st* layer, const char* base_filename)
 {
-	overlay->overlay_filename = (char*)malloc(strlen(base_filename) + 5);
-	overlay->index_filename = (char*)malloc(strlen(base_filename) + 5);
-	overlay->index_tmp_filename = (char*)malloc(strlen(base_filename) + 5);
+	layer->overlay_filename = (char*)malloc(strlen(base_filename) + 5);
+	layer->index_filename = (char*)malloc(strlen(base_filename) + 5);
+	layer->index_tmp_filename = (char*)malloc(strlen(base_filename) + 5);
+	layer->frozen_filename = (char*)malloc(strlen(base_filename) + 5);
+	layer->crc_filename = (char*)malloc(strlen(base_filename) + 5);
+	layer->partial_filename = (char*)malloc(strlen(base_filename) + 5);
+
+	strcpy(layer->overlay_filename, base_filename);
+	strcat(layer->overlay_filename, ".dat");
 
-	strcpy(overlay->overlay_filename, base_filename);
-	strcat(overlay->overlay_filename, ".dat");
+	strcpy(layer->index_filename, base_filename);
+	strcat(layer->index_filename, ".idx");
 
-	strcpy(overlay->index_filename, base_filename);
-	strcat(overlay->index_filename, ".idx");
+	strcpy(layer->index_tmp_filename, base_filename);
+	strcat(layer->index_tmp_filename, ".~dx");
 
-	strcpy(overlay->index_tmp_filename, base_filename);
-	strcat(overlay->index_tmp_filename, ".~dx");
+	strcpy(layer->frozen_filename, base_filename);
+	strcat(layer->frozen_filename, ".frz");
+
+	strcpy(layer->crc_filename, base_filename);
+	strcat(layer->crc_filename, ".crc");
+
+	strcpy(layer->partial_filename, base_filename);
+	strcat(layer->partial_filename, ".prt");
 }
 
-void _cleanup_overlay(overlay_ctx* overlay)
-{
-	if (overlay->overlay_filename != NULL) {
-		free(overlay->overlay_filename);
-		free(overlay->index_filename);
-		free(overlay->index_tmp_filename);
+// While an overlay writer is running it updates the index from its own
+// thread, so lookups take its lock.
 
-		overlay->overlay_filename = NULL;
+static void _lock_index(overlay_ctx* overlay)
+{
+	if (overlay->writer != NULL) {
+		pthread_mutex_lock(&overlay->writer->lock);
 	}
+}
 
-	if (overlay->overlay_file != NULL) {
-		fclose(overlay->overlay_file);
+static void _unlock_index(overlay_ctx* overlay)
+{
+	if (overlay->writer != NULL) {
+		pthread_mutex_unlock(&overlay->writer->lock);
 	}
 }
 
-int open_overlay(dd_ctx* dd, const char* base_filename)
+static void _free_extents(extent_list_st* list)
 {
-	overlay_ctx* overlay = &(dd->overlay);
+	free(list->extent);
 
-	// Build filenames from base_filename.
+	memset(list, 0, sizeof(extent_list_st));
+}
 
-	_allocate_filenames(overlay, base_filename);
+void _cleanup_layer(overlay_layer_st* layer)
+{
+	if (layer->overlay_filename != NULL) {
+		free(layer->overlay_filename);
+		free(layer->index_filename);
+		free(layer->index_tmp_filename);
+		free(layer->frozen_filename);
+		free(layer->crc_filename);
+		free(layer->partial_filename);
+
+		layer->overlay_filename = NULL;
+	}
 
-	// Test if index file backup exists.  Exit here if so, so the user
-	// can decide whether to keep it or remove it.
+	if (layer->name != NULL) {
+		free(layer->name);
 
-	if (access(overlay->index_tmp_filename, F_OK) == 0) {
-		ERR("Overlay index backup file %s found; rename to overlay index file %s or remove to continue\n", overlay->index_filename, overlay->index_filename);
+		layer->name = NULL;
+	}
 
-		_cleanup_overlay(overlay);
+	if (layer->overlay_file != NULL) {
+		fclose(layer->overlay_file);
 
-		return 1;
+		layer->overlay_file = NULL;
 	}
 
-	// Initialize hash table of overlay index entries.
+	if (layer->crc_file != NULL) {
+		fclose(layer->crc_file);
 
-	overlay->index = NULL;
+		layer->crc_file = NULL;
+	}
 
-	// Open or create overlay index file.
+	if (layer->partial_file != NULL) {
+		fclose(layer->partial_file);
 
-	FILE *index_file = fopen(overlay->index_filename, "rb+");
+		layer->partial_file = NULL;
+	}
 
-	if (index_file == NULL) {
-		index_file = fopen(overlay->index_filename, "wb+");
+	partial_cluster_st* current_partial;
+	partial_cluster_st* partial_tmp;
 
-		if (index_file == NULL) {
-			ERR("Unable to open overlay index %s; %s\n", overlay->index_filename, strerror(errno));
+	HASH_ITER(hh, layer->partial, current_partial, partial_tmp) {
+		HASH_DEL(layer->partial, current_partial);
+		free(current_partial);
+	}
+
+	free(layer->crc);
 
-			_cleanup_overlay(overlay);
+	layer->crc = NULL;
+	layer->crc_count = 0;
+	layer->crc_alloc = 0;
+
+	_free_extents(&layer->index);
+}
+
+/**
+ * Store the checksum of the cluster at the given slot of the overlay file in
+ * memory.
+ *
+ * @param layer Overlay layer
+ * @param slot Position of the cluster in the overlay file, in clusters
+ * @param crc CRC32C of the cluster
+ */
+static void _store_crc(overlay_layer_st* layer, __uint64_t slot, __uint32_t crc)
+{
+	if (slot >= layer->crc_alloc) {
+		layer->crc_alloc = (layer->crc_alloc == 0) ? 1024 : layer->crc_alloc * 2;
+
+		if (layer->crc_alloc <= slot) {
+			layer->crc_alloc = slot + 1;
+		}
+
+		layer->crc = (__uint32_t*)realloc(layer->crc, sizeof(__uint32_t) * layer->crc_alloc);
+	}
+
+	// Slots skipped over (never expected in practice) get a checksum of zero
+	// and will be reported by verify_overlay().
+
+	while (layer->crc_count < slot) {
+		layer->crc[layer->crc_count++] = 0;
+	}
+
+	layer->crc[slot] = crc;
+
+	if (slot == layer->crc_count) {
+		layer->crc_count++;
+	}
+}
+
+/**
+ * Read a layer's checksum file.  Clusters in a writable layer that have no
+ * stored checksum (overlays created before checksums existed) have theirs
+ * computed from the overlay file and saved.
+ *
+ * @param dd DD context struct
+ * @param layer Overlay layer, with its overlay file open
+ * @return 0 on success, nonzero on failure
+ */
+static int _load_layer_crcs(dd_ctx* dd, overlay_layer_st* layer)
+{
+	layer->crc_file = fopen(layer->crc_filename, layer->frozen ? "rb" : "rb+");
+
+	if (layer->crc_file == NULL && !layer->frozen) {
+		layer->crc_file = fopen(layer->crc_filename, "wb+");
+
+		if (layer->crc_file == NULL) {
+			ERR("Unable to open overlay checksums %s; %s\n", layer->crc_filename, strerror(errno));
 
 			return 1;
 		}
 	}
 
-	// Open or create overlay file.
+	// Work out how many clusters the overlay file holds.
 
-	overlay->overlay_file = fopen(overlay->overlay_filename, "rb+");
+	if (fseek(layer->overlay_file, 0, SEEK_END)) {
+		ERR("fseek to EOF failed on %s: %s\n", layer->overlay_filename, strerror(errno));
 
-	if (overlay->overlay_file == NULL) {
-		overlay->overlay_file = fopen(overlay->overlay_filename, "wb+");
+		return 2;
+	}
 
-		if (overlay->overlay_file == NULL) {
-			ERR("Unable to open overlay %s; %s\n", overlay->overlay_filename, strerror(errno));
+	__uint64_t num_slots = ftell(layer->overlay_file) / NTFS_CLUSTER_SIZE;
 
-			fclose(index_file);
+	layer->crc_alloc = num_slots + 1024;
+	layer->crc = (__uint32_t*)malloc(sizeof(__uint32_t) * layer->crc_alloc);
 
-			_cleanup_overlay(overlay);
+	if (layer->crc_file != NULL) {
+		layer->crc_count = fread(layer->crc, 4, num_slots, layer->crc_file);
+	}
 
-			return 2;
+	if (layer->crc_count == num_slots || layer->frozen) {
+		return 0;
+	}
+
+	// Backfill missing checksums.
+
+	printf("Computing checksums for %lu clusters of %s\n", num_slots - layer->crc_count, layer->overlay_filename);
+
+	unsigned char* buf = (unsigned char*)malloc(NTFS_CLUSTER_SIZE * VERIFY_CHUNK_CLUSTERS);
+
+	__uint64_t slot = layer->crc_count;
+
+	fseek(layer->overlay_file, slot * NTFS_CLUSTER_SIZE, SEEK_SET);
+
+	while (slot < num_slots) {
+		__uint64_t count = num_slots - slot;
+
+		if (count > VERIFY_CHUNK_CLUSTERS) {
+			count = VERIFY_CHUNK_CLUSTERS;
+		}
+
+		if (fread(buf, NTFS_CLUSTER_SIZE, count, layer->overlay_file) != count) {
+			ERR("Read from overlay %s failed: %s\n", layer->overlay_filename, strerror(errno));
+
+			free(buf);
+			return 3;
 		}
+
+		crc32c_blocks(buf, NTFS_CLUSTER_SIZE, count, layer->crc + slot);
+
+		slot += count;
 	}
 
-	// [TODO] Verify index file is multiple of 16 bytes (record size), and
-	// overlay file is multiple of cluster size.
+	free(buf);
+
+	fseek(layer->crc_file, layer->crc_count * 4, SEEK_SET);
 
-	// Read index file to hash.
+	if (fwrite(layer->crc + layer->crc_count, 4, num_slots - layer->crc_count, layer->crc_file) != num_slots - layer->crc_count) {
+		ERR("Write to overlay checksums %s failed: %s\n", layer->crc_filename, strerror(errno));
 
-	char record_bytes[16];
+		return 4;
+	}
+
+	layer->crc_count = num_slots;
+
+	return 0;
+}
 
-	cluster_index_st *cluster_index;
+/**
+ * Read a layer's partial file, if it has one, into its table of partly
+ * recovered clusters.  Records failing their checksum are dropped, as is a
+ * record cut short by a crash.
+ *
+ * @param dd DD context struct
+ * @param layer Overlay layer
+ * @return 0 on success, nonzero on failure
+ */
+static int _load_layer_partials(dd_ctx* dd, overlay_layer_st* layer)
+{
+	layer->partial_file = fopen(layer->partial_filename, layer->frozen ? "rb" : "rb+");
 
-	while (fread(record_bytes, 16, 1, index_file) == 1) {
-		cluster_index = (cluster_index_st*)malloc(sizeof(cluster_index_st));
+	if (layer->partial_file == NULL) {
+		if (errno == ENOENT) {
+			return 0;
+		}
 
-		memcpy(&cluster_index->id, record_bytes, 8);
-		memcpy(&cluster_index->file_pos, record_bytes + 8, 8);
+		ERR("Unable to open overlay partial clusters %s; %s\n", layer->partial_filename, strerror(errno));
 
-		HASH_ADD(hh, overlay->index, id, sizeof(__uint64_t), cluster_index);
+		return 1;
 	}
 
-	// Close index file.
+	unsigned char header[PARTIAL_HEADER_SIZE];
+	unsigned char* cluster = (unsigned char*)malloc(NTFS_CLUSTER_SIZE);
 
-	fclose(index_file);
+	__uint64_t file_pos = 0;
+
+	while (fread(header, PARTIAL_HEADER_SIZE, 1, layer->partial_file) == 1 &&
+			fread(cluster, NTFS_CLUSTER_SIZE, 1, layer->partial_file) == 1) {
+		__uint64_t cluster_pos;
+		__uint64_t mask;
+		__uint32_t crc;
+
+		memcpy(&cluster_pos, header, 8);
+		memcpy(&mask, header + 8, 8);
+		memcpy(&crc, header + 16, 4);
+
+		if (crc32c(0, cluster, NTFS_CLUSTER_SIZE) != crc) {
+			printf("%s: partial cluster %lu at offset %lX fails checksum; dropped\n", layer->name, cluster_pos, file_pos);
+		} else {
+			partial_cluster_st* partial;
+
+			HASH_FIND(hh, layer->partial, &cluster_pos, sizeof(__uint64_t), partial);
+
+			if (partial == NULL) {
+				partial = (partial_cluster_st*)malloc(sizeof(partial_cluster_st));
+
+				partial->id = cluster_pos;
+
+				HASH_ADD(hh, layer->partial, id, sizeof(__uint64_t), partial);
+			}
+
+			partial->mask = mask;
+			partial->file_pos = file_pos;
+		}
+
+		file_pos += PARTIAL_HEADER_SIZE + NTFS_CLUSTER_SIZE;
+	}
+
+	free(cluster);
 
 	return 0;
 }
 
+/**
+ * Binary search an extent list for the first extent ending after the given
+ * cluster.
+ *
+ * @param list Extent list
+ * @param cluster_pos Cluster number
+ * @return Position of the extent in the list, or list->count if none
+ */
+static __uint64_t _extent_lower(extent_list_st* list, __uint64_t cluster_pos)
+{
+	__uint64_t lo = 0;
+	__uint64_t hi = list->count;
+
+	while (lo < hi) {
+		__uint64_t mid = lo + (hi - lo) / 2;
+
+		if (list->extent[mid].start + list->extent[mid].count <= cluster_pos) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
 
-int sort_index_by_id(cluster_index_st *a, cluster_index_st *b)
+/**
+ * Find the extent holding a cluster.
+ *
+ * @param list Extent list
+ * @param cluster_pos Cluster number
+ * @return Extent holding the cluster, or NULL if not present
+ */
+static overlay_extent_st* _extent_find(extent_list_st* list, __uint64_t cluster_pos)
 {
-	return (a->id - b->id);
+	__uint64_t i = _extent_lower(list, cluster_pos);
+
+	if (i < list->count && list->extent[i].start <= cluster_pos) {
+		return &list->extent[i];
+	}
+
+	return NULL;
+}
+
+static int _extent_adjacent(overlay_extent_st* a, overlay_extent_st* b, __uint64_t cluster_size)
+{
+	return a->layer == b->layer &&
+			a->start + a->count == b->start &&
+			a->file_pos + a->count * cluster_size == b->file_pos;
 }
 
+static void _extent_remove(extent_list_st* list, __uint64_t i)
+{
+	memmove(&list->extent[i], &list->extent[i + 1], sizeof(overlay_extent_st) * (list->count - i - 1));
 
-int save_index(dd_ctx* dd)
+	list->count--;
+}
+
+/**
+ * Record a run of clusters stored contiguously in an overlay file, replacing
+ * whatever the list held for those clusters before.  The run is merged with
+ * its neighbours when they continue it both in cluster numbers and in the
+ * overlay file.
+ *
+ * @param list Extent list
+ * @param start First cluster number of run
+ * @param count Number of clusters in run
+ * @param file_pos Position of the first cluster in the overlay file
+ * @param layer Layer holding the run (merged index only, otherwise 0)
+ * @param cluster_size Cluster size in bytes
+ */
+static void _extent_paint(extent_list_st* list, __uint64_t start, __uint64_t count, __uint64_t file_pos, int layer, __uint64_t cluster_size)
+{
+	__uint64_t end = start + count;
+
+	// Find the extents [lo, hi) overlapping the run.
+
+	__uint64_t lo = _extent_lower(list, start);
+	__uint64_t hi = lo;
+
+	while (hi < list->count && list->extent[hi].start < end) {
+		hi++;
+	}
+
+	// Build replacements: the part of the first overlapped extent left of the
+	// run, the run itself, and the part of the last overlapped extent right of
+	// the run.
+
+	overlay_extent_st replacement[3];
+	int replacement_count = 0;
+	int run_pos = 0;
+
+	if (lo < hi && list->extent[lo].start < start) {
+		replacement[replacement_count] = list->extent[lo];
+		replacement[replacement_count].count = start - list->extent[lo].start;
+
+		replacement_count++;
+		run_pos = 1;
+	}
+
+	replacement[replacement_count].start = start;
+	replacement[replacement_count].count = count;
+	replacement[replacement_count].file_pos = file_pos;
+	replacement[replacement_count].layer = layer;
+
+	replacement_count++;
+
+	if (lo < hi) {
+		overlay_extent_st* last = &list->extent[hi - 1];
+
+		if (last->start + last->count > end) {
+			replacement[replacement_count] = *last;
+			replacement[replacement_count].start = end;
+			replacement[replacement_count].count = last->start + last->count - end;
+			replacement[replacement_count].file_pos = last->file_pos + (end - last->start) * cluster_size;
+
+			replacement_count++;
+		}
+	}
+
+	// Splice replacements into the list.
+
+	__uint64_t new_count = list->count - (hi - lo) + replacement_count;
+
+	if (new_count > list->alloc) {
+		list->alloc = (list->alloc == 0) ? 64 : list->alloc * 2;
+
+		if (list->alloc < new_count) {
+			list->alloc = new_count;
+		}
+
+		list->extent = (overlay_extent_st*)realloc(list->extent, sizeof(overlay_extent_st) * list->alloc);
+	}
+
+	memmove(&list->extent[lo + replacement_count], &list->extent[hi], sizeof(overlay_extent_st) * (list->count - hi));
+	memcpy(&list->extent[lo], replacement, sizeof(overlay_extent_st) * replacement_count);
+
+	list->count = new_count;
+
+	// Merge the run with its neighbours.
+
+	__uint64_t i = lo + run_pos;
+
+	if (i + 1 < list->count && _extent_adjacent(&list->extent[i], &list->extent[i + 1], cluster_size)) {
+		list->extent[i].count += list->extent[i + 1].count;
+
+		_extent_remove(list, i + 1);
+	}
+
+	if (i > 0 && _extent_adjacent(&list->extent[i - 1], &list->extent[i], cluster_size)) {
+		list->extent[i - 1].count += list->extent[i].count;
+
+		_extent_remove(list, i);
+	}
+}
+
+/**
+ * Read a layer's index file into its extent list.  Index files in the
+ * original per-cluster format are converted as they're read.
+ *
+ * @param dd DD context struct
+ * @param layer Overlay layer
+ * @param index_file Open index file
+ * @return 0 on success, nonzero on failure
+ */
+static int _load_layer_index(dd_ctx* dd, overlay_layer_st* layer, FILE* index_file)
+{
+	char header[INDEX_HEADER_SIZE];
+	char record_bytes[INDEX_RECORD_SIZE];
+
+	__uint32_t version = 0;
+
+	__uint64_t start;
+	__uint64_t count;
+	__uint64_t file_pos;
+
+	if (fread(header, INDEX_HEADER_SIZE, 1, index_file) == 1 && memcmp(header, INDEX_MAGIC, 4) == 0) {
+		memcpy(&version, header + 4, 4);
+	}
+
+	if (version == INDEX_VERSION) {
+		while (fread(record_bytes, INDEX_RECORD_SIZE, 1, index_file) == 1) {
+			memcpy(&start, record_bytes, 8);
+			memcpy(&count, record_bytes + 8, 8);
+			memcpy(&file_pos, record_bytes + 16, 8);
+
+			_extent_paint(&layer->index, start, count, file_pos, 0, NTFS_CLUSTER_SIZE);
+		}
+
+		return 0;
+	}
+
+	if (version != 0) {
+		ERR("Overlay index %s has unsupported version %u\n", layer->index_filename, version);
+
+		return 1;
+	}
+
+	// No header; read original 16-byte records.
+
+	rewind(index_file);
+
+	while (fread(record_bytes, LEGACY_INDEX_RECORD_SIZE, 1, index_file) == 1) {
+		memcpy(&start, record_bytes, 8);
+		memcpy(&file_pos, record_bytes + 8, 8);
+
+		_extent_paint(&layer->index, start, 1, file_pos, 0, NTFS_CLUSTER_SIZE);
+	}
+
+	return 0;
+}
+
+int open_overlay(dd_ctx* dd, const char* base_filename)
+{
+	return push_overlay_layer(dd, base_filename, base_filename);
+}
+
+int push_overlay_layer(dd_ctx* dd, const char* base_filename, const char* name)
 {
 	overlay_ctx* overlay = &(dd->overlay);
 
-	struct stat statbuf;
+	overlay_layer_st layer;
+
+	memset(&layer, 0, sizeof(overlay_layer_st));
+
+	// Build filenames from base_filename.
+
+	_allocate_filenames(&layer, base_filename);
+
+	layer.name = (char*)malloc(strlen(name) + 1);
+	strcpy(layer.name, name);
+
+	// Test if index file backup exists.  Exit here if so, so the user
+	// can decide whether to keep it or remove it.
+
+	if (access(layer.index_tmp_filename, F_OK) == 0) {
+		ERR("Overlay index backup file %s found; rename to overlay index file %s or remove to continue\n", layer.index_tmp_filename, layer.index_filename);
+
+		_cleanup_layer(&layer);
+
+		return 1;
+	}
+
+	// A layer carrying a freeze marker is a read-only snapshot.
+
+	layer.frozen = (access(layer.frozen_filename, F_OK) == 0);
+
+	// Open or create overlay index file.
+
+	FILE *index_file = fopen(layer.index_filename, layer.frozen ? "rb" : "rb+");
+
+	if (index_file == NULL && !layer.frozen) {
+		index_file = fopen(layer.index_filename, "wb+");
+	}
+
+	if (index_file == NULL) {
+		ERR("Unable to open overlay index %s; %s\n", layer.index_filename, strerror(errno));
+
+		_cleanup_layer(&layer);
+
+		return 1;
+	}
+
+	// Open or create overlay file.
+
+	layer.overlay_file = fopen(layer.overlay_filename, layer.frozen ? "rb" : "rb+");
+
+	if (layer.overlay_file == NULL && !layer.frozen) {
+		layer.overlay_file = fopen(layer.overlay_filename, "wb+");
+	}
+
+	if (layer.overlay_file == NULL) {
+		ERR("Unable to open overlay %s; %s\n", layer.overlay_filename, strerror(errno));
+
+		fclose(index_file);
+
+		_cleanup_layer(&layer);
 
-	// Sort index hash.
+		return 2;
+	}
+
+	// [TODO] Verify overlay file is multiple of cluster size.
+
+	// Read index file to extent list.
 
-	HASH_SORT(overlay->index, sort_index_by_id);
+	if (_load_layer_index(dd, &layer, index_file)) {
+		fclose(index_file);
+
+		_cleanup_layer(&layer);
+
+		return 3;
+	}
+
+	// Close index file.
+
+	fclose(index_file);
+
+	// Read cluster checksums.
+
+	if (_load_layer_crcs(dd, &layer)) {
+		_cleanup_layer(&layer);
+
+		return 4;
+	}
+
+	// Read partly recovered clusters.
+
+	if (_load_layer_partials(dd, &layer)) {
+		_cleanup_layer(&layer);
+
+		return 5;
+	}
+
+	// Place the layer on top of the stack.
+
+	overlay->layers = (overlay_layer_st*)realloc(overlay->layers, sizeof(overlay_layer_st) * (overlay->layer_count + 1));
+
+	memcpy(&overlay->layers[overlay->layer_count], &layer, sizeof(overlay_layer_st));
+
+	// Clusters in the new layer shadow those in every layer below it.
+
+	for (__uint64_t i = 0; i < layer.index.count; i++) {
+		_extent_paint(&overlay->index, layer.index.extent[i].start, layer.index.extent[i].count,
+				layer.index.extent[i].file_pos, overlay->layer_count, NTFS_CLUSTER_SIZE);
+	}
+
+	overlay->layer_count++;
+
+	return 0;
+}
+
+int _save_layer_index(dd_ctx* dd, overlay_layer_st* layer)
+{
+	struct stat statbuf;
 
 	// Plan to backup the index file if it exists and contains data.
 
 	int backup = 0;
 
-	if (stat(overlay->index_filename, &statbuf) == -1) {
+	if (stat(layer->index_filename, &statbuf) == -1) {
 
 		// Exit here if unable to access the file information, unless that's
 		// because the file doesn't exist.
 
 		if (errno != ENOENT) {
-			ERR("Unable to stat() %s; %s\n", overlay->index_filename, strerror(errno));
+			ERR("Unable to stat() %s; %s\n", layer->index_filename, strerror(errno));
 
 			return 1;
 		}
@@ -195,44 +719,55 @@ int save_index(dd_ctx* dd)
 	// Rename current index file to backup if necessary.
 
 	if (backup) {
-		if (rename(overlay->index_filename, overlay->index_tmp_filename)) {
-			ERR("Unable to rename overlay index %s to %s: %s\n", overlay->index_filename, overlay->index_tmp_filename, strerror(errno));
+		if (rename(layer->index_filename, layer->index_tmp_filename)) {
+			ERR("Unable to rename overlay index %s to %s: %s\n", layer->index_filename, layer->index_tmp_filename, strerror(errno));
 
 			return 2;
 		}
 	}
 
 
-	// Save hash to index file.
+	// Save extent list to index file.  The list is kept sorted, so records
+	// are written in cluster order.
 
 	int failed_save_index = 0;
 
-	FILE *index_file = fopen(overlay->index_filename, "wb+");
+	FILE *index_file = fopen(layer->index_filename, "wb+");
 
 	if (index_file == NULL) {
-		ERR("Unable to open overlay index %s; %s\n", overlay->index_filename, strerror(errno));
+		ERR("Unable to open overlay index %s; %s\n", layer->index_filename, strerror(errno));
 
 		failed_save_index = 1;
 	}
 
-	cluster_index_st *current_cluster_index;
-	cluster_index_st *cluster_index_tmp;
+	char header[INDEX_HEADER_SIZE];
+	__uint32_t version = INDEX_VERSION;
+
+	memcpy(header, INDEX_MAGIC, 4);
+	memcpy(header + 4, &version, 4);
+
+	if (index_file != NULL && fwrite(header, INDEX_HEADER_SIZE, 1, index_file) != 1) {
+		ERR("Write to overlay index %s failed: %s\n", layer->index_filename, strerror(errno));
+
+		fclose(index_file);
+
+		index_file = NULL;
+
+		failed_save_index = 1;
+	}
 
-	char record_bytes[16];
+	unsigned char record_bytes[INDEX_RECORD_SIZE];
 
-	HASH_ITER(hh, overlay->index, current_cluster_index, cluster_index_tmp) {
-		memcpy(record_bytes, &current_cluster_index->id, 8);
-		memcpy(record_bytes + 8, &current_cluster_index->file_pos, 8);
+	for (__uint64_t i = 0; index_file != NULL && i < layer->index.count; i++) {
+		overlay_index_record(record_bytes, layer->index.extent[i].start, layer->index.extent[i].count, layer->index.extent[i].file_pos);
 
-		if (fwrite(record_bytes, 16, 1, index_file) != 1) {
-			ERR("Write to overlay index %s failed: %s\n", overlay->index_filename, strerror(errno));
+		if (fwrite(record_bytes, INDEX_RECORD_SIZE, 1, index_file) != 1) {
+			ERR("Write to overlay index %s failed: %s\n", layer->index_filename, strerror(errno));
 
 			fclose(index_file);
 
 			index_file = NULL;
 
-			unlink(overlay->index_filename);
-
 			failed_save_index = 1;
 		}
 	}
@@ -245,194 +780,723 @@ int save_index(dd_ctx* dd)
 	// If fail, restore backup to index file.
 
 	if (failed_save_index) {
-		unlink(overlay->index_filename);
+		unlink(layer->index_filename);
 
-		if (rename(overlay->index_tmp_filename, overlay->index_filename)) {
-			ERR("Unable to rename overlay index backup %s to %s: %s\n", overlay->index_tmp_filename, overlay->index_filename, strerror(errno));
+		if (backup && rename(layer->index_tmp_filename, layer->index_filename)) {
+			ERR("Unable to rename overlay index backup %s to %s: %s\n", layer->index_tmp_filename, layer->index_filename, strerror(errno));
 
 			return 3;
 		}
+
+		return 4;
 	}
 
 
 	// Otherwise, remove backup.
 
-	unlink(overlay->index_tmp_filename);
+	unlink(layer->index_tmp_filename);
 
 	return 0;
 }
 
-void close_overlay(dd_ctx* dd)
+/**
+ * Encode an index record for a run of clusters stored contiguously in an
+ * overlay file.
+ *
+ * @param record Buffer of OVERLAY_INDEX_RECORD_SIZE bytes
+ * @param start First cluster number of run
+ * @param count Number of clusters in run
+ * @param file_pos Position of the first cluster in the overlay file
+ */
+void overlay_index_record(unsigned char* record, __uint64_t start, __uint64_t count, __uint64_t file_pos)
 {
-	_cleanup_overlay(&(dd->overlay));
+	memcpy(record, &start, 8);
+	memcpy(record + 8, &count, 8);
+	memcpy(record + 16, &file_pos, 8);
 }
 
-// [TODO]
-// Cleanup.  Assign the device name to dd and remove from this call.  Make the call to initialize
-// reader deliberate so the program only throws an error regarding the device if the device needs
-// to be accessed as part of the program's operation.
+/**
+ * Save a layer's index and open its index file for appending records to, so
+ * the overlay writer can make each batch's index entries durable along with
+ * the batch.  Saving first rewrites an index in the original per-cluster
+ * format, which records can't be appended to.
+ *
+ * @param dd DD context struct
+ * @param layer_num Layer number
+ * @param index_pos Set to the end of the index file
+ * @return File descriptor, or -1 on failure
+ */
+int open_layer_index_log(dd_ctx* dd, int layer_num, __uint64_t* index_pos)
+{
+	overlay_layer_st* layer = &dd->overlay.layers[layer_num];
+
+	if (_save_layer_index(dd, layer)) {
+		return -1;
+	}
+
+	int fd = open(layer->index_filename, O_WRONLY);
+
+	if (fd == -1) {
+		ERR("Unable to open overlay index %s; %s\n", layer->index_filename, strerror(errno));
+
+		return -1;
+	}
+
+	struct stat statbuf;
+
+	if (fstat(fd, &statbuf)) {
+		ERR("Unable to stat() %s; %s\n", layer->index_filename, strerror(errno));
+
+		close(fd);
+		return -1;
+	}
+
+	*index_pos = statbuf.st_size;
+
+	return fd;
+}
 
-int recover_to_overlay(dd_ctx* dd, const char* device, __uint64_t start_cluster_pos, int num_clusters)
+int save_index(dd_ctx* dd)
 {
 	overlay_ctx* overlay = &(dd->overlay);
 
-	if (dd->reader.dev == NULL) {
-		if (init_reader(&(dd->reader), device, -1, -1)) {
-			ERR("%s", dd->reader.error_msg);
+	// Frozen layers never change, so only writable layers are saved.
 
-			return 3;
+	for (int i = 0; i < overlay->layer_count; i++) {
+		if (overlay->layers[i].frozen) {
+			continue;
 		}
 
-//		uint32_t max_lba;
-//		uint32_t block_size;
-//
-//		if (get_capacity(&(dd->reader), &max_lba, &block_size)) {
-//			printf("%s", dd->reader.error_msg);
-//
-//			return 1;
-//		}
-//
-//		printf("Max LBA: %d, block size: %d\n", max_lba, block_size);
+		int result = _save_layer_index(dd, &overlay->layers[i]);
+
+		if (result) {
+			return result;
+		}
 	}
 
-	__uint64_t cluster_pos;
+	return 0;
+}
 
-	for (cluster_pos = start_cluster_pos; cluster_pos < start_cluster_pos + num_clusters; cluster_pos++) {
+void close_overlay(dd_ctx* dd)
+{
+	overlay_ctx* overlay = &(dd->overlay);
 
-		// [TODO] Retrieve cluster from device.
-		// [TODO] Write this better!!
+	for (int i = 0; i < overlay->layer_count; i++) {
+		_cleanup_layer(&overlay->layers[i]);
+	}
+
+	free(overlay->layers);
+
+	overlay->layers = NULL;
+	overlay->layer_count = 0;
+
+	_free_extents(&overlay->index);
+}
+
+/**
+ * Freeze an overlay layer into a read-only snapshot.  The layer's index is
+ * saved, a freeze marker is written next to it so the layer stays frozen when
+ * reopened, and its overlay file is reopened read-only.  Further recoveries
+ * need a new layer pushed above it.
+ *
+ * @param dd DD context struct
+ * @param layer_num Layer number (0 is the bottom layer)
+ * @return 0 on success, nonzero on failure
+ */
+int freeze_overlay_layer(dd_ctx* dd, int layer_num)
+{
+	overlay_ctx* overlay = &(dd->overlay);
 
-		unsigned char* cluster = (unsigned char*)malloc(NTFS_CLUSTER_SIZE);
+	if (layer_num < 0 || layer_num >= overlay->layer_count) {
+		ERR("No overlay layer %d\n", layer_num);
 
-//		printf("read block %lu\n", (NTFS.partition_offset + NTFS_CLUSTER_SIZE * cluster_pos) / 512);
+		return 1;
+	}
 
-//		printf("%lu\n", NTFS.partition_offset / 512);
-//		exit(0);
+	overlay_layer_st* layer = &overlay->layers[layer_num];
+
+	if (layer->frozen) {
+		return 0;
+	}
 
-//		printf("read: %d\n", read_blocks(&dd->reader, (NTFS_CLUSTER_SIZE * cluster_pos) / 512, 8));
-//		printf("read: %d\n", read_blocks(&dd->reader, (NTFS.partition_offset + (NTFS_CLUSTER_SIZE * cluster_pos)) / 512, 8));
-//		printf("read: %d\n", read_blocks(&dd->reader, 1, 8));
+	if (_save_layer_index(dd, layer)) {
+		return 2;
+	}
 
+	// Open the read-only handles before touching the layer, so a failure
+	// leaves it writable and usable.
 
-//		if (lseek64(dd->reader.fd, NTFS.partition_offset + (NTFS_CLUSTER_SIZE * cluster_pos), SEEK_SET) == -1) {
-//		if (lseek64(dd->reader.fd, NTFS.partition_offset, SEEK_SET) == -1) {
-		FILE* fil = fopen(dd->reader.dev, "rb");
+	FILE* overlay_file = fopen(layer->overlay_filename, "rb");
 
-		printf("%lu\n", sizeof(off_t));
+	if (overlay_file == NULL) {
+		ERR("Unable to reopen overlay %s read-only: %s\n", layer->overlay_filename, strerror(errno));
 
-		if (fseeko(fil, NTFS.partition_offset + (NTFS_CLUSTER_SIZE * cluster_pos), SEEK_SET)) {
-			ERR("Seek failed on %s: %s\n", dd->reader.dev, strerror(errno));
+		return 4;
+	}
 
-			fclose(fil);
-			return 5;
+	FILE* partial_file = NULL;
+
+	if (layer->partial_file != NULL) {
+		partial_file = fopen(layer->partial_filename, "rb");
+
+		if (partial_file == NULL) {
+			ERR("Unable to reopen overlay partial clusters %s read-only: %s\n", layer->partial_filename, strerror(errno));
+
+			fclose(overlay_file);
+			return 4;
 		}
+	}
 
-		if (fread(cluster, NTFS_CLUSTER_SIZE, 1, fil) != 1) {
-			ERR("Read failed on %s: %s\n", dd->reader.dev, strerror(errno));
+	FILE* marker = fopen(layer->frozen_filename, "wb");
 
-			fclose(fil);
-			return 5;
+	if (marker == NULL) {
+		ERR("Unable to create freeze marker %s: %s\n", layer->frozen_filename, strerror(errno));
+
+		if (partial_file != NULL) {
+			fclose(partial_file);
 		}
 
-		fclose(fil);
+		fclose(overlay_file);
+		return 3;
+	}
 
-//		if (dd->reader.senseinfo.sense_key != 0) {
-//			printf("%s: Sense %02x, %02x, %02x; exiting\n",
-//							 dd->reader.error_msg, dd->reader.senseinfo.sense_key, dd->reader.senseinfo.asc, dd->reader.senseinfo.ascq);
-//		}
-//
-//		memcpy(cluster, dd->reader.buf, 4096);
+	fprintf(marker, "%s\n", layer->name);
+	fclose(marker);
 
-		// Look up cluster_pos in index.
+	fclose(layer->overlay_file);
 
-		cluster_index_st *cluster_index;
+	layer->overlay_file = overlay_file;
 
-		HASH_FIND(hh, overlay->index, &cluster_pos, sizeof(__uint64_t), cluster_index);
+	if (layer->partial_file != NULL) {
+		fclose(layer->partial_file);
 
-		if (cluster_index != NULL) {
+		layer->partial_file = partial_file;
+	}
 
-			// If the cluster already exists in the overlay, overwrite it.
+	if (layer->crc_file != NULL) {
+		fclose(layer->crc_file);
+	}
 
-			if (fseek(overlay->overlay_file, cluster_index->file_pos, SEEK_SET)) {
-				ERR("fseek to %lu failed on %s: %s\n", cluster_index->file_pos, overlay->overlay_filename, strerror(errno));
+	layer->crc_file = fopen(layer->crc_filename, "rb");
 
-				return 1;
-			}
+	layer->frozen = 1;
 
-			if (fwrite(cluster, NTFS_CLUSTER_SIZE, 1, overlay->overlay_file) != 1) {
-				ERR("Write to overlay %s failed: %s\n", overlay->overlay_filename, strerror(errno));
+	return 0;
+}
 
-				return 2;
-			}
-		} else {
 
-			// Prepare to add the cluster to the end of the overlay.
+/**
+ * Add a run of clusters already written to a layer's overlay file (and
+ * whose checksums are already in its checksum file) to the layer's index and
+ * the merged index.  Used by the overlay writer once a batch is on disk.
+ *
+ * @param dd DD context struct
+ * @param layer_num Layer the run was written to
+ * @param cluster_pos First cluster number of the run
+ * @param count Number of clusters in the run
+ * @param file_pos Position of the run in the layer's overlay file
+ * @param crcs CRC32C of each cluster in the run
+ */
+void overlay_commit_run(dd_ctx* dd, int layer_num, __uint64_t cluster_pos, __uint64_t count, __uint64_t file_pos, const __uint32_t* crcs)
+{
+	overlay_ctx* overlay = &(dd->overlay);
+	overlay_layer_st* layer = &overlay->layers[layer_num];
+
+	for (__uint64_t i = 0; i < count; i++) {
+		_store_crc(layer, file_pos / NTFS_CLUSTER_SIZE + i, crcs[i]);
+	}
+
+	_extent_paint(&layer->index, cluster_pos, count, file_pos, 0, NTFS_CLUSTER_SIZE);
 
-			if (fseek(overlay->overlay_file, 0, SEEK_END)) {
-				ERR("fseek to EOF failed on %s: %s\n", overlay->overlay_filename, strerror(errno));
+	// Only the top layer is ever written, so the run shadows everything.
 
-				return 1;
-			}
+	_extent_paint(&overlay->index, cluster_pos, count, file_pos, layer_num, NTFS_CLUSTER_SIZE);
+}
 
-			__uint64_t file_pos = ftell(overlay->overlay_file);
+int overlay_has_cluster(dd_ctx* dd, __uint64_t cluster_pos)
+{
+	_lock_index(&dd->overlay);
 
-			if (fwrite(cluster, NTFS_CLUSTER_SIZE, 1, overlay->overlay_file) != 1) {
-				ERR("Write to overlay %s failed: %s\n", overlay->overlay_filename, strerror(errno));
+	int found = (_extent_find(&dd->overlay.index, cluster_pos) != NULL);
 
-				return 2;
-			}
+	_unlock_index(&dd->overlay);
+
+	return found;
+}
+
+/**
+ * Identify the overlay's copy of a cluster, so callers can tell later
+ * whether what they read from it has changed.  A whole copy is identified
+ * by its checksum, a partial one (only used if there's no whole copy) by
+ * its sector mask and where it was written.
+ *
+ * @param dd DD context struct
+ * @param cluster_pos Cluster number
+ * @return 0 if the overlay holds no copy of the cluster, otherwise
+ *         OVERLAY_VERSION_WHOLE or OVERLAY_VERSION_PARTIAL with a 32-bit
+ *         value that changes with the copy
+ */
+__uint64_t overlay_cluster_version(dd_ctx* dd, __uint64_t cluster_pos)
+{
+	overlay_ctx* overlay = &(dd->overlay);
+
+	__uint64_t version = 0;
+
+	_lock_index(overlay);
+
+	overlay_extent_st *extent = _extent_find(&overlay->index, cluster_pos);
 
-			cluster_index = (cluster_index_st*)malloc(sizeof(cluster_index_st));
+	if (extent != NULL) {
+		overlay_layer_st* layer = &overlay->layers[extent->layer];
 
-			cluster_index->id = cluster_pos;
-			cluster_index->file_pos = file_pos;
+		__uint64_t slot = (extent->file_pos + (cluster_pos - extent->start) * NTFS_CLUSTER_SIZE) / NTFS_CLUSTER_SIZE;
 
-			HASH_ADD(hh, overlay->index, id, sizeof(__uint64_t), cluster_index);
+		version = OVERLAY_VERSION_WHOLE | ((slot < layer->crc_count) ? layer->crc[slot] : 0);
+	}
+
+	_unlock_index(overlay);
+
+	if (version != 0) {
+		return version;
+	}
+
+	for (int i = overlay->layer_count - 1; i >= 0; i--) {
+		partial_cluster_st* partial;
+
+		HASH_FIND(hh, overlay->layers[i].partial, &cluster_pos, sizeof(__uint64_t), partial);
+
+		if (partial != NULL) {
+			__uint32_t crc = crc32c(0, &partial->mask, sizeof(__uint64_t));
+
+			crc = crc32c(crc, &partial->file_pos, sizeof(__uint64_t));
+
+			return OVERLAY_VERSION_PARTIAL | ((__uint64_t)i << 32) | crc;
 		}
 	}
 
 	return 0;
 }
 
-int overlay_has_cluster(dd_ctx* dd, __uint64_t cluster_pos)
+/**
+ * Return how many clusters, starting at cluster_pos, can be read from the
+ * overlay with a single read.
+ *
+ * @param dd DD context struct
+ * @param cluster_pos First cluster number
+ * @return Length of the overlay run starting at cluster_pos (0 if the
+ *         cluster isn't in the overlay)
+ */
+__uint64_t overlay_run_length(dd_ctx* dd, __uint64_t cluster_pos)
+{
+	_lock_index(&dd->overlay);
+
+	__uint64_t run = 0;
+
+	overlay_extent_st *extent = _extent_find(&dd->overlay.index, cluster_pos);
+
+	if (extent != NULL) {
+		run = extent->start + extent->count - cluster_pos;
+	}
+
+	_unlock_index(&dd->overlay);
+
+	return run;
+}
+
+static int _read_run_from_overlay(dd_ctx* dd, unsigned char* buf, __uint64_t cluster_pos, __uint64_t num_clusters)
 {
 	overlay_ctx* overlay = &(dd->overlay);
 
-	cluster_index_st *cluster_index;
+	overlay_extent_st *extent = _extent_find(&overlay->index, cluster_pos);
+
+	if (extent == NULL || extent->start + extent->count - cluster_pos < num_clusters) {
+		return -1;
+	}
 
-	HASH_FIND(hh, overlay->index, &cluster_pos, sizeof(__uint64_t), cluster_index);
+	overlay_layer_st* layer = &overlay->layers[extent->layer];
 
-	if (cluster_index == NULL) {
-		return 0;
+	__uint64_t file_pos = extent->file_pos + (cluster_pos - extent->start) * NTFS_CLUSTER_SIZE;
+
+	// pread() so MFT scan threads can read the overlay at the same time.
+
+	ssize_t length = (ssize_t)NTFS_CLUSTER_SIZE * num_clusters;
+
+	if (pread(fileno(layer->overlay_file), buf, length, file_pos) != length) {
+		ERR("Read from overlay %s at %lu failed: %s\n", layer->overlay_filename, file_pos, strerror(errno));
+
+		return 2;
 	}
 
-	return 1;
+	// Verify clusters against their stored checksums.
+
+	if (!overlay->no_verify) {
+		__uint64_t slot = file_pos / NTFS_CLUSTER_SIZE;
+
+		for (__uint64_t i = 0; i < num_clusters && slot + i < layer->crc_count; i++) {
+			if (crc32c(0, buf + NTFS_CLUSTER_SIZE * i, NTFS_CLUSTER_SIZE) != layer->crc[slot + i]) {
+				ERR("Cluster %lu in overlay %s fails checksum\n", cluster_pos + i, layer->overlay_filename);
+
+				return 3;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Read a run of clusters from the overlay with one read.
+ *
+ * @param dd DD context struct
+ * @param buf Buffer of at least num_clusters clusters
+ * @param cluster_pos First cluster number
+ * @param num_clusters Number of clusters to read; must not exceed
+ *        overlay_run_length(dd, cluster_pos)
+ * @return -1 if the run isn't in the overlay, 0 on success, 2 on read
+ *         failure, 3 if a cluster fails its checksum
+ */
+int read_run_from_overlay(dd_ctx* dd, unsigned char* buf, __uint64_t cluster_pos, __uint64_t num_clusters)
+{
+	_lock_index(&dd->overlay);
+
+	int result = _read_run_from_overlay(dd, buf, cluster_pos, num_clusters);
+
+	_unlock_index(&dd->overlay);
+
+	return result;
 }
 
 int read_cluster_from_overlay(dd_ctx* dd, unsigned char* cluster, __uint64_t cluster_pos)
+{
+	return read_run_from_overlay(dd, cluster, cluster_pos, 1);
+}
+
+/**
+ * Read the sectors of a partly recovered cluster, from the topmost layer
+ * holding it.  Only the sectors that were read are copied into cluster;
+ * the rest of it is left alone.
+ *
+ * @param dd DD context struct
+ * @param cluster Cluster buffer
+ * @param cluster_pos Cluster number
+ * @return Mask of the sectors copied (see OVERLAY_SECTOR_SIZE), 0 if the
+ *         cluster isn't partly recovered or can't be read
+ */
+__uint64_t read_partial_cluster(dd_ctx* dd, unsigned char* cluster, __uint64_t cluster_pos)
 {
 	overlay_ctx* overlay = &(dd->overlay);
 
-	cluster_index_st *cluster_index;
+	for (int i = overlay->layer_count - 1; i >= 0; i--) {
+		overlay_layer_st* layer = &overlay->layers[i];
 
-	HASH_FIND(hh, overlay->index, &cluster_pos, sizeof(__uint64_t), cluster_index);
+		partial_cluster_st* partial;
 
-	if (cluster_index == NULL) {
-		return -1;
+		HASH_FIND(hh, layer->partial, &cluster_pos, sizeof(__uint64_t), partial);
+
+		if (partial == NULL) {
+			continue;
+		}
+
+		unsigned char header[PARTIAL_HEADER_SIZE];
+		unsigned char* data = (unsigned char*)malloc(NTFS_CLUSTER_SIZE);
+
+		if (pread(fileno(layer->partial_file), header, PARTIAL_HEADER_SIZE, partial->file_pos) != PARTIAL_HEADER_SIZE ||
+				pread(fileno(layer->partial_file), data, NTFS_CLUSTER_SIZE, partial->file_pos + PARTIAL_HEADER_SIZE) != NTFS_CLUSTER_SIZE) {
+			ERR("Read from overlay partial clusters %s failed: %s\n", layer->partial_filename, strerror(errno));
+
+			free(data);
+			return 0;
+		}
+
+		__uint32_t crc;
+
+		memcpy(&crc, header + 16, 4);
+
+		if (!overlay->no_verify && crc32c(0, data, NTFS_CLUSTER_SIZE) != crc) {
+			ERR("Partial cluster %lu in overlay %s fails checksum\n", cluster_pos, layer->partial_filename);
+
+			free(data);
+			return 0;
+		}
+
+		int sectors = NTFS_CLUSTER_SIZE / OVERLAY_SECTOR_SIZE;
+
+		for (int j = 0; j < sectors && j < 64; j++) {
+			if (partial->mask & ((__uint64_t)1 << j)) {
+				memcpy(cluster + OVERLAY_SECTOR_SIZE * j, data + OVERLAY_SECTOR_SIZE * j, OVERLAY_SECTOR_SIZE);
+			}
+		}
+
+		free(data);
+
+		return partial->mask;
 	}
 
-	if (fseek(overlay->overlay_file, cluster_index->file_pos, SEEK_SET)) {
-		ERR("fseek to %lu failed on %s: %s\n", cluster_index->file_pos, overlay->overlay_filename, strerror(errno));
+	return 0;
+}
+
+/**
+ * Store a partly recovered cluster in the top overlay layer, replacing any
+ * earlier copy of it there.  Unread sectors are stored zeroed.
+ *
+ * @param dd DD context struct
+ * @param cluster Cluster buffer
+ * @param cluster_pos Cluster number
+ * @param mask Sectors of cluster that were read (see OVERLAY_SECTOR_SIZE)
+ * @return 0 on success, nonzero on failure
+ */
+int write_partial_cluster(dd_ctx* dd, const unsigned char* cluster, __uint64_t cluster_pos, __uint64_t mask)
+{
+	overlay_ctx* overlay = &(dd->overlay);
+
+	if (overlay->layer_count == 0 || overlay->layers[overlay->layer_count - 1].frozen) {
+		ERR("Top overlay layer is frozen; push a new layer to store partial clusters\n");
 
 		return 1;
 	}
 
-	if (fread(cluster, NTFS_CLUSTER_SIZE, 1, overlay->overlay_file) != 1) {
-		ERR("Read from overlay %s failed: %s\n", overlay->overlay_filename, strerror(errno));
+	overlay_layer_st* layer = &overlay->layers[overlay->layer_count - 1];
 
-		return 2;
+	if (layer->partial_file == NULL) {
+		layer->partial_file = fopen(layer->partial_filename, "wb+");
+
+		if (layer->partial_file == NULL) {
+			ERR("Unable to open overlay partial clusters %s; %s\n", layer->partial_filename, strerror(errno));
+
+			return 2;
+		}
 	}
 
+	unsigned char header[PARTIAL_HEADER_SIZE];
+	unsigned char* data = (unsigned char*)malloc(NTFS_CLUSTER_SIZE);
+
+	int sectors = NTFS_CLUSTER_SIZE / OVERLAY_SECTOR_SIZE;
+
+	for (int j = 0; j < sectors; j++) {
+		if (j < 64 && (mask & ((__uint64_t)1 << j))) {
+			memcpy(data + OVERLAY_SECTOR_SIZE * j, cluster + OVERLAY_SECTOR_SIZE * j, OVERLAY_SECTOR_SIZE);
+		} else {
+			memset(data + OVERLAY_SECTOR_SIZE * j, 0, OVERLAY_SECTOR_SIZE);
+		}
+	}
+
+	__uint32_t crc = crc32c(0, data, NTFS_CLUSTER_SIZE);
+
+	memset(header, 0, PARTIAL_HEADER_SIZE);
+	memcpy(header, &cluster_pos, 8);
+	memcpy(header + 8, &mask, 8);
+	memcpy(header + 16, &crc, 4);
+
+	if (fseek(layer->partial_file, 0, SEEK_END)) {
+		ERR("fseek to EOF failed on %s: %s\n", layer->partial_filename, strerror(errno));
+
+		free(data);
+		return 3;
+	}
+
+	__uint64_t file_pos = ftell(layer->partial_file);
+
+	if (fwrite(header, PARTIAL_HEADER_SIZE, 1, layer->partial_file) != 1 ||
+			fwrite(data, NTFS_CLUSTER_SIZE, 1, layer->partial_file) != 1 ||
+			fflush(layer->partial_file)) {
+		ERR("Write to overlay partial clusters %s failed: %s\n", layer->partial_filename, strerror(errno));
+
+		free(data);
+		return 4;
+	}
+
+	free(data);
+
+	partial_cluster_st* partial;
+
+	HASH_FIND(hh, layer->partial, &cluster_pos, sizeof(__uint64_t), partial);
+
+	if (partial == NULL) {
+		partial = (partial_cluster_st*)malloc(sizeof(partial_cluster_st));
+
+		partial->id = cluster_pos;
+
+		HASH_ADD(hh, layer->partial, id, sizeof(__uint64_t), partial);
+	}
+
+	partial->mask = mask;
+	partial->file_pos = file_pos;
+
 	return 0;
 }
 
+/**
+ * Find which cluster is stored at a slot of a layer's overlay file.
+ *
+ * @return Cluster number, or UINT64_MAX if the slot isn't indexed
+ */
+static __uint64_t _slot_cluster(dd_ctx* dd, overlay_layer_st* layer, __uint64_t slot)
+{
+	__uint64_t file_pos = slot * NTFS_CLUSTER_SIZE;
+
+	for (__uint64_t i = 0; i < layer->index.count; i++) {
+		overlay_extent_st* extent = &layer->index.extent[i];
+
+		if (file_pos >= extent->file_pos && file_pos < extent->file_pos + extent->count * NTFS_CLUSTER_SIZE) {
+			return extent->start + (file_pos - extent->file_pos) / NTFS_CLUSTER_SIZE;
+		}
+	}
+
+	return UINT64_MAX;
+}
+
+/**
+ * Verify a range of a layer's overlay file against its stored checksums,
+ * reading it in large chunks and printing any cluster that fails.
+ *
+ * @return Number of clusters failing their checksum, or -1 on read failure
+ */
+static long _verify_layer_slots(dd_ctx* dd, overlay_layer_st* layer, unsigned char* buf, __uint32_t* crcs, __uint64_t first_slot, __uint64_t num_slots)
+{
+	long failed = 0;
+
+	if (fseek(layer->overlay_file, first_slot * NTFS_CLUSTER_SIZE, SEEK_SET)) {
+		ERR("fseek failed on %s: %s\n", layer->overlay_filename, strerror(errno));
+
+		return -1;
+	}
+
+	for (__uint64_t slot = first_slot; slot < first_slot + num_slots; ) {
+		__uint64_t count = first_slot + num_slots - slot;
+
+		if (count > VERIFY_CHUNK_CLUSTERS) {
+			count = VERIFY_CHUNK_CLUSTERS;
+		}
+
+		if (fread(buf, NTFS_CLUSTER_SIZE, count, layer->overlay_file) != count) {
+			ERR("Read from overlay %s failed: %s\n", layer->overlay_filename, strerror(errno));
+
+			return -1;
+		}
+
+		crc32c_blocks(buf, NTFS_CLUSTER_SIZE, count, crcs);
+
+		// A running overlay writer may realloc layer->crc and the index.
+
+		_lock_index(&dd->overlay);
+
+		for (__uint64_t i = 0; i < count; i++) {
+			if (crcs[i] != layer->crc[slot + i]) {
+				printf("%s: cluster %lu at overlay offset %lX fails checksum\n",
+						layer->name, _slot_cluster(dd, layer, slot + i), (slot + i) * NTFS_CLUSTER_SIZE);
+
+				failed++;
+			}
+		}
+
+		_unlock_index(&dd->overlay);
+
+		slot += count;
+	}
+
+	return failed;
+}
+
+/**
+ * Verify every cluster of every overlay layer against its stored checksum.
+ *
+ * @param dd DD context struct
+ * @return Number of clusters failing their checksum, or -1 on read failure
+ */
+long verify_overlay(dd_ctx* dd)
+{
+	overlay_ctx* overlay = &(dd->overlay);
+
+	unsigned char* buf = (unsigned char*)malloc(NTFS_CLUSTER_SIZE * VERIFY_CHUNK_CLUSTERS);
+	__uint32_t* crcs = (__uint32_t*)malloc(sizeof(__uint32_t) * VERIFY_CHUNK_CLUSTERS);
+
+	long failed = 0;
+
+	for (int i = 0; i < overlay->layer_count; i++) {
+		_lock_index(overlay);
+
+		__uint64_t num_slots = overlay->layers[i].crc_count;
+
+		_unlock_index(overlay);
+
+		long layer_failed = _verify_layer_slots(dd, &overlay->layers[i], buf, crcs, 0, num_slots);
+
+		if (layer_failed < 0) {
+			failed = -1;
+			break;
+		}
+
+		failed += layer_failed;
+	}
+
+	free(crcs);
+	free(buf);
+
+	return failed;
+}
+
+/**
+ * Verify the next max_clusters overlay clusters against their checksums,
+ * picking up where the previous call left off and wrapping around at the
+ * end.  Call between other work to scrub the overlay in the background.
+ *
+ * @param dd DD context struct
+ * @param max_clusters Most clusters to verify in this call
+ * @return Number of clusters failing their checksum, or -1 on read failure
+ */
+long scrub_overlay(dd_ctx* dd, __uint64_t max_clusters)
+{
+	overlay_ctx* overlay = &(dd->overlay);
+
+	if (overlay->layer_count == 0) {
+		return 0;
+	}
+
+	if (max_clusters > VERIFY_CHUNK_CLUSTERS) {
+		max_clusters = VERIFY_CHUNK_CLUSTERS;
+	}
+
+	if (overlay->scrub_layer >= overlay->layer_count) {
+		overlay->scrub_layer = 0;
+		overlay->scrub_slot = 0;
+	}
+
+	overlay_layer_st* layer = &overlay->layers[overlay->scrub_layer];
+
+	_lock_index(overlay);
+
+	__uint64_t crc_count = layer->crc_count;
+
+	_unlock_index(overlay);
+
+	__uint64_t count = 0;
+
+	if (overlay->scrub_slot < crc_count) {
+		count = crc_count - overlay->scrub_slot;
+	}
+
+	if (count > max_clusters) {
+		count = max_clusters;
+	}
+
+	long failed = 0;
+
+	if (count > 0) {
+		unsigned char* buf = (unsigned char*)malloc(NTFS_CLUSTER_SIZE * count);
+		__uint32_t* crcs = (__uint32_t*)malloc(sizeof(__uint32_t) * count);
+
+		failed = _verify_layer_slots(dd, layer, buf, crcs, overlay->scrub_slot, count);
+
+		free(crcs);
+		free(buf);
+	}
+
+	overlay->scrub_slot += count;
+
+	if (overlay->scrub_slot >= crc_count) {
+		overlay->scrub_layer++;
+		overlay->scrub_slot = 0;
+	}
+
+	return failed;
+}
@@ -33,12 +33,39 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 int open_overlay(dd_ctx* dd, const char* base_filename);
 
+int push_overlay_layer(dd_ctx* dd, const char* base_filename, const char* name);
+
+int freeze_overlay_layer(dd_ctx* dd, int layer_num);
+
 int save_index(dd_ctx* dd);
 
+#define OVERLAY_INDEX_RECORD_SIZE 24
+
+void overlay_index_record(unsigned char* record, __uint64_t start, __uint64_t count, __uint64_t file_pos);
+
+int open_layer_index_log(dd_ctx* dd, int layer_num, __uint64_t* index_pos);
+
 void close_overlay(dd_ctx* dd);
 
-int recover_to_overlay(dd_ctx* dd, const char* device, __uint64_t start_cluster_pos, int num_clusters);
+void overlay_commit_run(dd_ctx* dd, int layer_num, __uint64_t cluster_pos, __uint64_t count, __uint64_t file_pos, const __uint32_t* crcs);
 
 int read_cluster_from_overlay(dd_ctx* dd, unsigned char* cluster, __uint64_t cluster_pos);
 
+__uint64_t read_partial_cluster(dd_ctx* dd, unsigned char* cluster, __uint64_t cluster_pos);
+
+int write_partial_cluster(dd_ctx* dd, const unsigned char* cluster, __uint64_t cluster_pos, __uint64_t mask);
+
+__uint64_t overlay_run_length(dd_ctx* dd, __uint64_t cluster_pos);
+
+int read_run_from_overlay(dd_ctx* dd, unsigned char* buf, __uint64_t cluster_pos, __uint64_t num_clusters);
+
 int overlay_has_cluster(dd_ctx* dd, __uint64_t cluster_pos);
+
+#define OVERLAY_VERSION_WHOLE ((__uint64_t)1 << 63)
+#define OVERLAY_VERSION_PARTIAL ((__uint64_t)1 << 62)
+
+__uint64_t overlay_cluster_version(dd_ctx* dd, __uint64_t cluster_pos);
+
+long verify_overlay(dd_ctx* dd);
+
+long scrub_overlay(dd_ctx* dd, __uint64_t max_clusters);
@@ -0,0 +1,513 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "overlay_writer.h"
+#include "overlay.h"
+#include "crc32c.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define ERR(...) \
+	if (dd->error == 0) { \
+		memset(dd->error_msg, 0, 4096); \
+		dd->error = 1; \
+	} \
+	dd->error = 1; \
+	snprintf(dd->error_msg + strlen(dd->error_msg), 4096 - strlen(dd->error_msg), __VA_ARGS__);
+
+#define WRITER_ERR(...) \
+	if (writer->error == 0) { \
+		writer->error = 1; \
+		snprintf(writer->error_msg, 4096, __VA_ARGS__); \
+	}
+
+// Longest a partly filled batch waits for more clusters before it's written.
+
+#define BATCH_WAIT_MS 50
+
+// Buffers per pwritev() call (Linux's IOV_MAX.)
+
+#define WRITE_IOV_MAX 1024
+
+static void _alloc_entries(overlay_writer_entry_st** entries, int count, int cluster_size)
+{
+	*entries = (overlay_writer_entry_st*)malloc(sizeof(overlay_writer_entry_st) * count);
+
+	for (int i = 0; i < count; i++) {
+		(*entries)[i].data = (unsigned char*)malloc(cluster_size);
+	}
+}
+
+static void _free_entries(overlay_writer_entry_st* entries, int count)
+{
+	if (entries == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < count; i++) {
+		free(entries[i].data);
+	}
+
+	free(entries);
+}
+
+/**
+ * Undo a batch that failed part way: hand its file positions out again and
+ * cut the overlay, checksum and index files back to where they ended before
+ * it, so a later writer doesn't append beyond a stretch nothing indexes.
+ */
+static void _rollback_batch(overlay_writer_st* writer)
+{
+	__uint64_t file_pos = writer->writing[0].file_pos;
+
+	if (ftruncate(writer->fd, file_pos) ||
+			ftruncate(writer->crc_fd, (file_pos / writer->cluster_size) * 4) ||
+			ftruncate(writer->index_fd, writer->index_pos)) {
+		pthread_mutex_lock(&writer->lock);
+		WRITER_ERR("Unable to truncate overlay after failed write: %s\n", strerror(errno));
+		pthread_mutex_unlock(&writer->lock);
+	}
+
+	pthread_mutex_lock(&writer->lock);
+
+	writer->next_pos = file_pos;
+
+	pthread_mutex_unlock(&writer->lock);
+}
+
+/**
+ * Write the current batch to the overlay, its checksums to the checksum file
+ * and its extents to the index file, sync the three, then publish the batch
+ * in the overlay index.  Called by the writer thread without the lock held.
+ */
+static void _write_batch(overlay_writer_st* writer)
+{
+	overlay_writer_entry_st* batch = writer->writing;
+	int count = writer->writing_count;
+
+	// File positions were handed out in submission order, so the batch is one
+	// contiguous stretch of the overlay file.
+
+	struct iovec iov[WRITE_IOV_MAX];
+
+	__uint64_t file_pos = batch[0].file_pos;
+
+	for (int i = 0; i < count; ) {
+		int iov_count = 0;
+
+		while (i + iov_count < count && iov_count < WRITE_IOV_MAX) {
+			iov[iov_count].iov_base = batch[i + iov_count].data;
+			iov[iov_count].iov_len = writer->cluster_size;
+
+			iov_count++;
+		}
+
+		ssize_t expected = (ssize_t)iov_count * writer->cluster_size;
+
+		if (pwritev(writer->fd, iov, iov_count, file_pos) != expected) {
+			pthread_mutex_lock(&writer->lock);
+			WRITER_ERR("Write to overlay failed at %lu: %s\n", file_pos, strerror(errno));
+			pthread_mutex_unlock(&writer->lock);
+
+			_rollback_batch(writer);
+			return;
+		}
+
+		file_pos += expected;
+		i += iov_count;
+	}
+
+	__uint32_t* crcs = (__uint32_t*)malloc(sizeof(__uint32_t) * count);
+
+	for (int i = 0; i < count; i++) {
+		crcs[i] = batch[i].crc;
+	}
+
+	// One index record per run of consecutive clusters.
+
+	int* run_start = (int*)malloc(sizeof(int) * (count + 1));
+	int run_count = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (i == 0 || batch[i].cluster_pos != batch[i - 1].cluster_pos + 1) {
+			run_start[run_count++] = i;
+		}
+	}
+
+	run_start[run_count] = count;
+
+	unsigned char* records = (unsigned char*)malloc(OVERLAY_INDEX_RECORD_SIZE * run_count);
+
+	for (int r = 0; r < run_count; r++) {
+		overlay_writer_entry_st* first = &batch[run_start[r]];
+
+		overlay_index_record(records + OVERLAY_INDEX_RECORD_SIZE * r, first->cluster_pos, run_start[r + 1] - run_start[r], first->file_pos);
+	}
+
+	// Checksums and index records are written before the sync, so the batch
+	// is durable all at once.  Should a crash leave an index record on disk
+	// without its clusters, reading them fails their checksum rather than
+	// returning stale data.
+
+	ssize_t crcs_size = sizeof(__uint32_t) * count;
+	ssize_t records_size = OVERLAY_INDEX_RECORD_SIZE * run_count;
+
+	const char* failed = NULL;
+
+	if (pwrite(writer->crc_fd, crcs, crcs_size, (batch[0].file_pos / writer->cluster_size) * 4) != crcs_size) {
+		failed = "Write to overlay checksums";
+	} else if (pwrite(writer->index_fd, records, records_size, writer->index_pos) != records_size) {
+		failed = "Write to overlay index";
+	} else if (fdatasync(writer->fd) || fdatasync(writer->crc_fd) || fdatasync(writer->index_fd)) {
+		failed = "fdatasync on overlay";
+	}
+
+	free(records);
+
+	if (failed != NULL) {
+		pthread_mutex_lock(&writer->lock);
+		WRITER_ERR("%s failed: %s\n", failed, strerror(errno));
+		pthread_mutex_unlock(&writer->lock);
+
+		_rollback_batch(writer);
+
+		free(run_start);
+		free(crcs);
+		return;
+	}
+
+	writer->index_pos += records_size;
+
+	// Publish the batch.
+
+	pthread_mutex_lock(&writer->lock);
+
+	for (int r = 0; r < run_count; r++) {
+		overlay_writer_entry_st* first = &batch[run_start[r]];
+
+		overlay_commit_run(writer->dd, writer->layer_num, first->cluster_pos, run_start[r + 1] - run_start[r],
+				first->file_pos, crcs + run_start[r]);
+	}
+
+	writer->committed += count;
+
+	pthread_cond_broadcast(&writer->batch_done);
+
+	pthread_mutex_unlock(&writer->lock);
+
+	free(run_start);
+	free(crcs);
+}
+
+static void* _writer_thread(void* param)
+{
+	overlay_writer_st* writer = (overlay_writer_st*)param;
+
+	pthread_mutex_lock(&writer->lock);
+
+	while (1) {
+		// Wait for a full batch, a flush or stop request, or the batch timer.
+
+		while (writer->pending_count == 0 && !writer->stop) {
+			pthread_cond_wait(&writer->batch_ready, &writer->lock);
+		}
+
+		if (writer->pending_count < writer->batch_clusters && !writer->stop && !writer->flush) {
+			struct timespec deadline;
+
+			clock_gettime(CLOCK_REALTIME, &deadline);
+
+			deadline.tv_nsec += BATCH_WAIT_MS * 1000000l;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000l;
+			deadline.tv_nsec %= 1000000000l;
+
+			while (writer->pending_count < writer->batch_clusters && !writer->stop && !writer->flush) {
+				if (pthread_cond_timedwait(&writer->batch_ready, &writer->lock, &deadline) == ETIMEDOUT) {
+					break;
+				}
+			}
+		}
+
+		if (writer->pending_count == 0) {
+			writer->flush = 0;
+
+			if (writer->stop) {
+				break;
+			}
+
+			continue;
+		}
+
+		if (writer->committed + writer->pending_count >= writer->flush_target) {
+			writer->flush = 0;
+		}
+
+		// Swap the pending batch out so producers can keep submitting while
+		// it's written.
+
+		overlay_writer_entry_st* swap = writer->writing;
+
+		writer->writing = writer->pending;
+		writer->writing_count = writer->pending_count;
+
+		writer->pending = swap;
+		writer->pending_count = 0;
+
+		pthread_cond_broadcast(&writer->batch_done);
+
+		pthread_mutex_unlock(&writer->lock);
+
+		_write_batch(writer);
+
+		pthread_mutex_lock(&writer->lock);
+
+		writer->writing_count = 0;
+
+		if (writer->error) {
+			// Release anyone waiting; they'll see the error.
+
+			writer->committed = writer->submitted;
+
+			pthread_cond_broadcast(&writer->batch_done);
+		}
+	}
+
+	pthread_mutex_unlock(&writer->lock);
+
+	return NULL;
+}
+
+/**
+ * Start a writer appending to the top overlay layer.  While it runs,
+ * recover_to_overlay() submits through it and overlay lookups take its lock.
+ *
+ * @param dd DD context struct
+ * @param writer Writer to start
+ * @param batch_clusters Clusters per batch (-1 for default)
+ * @return 0 on success, nonzero on failure
+ */
+int start_overlay_writer(dd_ctx* dd, overlay_writer_st* writer, int batch_clusters)
+{
+	overlay_ctx* overlay = &(dd->overlay);
+
+	memset(writer, 0, sizeof(overlay_writer_st));
+
+	if (overlay->layer_count == 0) {
+		ERR("No overlay layer open to recover into\n");
+
+		return 1;
+	}
+
+	writer->layer_num = overlay->layer_count - 1;
+
+	overlay_layer_st* layer = &overlay->layers[writer->layer_num];
+
+	if (layer->frozen) {
+		ERR("Top overlay layer %s is frozen; push a new layer to recover into\n", layer->name);
+
+		return 1;
+	}
+
+	writer->dd = dd;
+	writer->cluster_size = NTFS_CLUSTER_SIZE;
+	writer->batch_clusters = (batch_clusters > 0) ? batch_clusters : 256;
+
+	// Everything written through the layer's FILE handles so far must reach
+	// the files before writing around them.
+
+	fflush(layer->overlay_file);
+	fflush(layer->crc_file);
+
+	writer->fd = fileno(layer->overlay_file);
+	writer->crc_fd = fileno(layer->crc_file);
+
+	writer->index_fd = open_layer_index_log(dd, writer->layer_num, &writer->index_pos);
+
+	if (writer->index_fd == -1) {
+		return 2;
+	}
+
+	struct stat statbuf;
+
+	if (fstat(writer->fd, &statbuf)) {
+		ERR("Unable to stat() %s; %s\n", layer->overlay_filename, strerror(errno));
+
+		close(writer->index_fd);
+		return 2;
+	}
+
+	writer->next_pos = statbuf.st_size;
+
+	_alloc_entries(&writer->pending, writer->batch_clusters, writer->cluster_size);
+	_alloc_entries(&writer->writing, writer->batch_clusters, writer->cluster_size);
+
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->batch_ready, NULL);
+	pthread_cond_init(&writer->batch_done, NULL);
+
+	if (pthread_create(&writer->thread, NULL, &_writer_thread, writer)) {
+		ERR("Unable to start overlay writer thread\n");
+
+		close(writer->index_fd);
+
+		_free_entries(writer->pending, writer->batch_clusters);
+		_free_entries(writer->writing, writer->batch_clusters);
+
+		return 3;
+	}
+
+	overlay->writer = writer;
+
+	return 0;
+}
+
+/**
+ * Queue a recovered cluster for the overlay.  Safe to call from any number of
+ * threads; blocks while the pending batch is full.  The cluster is readable
+ * from the overlay once its batch is committed (see overlay_writer_flush().)
+ *
+ * @param writer Running writer
+ * @param cluster_pos Cluster number
+ * @param data Cluster contents (copied before returning)
+ * @return 0 on success, nonzero if the writer has failed
+ */
+int overlay_writer_submit(overlay_writer_st* writer, __uint64_t cluster_pos, const unsigned char* data)
+{
+	// Checksum outside the lock so producers compute them in parallel.
+
+	__uint32_t crc = crc32c(0, data, writer->cluster_size);
+
+	pthread_mutex_lock(&writer->lock);
+
+	while (writer->pending_count == writer->batch_clusters && !writer->error) {
+		pthread_cond_wait(&writer->batch_done, &writer->lock);
+	}
+
+	if (writer->error) {
+		pthread_mutex_unlock(&writer->lock);
+
+		return 1;
+	}
+
+	overlay_writer_entry_st* entry = &writer->pending[writer->pending_count++];
+
+	entry->cluster_pos = cluster_pos;
+	entry->file_pos = writer->next_pos;
+	entry->crc = crc;
+
+	memcpy(entry->data, data, writer->cluster_size);
+
+	writer->next_pos += writer->cluster_size;
+	writer->submitted++;
+
+	if (writer->pending_count == writer->batch_clusters || writer->pending_count == 1) {
+		pthread_cond_signal(&writer->batch_ready);
+	}
+
+	pthread_mutex_unlock(&writer->lock);
+
+	return 0;
+}
+
+/**
+ * Wait until every cluster submitted so far is on disk and in the index.
+ *
+ * @param writer Running writer
+ * @return 0 on success, nonzero if the writer has failed
+ */
+int overlay_writer_flush(overlay_writer_st* writer)
+{
+	pthread_mutex_lock(&writer->lock);
+
+	__uint64_t target = writer->submitted;
+
+	if (writer->committed < target) {
+		writer->flush = 1;
+		writer->flush_target = target;
+
+		pthread_cond_signal(&writer->batch_ready);
+	}
+
+	while (writer->committed < target && !writer->error) {
+		pthread_cond_wait(&writer->batch_done, &writer->lock);
+	}
+
+	int error = writer->error;
+
+	pthread_mutex_unlock(&writer->lock);
+
+	return error;
+}
+
+/**
+ * Write out anything still queued and stop the writer thread.  Writer errors
+ * are copied to the DD context.
+ *
+ * @param writer Running writer
+ * @return 0 on success, nonzero if the writer failed at any point
+ */
+int stop_overlay_writer(overlay_writer_st* writer)
+{
+	dd_ctx* dd = writer->dd;
+
+	pthread_mutex_lock(&writer->lock);
+
+	writer->stop = 1;
+
+	pthread_cond_signal(&writer->batch_ready);
+
+	pthread_mutex_unlock(&writer->lock);
+
+	pthread_join(writer->thread, NULL);
+
+	dd->overlay.writer = NULL;
+
+	close(writer->index_fd);
+
+	_free_entries(writer->pending, writer->batch_clusters);
+	_free_entries(writer->writing, writer->batch_clusters);
+
+	writer->pending = NULL;
+	writer->writing = NULL;
+
+	pthread_cond_destroy(&writer->batch_done);
+	pthread_cond_destroy(&writer->batch_ready);
+	pthread_mutex_destroy(&writer->lock);
+
+	if (writer->error) {
+		ERR("%s", writer->error_msg);
+
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "dd.h"
+
+#include <pthread.h>
+
+// Accepts recovered clusters from any number of threads and appends them to
+// the top overlay layer in batches: one pwritev() per batch, with the batch's
+// checksums and index records appended to their files before one sync of
+// all three, after which the batch's index entries are published.  Clusters
+// rewritten by a later recovery are appended again; the index points at the
+// newest copy.
+
+typedef struct overlay_writer_entry_st {
+	__uint64_t cluster_pos;
+	__uint64_t file_pos;
+	__uint32_t crc;
+	unsigned char* data;
+} overlay_writer_entry_st;
+
+typedef struct overlay_writer_st {
+	dd_ctx* dd;
+
+	int layer_num;
+	int fd; // Top layer's overlay file
+	int crc_fd; // Top layer's checksum file
+	int index_fd; // Top layer's index file, appended to per batch
+	__uint64_t index_pos; // End of the index file; writer thread only
+
+	int cluster_size;
+	int batch_clusters; // Clusters per batch
+
+	pthread_mutex_t lock; // Guards everything below, and the overlay index
+	pthread_cond_t batch_ready;
+	pthread_cond_t batch_done;
+
+	__uint64_t next_pos; // File position handed to the next submitted cluster
+
+	overlay_writer_entry_st* pending; // Waiting for the next batch
+	int pending_count;
+
+	overlay_writer_entry_st* writing; // Batch being written
+	int writing_count;
+
+	__uint64_t submitted; // Clusters submitted so far
+	__uint64_t committed; // Clusters on disk and in the index so far
+
+	int stop;
+	int flush; // Write the pending batch without waiting for it to fill
+	__uint64_t flush_target;
+
+	int error;
+	char error_msg[4096];
+
+	pthread_t thread;
+} overlay_writer_st;
+
+int start_overlay_writer(dd_ctx* dd, overlay_writer_st* writer, int batch_clusters);
+
+int overlay_writer_submit(overlay_writer_st* writer, __uint64_t cluster_pos, const unsigned char* data);
+
+int overlay_writer_flush(overlay_writer_st* writer);
+
+int stop_overlay_writer(overlay_writer_st* writer);
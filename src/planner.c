@@ -0,0 +1,462 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "planner.h"
+#include "overlay.h"
+
+#include <string.h>
+
+// Max-heap of files by weight per missing cluster.  Entries go stale when a
+// file's missing count changes; a fresh entry is pushed and the stale one
+// skipped when it surfaces.
+
+typedef struct heap_entry_st {
+	double score;
+	__uint32_t file;
+	__uint32_t missing; // File's missing count when pushed
+} heap_entry_st;
+
+typedef struct heap_st {
+	heap_entry_st* entry;
+	__uint64_t count;
+	__uint64_t alloc;
+} heap_st;
+
+static void _heap_push(heap_st* heap, double score, __uint32_t file, __uint32_t missing)
+{
+	if (heap->count == heap->alloc) {
+		heap->alloc = (heap->alloc == 0) ? 1024 : heap->alloc * 2;
+		heap->entry = (heap_entry_st*)realloc(heap->entry, sizeof(heap_entry_st) * heap->alloc);
+	}
+
+	__uint64_t pos = heap->count++;
+
+	while (pos > 0 && heap->entry[(pos - 1) / 2].score < score) {
+		heap->entry[pos] = heap->entry[(pos - 1) / 2];
+		pos = (pos - 1) / 2;
+	}
+
+	heap->entry[pos].score = score;
+	heap->entry[pos].file = file;
+	heap->entry[pos].missing = missing;
+}
+
+static heap_entry_st _heap_pop(heap_st* heap)
+{
+	heap_entry_st top = heap->entry[0];
+	heap_entry_st last = heap->entry[--heap->count];
+
+	__uint64_t pos = 0;
+
+	while (1) {
+		__uint64_t child = pos * 2 + 1;
+
+		if (child >= heap->count) {
+			break;
+		}
+
+		if (child + 1 < heap->count && heap->entry[child + 1].score > heap->entry[child].score) {
+			child++;
+		}
+
+		if (heap->entry[child].score <= last.score) {
+			break;
+		}
+
+		heap->entry[pos] = heap->entry[child];
+		pos = child;
+	}
+
+	if (heap->count > 0) {
+		heap->entry[pos] = last;
+	}
+
+	return top;
+}
+
+static int _sort_by_id(bad_cluster_st *a, bad_cluster_st *b)
+{
+	return (a->id > b->id) - (a->id < b->id);
+}
+
+static plan_cluster_st* _find_cluster(planner_ctx* planner, __uint64_t cluster)
+{
+	plan_cluster_st* plan_cluster;
+
+	HASH_FIND(hh, planner->cluster_hash, &cluster, sizeof(__uint64_t), plan_cluster);
+
+	return plan_cluster;
+}
+
+/**
+ * Build the planner's file and cluster tables from the bad cluster lists.
+ * Clusters already in the overlay count as recovered.
+ *
+ * @param dd DD context struct
+ * @param planner Planner to initialize
+ * @param prio Ranked files for weights (NULL to weigh every file equally)
+ * @return 0 on success
+ */
+int init_planner(dd_ctx* dd, planner_ctx* planner, priority_ctx* prio)
+{
+	bad_cluster_by_mft_index_st *current_bad_clusters_by_mft_index;
+	bad_cluster_by_mft_index_st *bad_clusters_by_mft_index_tmp;
+
+	bad_cluster_st *current_bad_cluster;
+	bad_cluster_st *bad_cluster_tmp;
+
+	memset(planner, 0, sizeof(planner_ctx));
+
+	// Number the clusters in cluster order.  The array is sized up front so
+	// the hash can point into it.
+
+	HASH_SORT(dd->bad_clusters, _sort_by_id);
+
+	planner->cluster = (plan_cluster_st*)malloc(sizeof(plan_cluster_st) * (HASH_COUNT(dd->bad_clusters) + 1));
+
+	HASH_ITER(hh, dd->bad_clusters, current_bad_cluster, bad_cluster_tmp) {
+		plan_cluster_st* plan_cluster = &planner->cluster[planner->cluster_count++];
+
+		memset(plan_cluster, 0, sizeof(plan_cluster_st));
+
+		plan_cluster->id = current_bad_cluster->id;
+		plan_cluster->recovered = overlay_has_cluster(dd, current_bad_cluster->id);
+
+		HASH_ADD(hh, planner->cluster_hash, id, sizeof(__uint64_t), plan_cluster);
+	}
+
+	// Number the files and link them to their clusters.
+
+	planner->file = (plan_file_st*)malloc(sizeof(plan_file_st) * (HASH_COUNT(dd->bad_clusters_by_mft_index) + 1));
+
+	HASH_ITER(hh, dd->bad_clusters_by_mft_index, current_bad_clusters_by_mft_index, bad_clusters_by_mft_index_tmp) {
+		__uint32_t file_num = planner->file_count++;
+
+		plan_file_st* file = &planner->file[file_num];
+
+		memset(file, 0, sizeof(plan_file_st));
+
+		file->mft_index = current_bad_clusters_by_mft_index->id;
+		file->weight = 1;
+
+		if (prio != NULL) {
+			file_priority_st* file_priority;
+
+			HASH_FIND(hh, prio->files, &file->mft_index, sizeof(__uint32_t), file_priority);
+
+			if (file_priority != NULL) {
+				file->weight += file_priority->priority;
+			}
+		}
+
+		file->clusters = (__uint32_t*)malloc(sizeof(__uint32_t) * (HASH_COUNT(current_bad_clusters_by_mft_index->bad_clusters) + 1));
+
+		HASH_ITER(hh, current_bad_clusters_by_mft_index->bad_clusters, current_bad_cluster, bad_cluster_tmp) {
+			plan_cluster_st* plan_cluster = _find_cluster(planner, current_bad_cluster->id);
+
+			if (plan_cluster == NULL) {
+				continue;
+			}
+
+			__uint32_t cluster_num = plan_cluster - planner->cluster;
+
+			file->clusters[file->cluster_count++] = cluster_num;
+
+			if (!plan_cluster->recovered) {
+				file->missing++;
+			}
+
+			plan_cluster->files = (__uint32_t*)realloc(plan_cluster->files, sizeof(__uint32_t) * (plan_cluster->file_count + 1));
+			plan_cluster->files[plan_cluster->file_count++] = file_num;
+		}
+
+		if (file->missing == 0) {
+			planner->complete_files++;
+		}
+	}
+
+	return 0;
+}
+
+void cleanup_planner(planner_ctx* planner)
+{
+	HASH_CLEAR(hh, planner->cluster_hash);
+
+	for (__uint32_t i = 0; i < planner->cluster_count; i++) {
+		free(planner->cluster[i].files);
+	}
+
+	for (__uint32_t i = 0; i < planner->file_count; i++) {
+		free(planner->file[i].clusters);
+	}
+
+	free(planner->cluster);
+	free(planner->file);
+	free(planner->step);
+	free(planner->plan_cluster);
+
+	memset(planner, 0, sizeof(planner_ctx));
+}
+
+/**
+ * Note that a cluster has been recovered.
+ *
+ * @param planner Planner
+ * @param cluster Cluster number
+ */
+void planner_cluster_recovered(planner_ctx* planner, __uint64_t cluster)
+{
+	plan_cluster_st* plan_cluster = _find_cluster(planner, cluster);
+
+	if (plan_cluster == NULL || plan_cluster->recovered) {
+		return;
+	}
+
+	plan_cluster->recovered = 1;
+
+	for (__uint32_t i = 0; i < plan_cluster->file_count; i++) {
+		plan_file_st* file = &planner->file[plan_cluster->files[i]];
+
+		if (--file->missing == 0) {
+			planner->complete_files++;
+		}
+	}
+}
+
+/**
+ * Note every planned cluster that has reached the overlay since the planner
+ * was initialized (after a scheduler run, say.)
+ *
+ * @param dd DD context struct
+ * @param planner Planner
+ */
+void planner_sync_overlay(dd_ctx* dd, planner_ctx* planner)
+{
+	for (__uint32_t i = 0; i < planner->cluster_count; i++) {
+		if (!planner->cluster[i].recovered && overlay_has_cluster(dd, planner->cluster[i].id)) {
+			planner_cluster_recovered(planner, planner->cluster[i].id);
+		}
+	}
+}
+
+/**
+ * Plan the recovery of every missing cluster, greedily by weight of files
+ * completed per cluster read.  Replaces any earlier plan.
+ *
+ * @param planner Planner
+ */
+void build_plan(planner_ctx* planner)
+{
+	free(planner->step);
+	free(planner->plan_cluster);
+
+	planner->step = NULL;
+	planner->step_count = 0;
+
+	planner->plan_cluster = (__uint32_t*)malloc(sizeof(__uint32_t) * (planner->cluster_count + 1));
+	planner->plan_cluster_count = 0;
+
+	// Work on copies of the missing counts and recovered flags.
+
+	__uint32_t* missing = (__uint32_t*)malloc(sizeof(__uint32_t) * (planner->file_count + 1));
+	char* taken = (char*)malloc(planner->cluster_count + 1);
+
+	heap_st heap;
+
+	memset(&heap, 0, sizeof(heap_st));
+
+	__uint64_t total_files = planner->complete_files;
+	double total_weight = 0;
+
+	for (__uint32_t i = 0; i < planner->file_count; i++) {
+		missing[i] = planner->file[i].missing;
+
+		if (missing[i] > 0) {
+			_heap_push(&heap, planner->file[i].weight / missing[i], i, missing[i]);
+		}
+	}
+
+	for (__uint32_t i = 0; i < planner->cluster_count; i++) {
+		taken[i] = planner->cluster[i].recovered;
+	}
+
+	__uint64_t step_alloc = 0;
+
+	while (heap.count > 0) {
+		heap_entry_st top = _heap_pop(&heap);
+
+		if (missing[top.file] != top.missing || top.missing == 0) {
+			continue;
+		}
+
+		if (planner->step_count == step_alloc) {
+			step_alloc = (step_alloc == 0) ? 256 : step_alloc * 2;
+			planner->step = (plan_step_st*)realloc(planner->step, sizeof(plan_step_st) * step_alloc);
+		}
+
+		plan_step_st* step = &planner->step[planner->step_count++];
+
+		step->file = top.file;
+		step->cluster_start = planner->plan_cluster_count;
+
+		plan_file_st* file = &planner->file[top.file];
+
+		for (__uint32_t i = 0; i < file->cluster_count; i++) {
+			__uint32_t cluster_num = file->clusters[i];
+
+			if (taken[cluster_num]) {
+				continue;
+			}
+
+			taken[cluster_num] = 1;
+
+			planner->plan_cluster[planner->plan_cluster_count++] = cluster_num;
+
+			// Every file sharing the cluster is now missing one less.
+
+			plan_cluster_st* plan_cluster = &planner->cluster[cluster_num];
+
+			for (__uint32_t j = 0; j < plan_cluster->file_count; j++) {
+				__uint32_t other = plan_cluster->files[j];
+
+				if (--missing[other] == 0) {
+					total_files++;
+					total_weight += planner->file[other].weight;
+				} else if (other != top.file) {
+					_heap_push(&heap, planner->file[other].weight / missing[other], other, missing[other]);
+				}
+			}
+		}
+
+		step->cluster_count = planner->plan_cluster_count - step->cluster_start;
+		step->total_clusters = planner->plan_cluster_count;
+		step->total_files = total_files;
+		step->total_weight = total_weight;
+	}
+
+	free(heap.entry);
+	free(taken);
+	free(missing);
+}
+
+/**
+ * Print the plan's yield curve: how many more files are complete after how
+ * many more clusters.
+ *
+ * @param planner Planner (plan built)
+ * @param points Rows to print, spread evenly over the plan's clusters
+ */
+void print_yield_curve(planner_ctx* planner, int points)
+{
+	printf("Files complete now: %lu of %u\n", planner->complete_files, planner->file_count);
+
+	if (planner->step_count == 0 || points < 1) {
+		return;
+	}
+
+	__uint64_t total = planner->plan_cluster_count;
+	__uint64_t next = 0;
+
+	for (__uint64_t i = 0; i < planner->step_count; i++) {
+		plan_step_st* step = &planner->step[i];
+
+		if (step->total_clusters < next && i != planner->step_count - 1) {
+			continue;
+		}
+
+		printf("%10lu more clusters -> %8lu more complete files (weight %.0f)\n",
+				step->total_clusters, step->total_files - planner->complete_files, step->total_weight);
+
+		next = step->total_clusters + (total + points - 1) / points;
+	}
+}
+
+static int _sort_cluster_nums(const void* a, const void* b)
+{
+	__uint32_t ca = *(const __uint32_t*)a;
+	__uint32_t cb = *(const __uint32_t*)b;
+
+	return (ca > cb) - (ca < cb);
+}
+
+/**
+ * Add the plan to a scheduler, earlier steps at higher priority.  $MFT and
+ * directory index clusters keep their own (higher) priority.
+ *
+ * @param dd DD context struct
+ * @param sched Scheduler
+ * @param planner Planner (plan built)
+ */
+void scheduler_add_plan(dd_ctx* dd, scheduler_ctx* sched, planner_ctx* planner)
+{
+	for (__uint64_t i = 0; i < planner->step_count; i++) {
+		plan_step_st* step = &planner->step[i];
+
+		__uint32_t* clusters = &planner->plan_cluster[step->cluster_start];
+
+		// Cluster numbers are in cluster order (see init_planner().)
+
+		qsort(clusters, step->cluster_count, sizeof(__uint32_t), &_sort_cluster_nums);
+
+		int step_priority = (planner->step_count - i < PRIORITY_INDEX) ? planner->step_count - i : PRIORITY_INDEX - 1;
+
+		__uint64_t range_start = UINT64_MAX;
+		__uint64_t range_end = UINT64_MAX;
+		int range_priority = 0;
+
+		for (__uint64_t j = 0; j <= step->cluster_count; j++) {
+			__uint64_t cluster = UINT64_MAX;
+			int priority = 0;
+
+			if (j < step->cluster_count) {
+				cluster = planner->cluster[clusters[j]].id;
+
+				bad_cluster_st* bad_cluster;
+
+				HASH_FIND(hh, dd->bad_clusters, &cluster, sizeof(__uint64_t), bad_cluster);
+
+				priority = (bad_cluster != NULL) ? cluster_priority(dd, NULL, bad_cluster) : 0;
+
+				if (priority < step_priority) {
+					priority = step_priority;
+				}
+
+				if (range_start != UINT64_MAX && cluster == range_end + 1 && priority == range_priority) {
+					range_end = cluster;
+
+					continue;
+				}
+			}
+
+			if (range_start != UINT64_MAX) {
+				scheduler_add_range(sched, range_start, range_end - range_start + 1, range_priority);
+			}
+
+			range_start = cluster;
+			range_end = cluster;
+			range_priority = priority;
+		}
+	}
+}
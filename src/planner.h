@@ -0,0 +1,104 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "dd.h"
+#include "priority.h"
+#include "scheduler.h"
+
+// Orders recovery to complete as many files as possible per cluster read.
+// Many files are blocked by one or two missing clusters while a few need
+// thousands, so the plan is built greedily: repeatedly take the file with
+// the best weight per still-missing cluster, counting any other files its
+// clusters finish along the way.  Each step of the plan adds to a yield
+// curve ("N more clusters, M more complete files") for deciding when to
+// stop.
+//
+// Which clusters each file is missing is kept up to date with
+// planner_cluster_recovered() as recovery succeeds; build_plan() works
+// from the current state.
+
+typedef struct plan_file_st {
+	__uint32_t mft_index;
+	double weight; // 1 + the file's priority
+
+	__uint32_t* clusters; // Indexes into planner->cluster
+	__uint32_t cluster_count;
+
+	__uint32_t missing; // Clusters not yet recovered
+} plan_file_st;
+
+typedef struct plan_cluster_st {
+	__uint64_t id; // cluster
+
+	__uint32_t* files; // Indexes into planner->file
+	__uint32_t file_count;
+
+	int recovered;
+
+	UT_hash_handle hh;
+} plan_cluster_st;
+
+typedef struct plan_step_st {
+	__uint32_t file; // File chosen
+	__uint64_t cluster_start; // This step's clusters in planner->plan_cluster
+	__uint64_t cluster_count;
+
+	__uint64_t total_clusters; // Clusters to recover, up to and including this step
+	__uint64_t total_files; // Files complete after this step
+	double total_weight;
+} plan_step_st;
+
+typedef struct planner_ctx_st {
+	plan_file_st* file;
+	__uint32_t file_count;
+
+	plan_cluster_st* cluster; // Array, also hashed by cluster number
+	plan_cluster_st* cluster_hash;
+	__uint32_t cluster_count;
+
+	__uint64_t complete_files; // Files with nothing missing
+
+	plan_step_st* step; // Set by build_plan()
+	__uint64_t step_count;
+
+	__uint32_t* plan_cluster;
+	__uint64_t plan_cluster_count;
+} planner_ctx;
+
+int init_planner(dd_ctx* dd, planner_ctx* planner, priority_ctx* prio);
+
+void cleanup_planner(planner_ctx* planner);
+
+void planner_cluster_recovered(planner_ctx* planner, __uint64_t cluster);
+
+void planner_sync_overlay(dd_ctx* dd, planner_ctx* planner);
+
+void build_plan(planner_ctx* planner);
+
+void print_yield_curve(planner_ctx* planner, int points);
+
+void scheduler_add_plan(dd_ctx* dd, scheduler_ctx* sched, planner_ctx* planner);
@@ -0,0 +1,258 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "priority.h"
+
+#include <ctype.h>
+#include <string.h>
+
+// Difference between the NTFS epoch (1601) and the Unix epoch, in 100ns
+// intervals.
+
+#define NTFS_UNIX_EPOCH 116444736000000000
+
+void init_priorities(priority_ctx* prio)
+{
+	memset(prio, 0, sizeof(priority_ctx));
+}
+
+static void _free_cluster_priorities(priority_ctx* prio)
+{
+	cluster_priority_st *current_cluster;
+	cluster_priority_st *cluster_tmp;
+
+	HASH_ITER(hh, prio->clusters, current_cluster, cluster_tmp) {
+		HASH_DEL(prio->clusters, current_cluster);
+
+		free(current_cluster);
+	}
+}
+
+void cleanup_priorities(priority_ctx* prio)
+{
+	file_priority_st *current_file;
+	file_priority_st *file_tmp;
+
+	HASH_ITER(hh, prio->files, current_file, file_tmp) {
+		HASH_DEL(prio->files, current_file);
+
+		free(current_file);
+	}
+
+	_free_cluster_priorities(prio);
+
+	free(prio->criteria);
+
+	prio->criteria = NULL;
+	prio->criteria_count = 0;
+}
+
+/**
+ * Add a rule for ranking file data.  The strings aren't copied.
+ *
+ * @param prio Priority context
+ * @param criteria Rule to add
+ */
+void add_recovery_criteria(priority_ctx* prio, const recovery_criteria_st* criteria)
+{
+	prio->criteria = (recovery_criteria_st*)realloc(prio->criteria, sizeof(recovery_criteria_st) * (prio->criteria_count + 1));
+	prio->criteria[prio->criteria_count++] = *criteria;
+}
+
+static int _extension_matches(const char* name, const char* extension)
+{
+	const char* dot = strrchr(name, '.');
+
+	if (dot == NULL) {
+		return extension[0] == '\0';
+	}
+
+	dot++;
+
+	if (strlen(dot) != strlen(extension)) {
+		return 0;
+	}
+
+	for (int i = 0; dot[i] != '\0'; i++) {
+		if (tolower(dot[i]) != extension[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Rank a file found while walking directories against the criteria,
+ * remembering the result for rank_bad_clusters().
+ *
+ * @param prio Priority context
+ * @param path Path of the directory holding the file
+ * @param file File
+ * @return Priority of the file (0 if no criteria match)
+ */
+int rank_file(priority_ctx* prio, const char* path, NTFS_FILE* file)
+{
+	int priority = 0;
+
+	time_t modified = (file->date_modified - NTFS_UNIX_EPOCH) / 10000000;
+
+	for (int i = 0; i < prio->criteria_count; i++) {
+		recovery_criteria_st* criteria = &prio->criteria[i];
+
+		if (criteria->priority <= priority) {
+			continue;
+		}
+
+		if (criteria->extension != NULL && !_extension_matches(file->ascii_name, criteria->extension)) {
+			continue;
+		}
+
+		if (criteria->path_prefix != NULL && strncmp(path, criteria->path_prefix, strlen(criteria->path_prefix))) {
+			continue;
+		}
+
+		if ((criteria->modified_after != 0 && modified < criteria->modified_after) ||
+				(criteria->modified_before != 0 && modified >= criteria->modified_before)) {
+			continue;
+		}
+
+		if (file->filesize < criteria->min_size || (criteria->max_size != 0 && file->filesize > criteria->max_size)) {
+			continue;
+		}
+
+		priority = criteria->priority;
+	}
+
+	if (priority > 0) {
+		file_priority_st* file_priority;
+
+		__uint32_t id = file->id;
+
+		HASH_FIND(hh, prio->files, &id, sizeof(__uint32_t), file_priority);
+
+		if (file_priority == NULL) {
+			file_priority = (file_priority_st*)malloc(sizeof(file_priority_st));
+
+			file_priority->id = id;
+			file_priority->priority = priority;
+
+			HASH_ADD(hh, prio->files, id, sizeof(__uint32_t), file_priority);
+		} else if (priority > file_priority->priority) {
+			file_priority->priority = priority;
+		}
+	}
+
+	return priority;
+}
+
+/**
+ * Give every bad cluster owned by a ranked file that file's priority (the
+ * highest, if several files claim it.)  Call again after the bad cluster
+ * lists change.
+ *
+ * @param dd DD context struct
+ * @param prio Priority context
+ */
+void rank_bad_clusters(dd_ctx* dd, priority_ctx* prio)
+{
+	bad_cluster_by_mft_index_st *current_bad_clusters_by_mft_index;
+	bad_cluster_by_mft_index_st *bad_clusters_by_mft_index_tmp;
+
+	bad_cluster_st *current_bad_cluster;
+	bad_cluster_st *bad_cluster_tmp;
+
+	_free_cluster_priorities(prio);
+
+	HASH_ITER(hh, dd->bad_clusters_by_mft_index, current_bad_clusters_by_mft_index, bad_clusters_by_mft_index_tmp) {
+		file_priority_st* file_priority;
+
+		HASH_FIND(hh, prio->files, &current_bad_clusters_by_mft_index->id, sizeof(__uint32_t), file_priority);
+
+		if (file_priority == NULL) {
+			continue;
+		}
+
+		HASH_ITER(hh, current_bad_clusters_by_mft_index->bad_clusters, current_bad_cluster, bad_cluster_tmp) {
+			cluster_priority_st* cluster_priority;
+
+			HASH_FIND(hh, prio->clusters, &current_bad_cluster->id, sizeof(__uint64_t), cluster_priority);
+
+			if (cluster_priority == NULL) {
+				cluster_priority = (cluster_priority_st*)malloc(sizeof(cluster_priority_st));
+
+				cluster_priority->id = current_bad_cluster->id;
+				cluster_priority->priority = file_priority->priority;
+
+				HASH_ADD(hh, prio->clusters, id, sizeof(__uint64_t), cluster_priority);
+			} else if (file_priority->priority > cluster_priority->priority) {
+				cluster_priority->priority = file_priority->priority;
+			}
+		}
+	}
+}
+
+static int _is_mft_cluster(dd_ctx* dd, __uint64_t cluster)
+{
+	for (int i = 0; i < NTFS.mft_data_run.entry_count; i++) {
+		data_run_entry* entry = &NTFS.mft_data_run.entry[i];
+
+		if (cluster >= entry->cluster && cluster < entry->cluster + entry->count) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Priority of a bad cluster from dd->bad_clusters.
+ *
+ * @param dd DD context struct
+ * @param prio Priority context (NULL to rank file data equally)
+ * @param bad_cluster Bad cluster
+ * @return PRIORITY_MFT, PRIORITY_INDEX or the priority of the file owning
+ *         the cluster
+ */
+int cluster_priority(dd_ctx* dd, priority_ctx* prio, bad_cluster_st* bad_cluster)
+{
+	if (_is_mft_cluster(dd, bad_cluster->id)) {
+		return PRIORITY_MFT;
+	}
+
+	if (bad_cluster->kind == BAD_CLUSTER_INDEX) {
+		return PRIORITY_INDEX;
+	}
+
+	if (prio == NULL) {
+		return 0;
+	}
+
+	cluster_priority_st* cluster_priority;
+
+	HASH_FIND(hh, prio->clusters, &bad_cluster->id, sizeof(__uint64_t), cluster_priority);
+
+	return (cluster_priority != NULL) ? cluster_priority->priority : 0;
+}
@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "dd.h"
+
+// Decides which bad clusters are worth the device's time first.  Clusters
+// of the $MFT come first, since every record read depends on them, then the
+// index clusters of directories on the walk path, then file data, ranked by
+// criteria such as extension, path prefix, modification date and size.
+
+#define PRIORITY_MFT 2000000000
+#define PRIORITY_INDEX 1000000000
+
+typedef struct recovery_criteria_st {
+	const char* extension; // Lower case, without the dot (NULL for any)
+	const char* path_prefix; // NULL for any
+
+	time_t modified_after; // 0 for any
+	time_t modified_before; // 0 for any
+
+	__uint64_t min_size;
+	__uint64_t max_size; // 0 for any
+
+	int priority; // Given to matching files (the highest match wins)
+} recovery_criteria_st;
+
+typedef struct file_priority_st {
+	__uint32_t id; // mft index
+	int priority;
+
+	UT_hash_handle hh;
+} file_priority_st;
+
+typedef struct cluster_priority_st {
+	__uint64_t id; // cluster
+	int priority;
+
+	UT_hash_handle hh;
+} cluster_priority_st;
+
+typedef struct priority_ctx_st {
+	recovery_criteria_st* criteria;
+	int criteria_count;
+
+	file_priority_st* files; // Files ranked so far
+	cluster_priority_st* clusters; // Built by rank_bad_clusters()
+} priority_ctx;
+
+void init_priorities(priority_ctx* prio);
+
+void cleanup_priorities(priority_ctx* prio);
+
+void add_recovery_criteria(priority_ctx* prio, const recovery_criteria_st* criteria);
+
+int rank_file(priority_ctx* prio, const char* path, NTFS_FILE* file);
+
+void rank_bad_clusters(dd_ctx* dd, priority_ctx* prio);
+
+int cluster_priority(dd_ctx* dd, priority_ctx* prio, bad_cluster_st* bad_cluster);
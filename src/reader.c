@@ -68,8 +68,21 @@ int init_reader(reader_ctx* reader, const char* dev, unsigned char sensebuf_len,
 	}
 
 	reader->sensebuf = (char*)malloc(reader->sensebuf_len);
-	reader->buf = (char*)malloc(reader->buf_len);
 
+	// An aligned buffer lets the sg driver transfer straight into it.
+
+	void* buf;
+
+	if (posix_memalign(&buf, 4096, reader->buf_len)) {
+		ERR("Unable to allocate %u byte read buffer\n", reader->buf_len);
+
+		return 1;
+	}
+
+	reader->buf = (char*)buf;
+
+	reader->block_size = 512;
+	reader->timeout = 500000;
 
 	reader->fd = open(reader->dev, O_RDONLY);
 
@@ -112,81 +125,145 @@ void cleanup_reader(reader_ctx* reader)
 
 
 
-int get_capacity(reader_ctx* reader, uint32_t *max_lba, uint32_t *block_size)
+/**
+ * Issue one SG_IO command.  The data buffer must hold dxfer_len bytes; it
+ * isn't cleared beforehand, so only the bytes the device transferred
+ * (dxfer_len - reader->resid) are meaningful.
+ *
+ * @param reader Reader context
+ * @param cmd Command descriptor block
+ * @param cmd_len Length of cmd
+ * @param dxferp Data buffer
+ * @param dxfer_len Bytes to transfer
+ * @param timeout Milliseconds
+ * @return 0 on success, nonzero if the ioctl failed or the command didn't
+ *         complete cleanly (reader->senseinfo set unless the ioctl failed)
+ */
+static int _sg_command(reader_ctx* reader, unsigned char* cmd, unsigned char cmd_len, void* dxferp, unsigned int dxfer_len, unsigned int timeout)
 {
 	struct sg_io_hdr hdr;
 
-	char cmd[9];
-
-	cdb_read_capacity_10(cmd);
-
 	memset(&hdr, 0, sizeof(sg_io_hdr_t));
-	memset(reader->sensebuf, 0, reader->sensebuf_len);
-	memset(reader->buf, 0, reader->buf_len);
 
 	hdr.interface_id = 'S';
 	hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-	hdr.cmd_len = sizeof(cmd);
+	hdr.cmd_len = cmd_len;
 	hdr.mx_sb_len = reader->sensebuf_len;
-	hdr.iovec_count = 0;
-	hdr.dxfer_len = reader->buf_len;
-	hdr.dxferp = reader->buf;
+	hdr.dxfer_len = dxfer_len;
+	hdr.dxferp = dxferp;
 	hdr.cmdp = cmd;
-	hdr.sbp = reader->sensebuf;
-	hdr.timeout = 5000;
-//	hdr.flags = 0;
-//	hdr.pack_id = 0;
-//	hdr.usr_ptr = 0;
+	hdr.sbp = (unsigned char*)reader->sensebuf;
+	hdr.timeout = timeout;
 
-	int ret = 0;
-	ret = ioctl(reader->fd, SG_IO, &hdr);
+	int ret = ioctl(reader->fd, SG_IO, &hdr);
 
-	if (ret == 0) {
-		scsi_parse_sense(reader->sensebuf, hdr.sb_len_wr, &reader->senseinfo);
+	if (ret != 0) {
+		ERR("SG_IO failed on %s: %s\n", reader->dev, strerror(errno));
 
-		if (reader->senseinfo.sense_key == 0) {
-			parse_read_capacity_10(reader->buf, reader->buf_len, max_lba, block_size);
-		}
+		return ret;
+	}
+
+	reader->resid = hdr.resid;
+
+	if (hdr.sb_len_wr > 0) {
+		scsi_parse_sense((unsigned char*)reader->sensebuf, hdr.sb_len_wr, &reader->senseinfo);
+	} else {
+		memset(&reader->senseinfo, 0, sizeof(struct sense_info_t));
 	}
 
-	return ret;
+	// A transport or host adapter failure can leave no sense data at all,
+	// and the buffer holding whatever it held before.
+
+	if ((hdr.info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+		ERR("SG_IO command failed on %s: status %02X, host status %04X, driver status %04X\n",
+				reader->dev, hdr.status, hdr.host_status, hdr.driver_status);
+
+		return 1;
+	}
+
+	return 0;
 }
 
-int read_blocks(reader_ctx* reader, uint64_t lba, uint16_t len) {
+/**
+ * Read the device's capacity with READ CAPACITY (10), or (16) if the device
+ * is too big for it.  Sets reader->block_size.
+ *
+ * @param reader Reader context
+ * @param max_lba Set to the last LBA
+ * @param block_size Set to the logical block size
+ * @return 0 on success (check reader->senseinfo), nonzero on failure
+ */
+int get_capacity(reader_ctx* reader, uint64_t *max_lba, uint32_t *block_size)
+{
+	unsigned char cmd[16];
+	unsigned char data[32];
 
-	struct sg_io_hdr hdr;
+	uint32_t max_lba_10;
 
-	char cmd[16];
+	cdb_read_capacity_10(cmd);
 
-	//cdb_read_10(cmd, true, lba, len);
-	cdb_read_16(cmd, 0, 0, 0, lba, len);
+	int ret = _sg_command(reader, cmd, 10, data, 8, 5000);
 
-	memset(&hdr, 0, sizeof(sg_io_hdr_t));
-	memset(reader->sensebuf, 0, reader->sensebuf_len);
-	memset(reader->buf, 0, reader->buf_len);
+	if (ret != 0 || reader->senseinfo.sense_key != 0) {
+		return ret;
+	}
 
-	hdr.interface_id = 'S';
-	hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-	hdr.cmd_len = sizeof(cmd);
-	hdr.mx_sb_len = reader->sensebuf_len;
-	hdr.iovec_count = 0;
-	hdr.dxfer_len = reader->buf_len;
-	hdr.dxferp = reader->buf;
-	hdr.cmdp = cmd;
-	hdr.sbp = reader->sensebuf;
-	hdr.timeout = 500000;
-//	hdr.flags = 0;
-//	hdr.pack_id = 0;
-//	hdr.usr_ptr = 0;
+	parse_read_capacity_10(data, 8, &max_lba_10, block_size);
+
+	*max_lba = max_lba_10;
 
-	int ret = 0;
-	ret = ioctl(reader->fd, SG_IO, &hdr);
+	if (max_lba_10 == 0xFFFFFFFF) {
+		cdb_read_capacity_16(cmd, sizeof(data));
+
+		ret = _sg_command(reader, cmd, 16, data, sizeof(data), 5000);
+
+		if (ret != 0 || reader->senseinfo.sense_key != 0) {
+			return ret;
+		}
 
-	if (ret == 0) {
-		scsi_parse_sense(reader->sensebuf, hdr.sb_len_wr, &reader->senseinfo);
+		parse_read_capacity_16_simple(data, sizeof(data), max_lba, block_size);
 	}
 
-	return ret;
+	reader->block_size = *block_size;
 
+	return 0;
 }
 
+/**
+ * Read blocks into reader->buf with READ (16).
+ *
+ * @param reader Reader context
+ * @param lba First block
+ * @param len Number of blocks (len * block_size must fit reader->buf)
+ * @return 0 on success (check reader->senseinfo), nonzero on failure
+ */
+int read_blocks(reader_ctx* reader, uint64_t lba, uint32_t len)
+{
+	uint64_t dxfer_len = (uint64_t)len * reader->block_size;
+
+	if (dxfer_len > reader->buf_len) {
+		ERR("Read of %u blocks doesn't fit %u byte buffer\n", len, reader->buf_len);
+
+		return 1;
+	}
+
+	unsigned char cmd[16];
+
+	cdb_read_16(cmd, 0, 0, 0, lba, len);
+
+	int ret = _sg_command(reader, cmd, sizeof(cmd), reader->buf, dxfer_len, reader->timeout);
+
+	if (ret != 0) {
+		return ret;
+	}
+
+	// The rest of the buffer is stale, so a short read is a failed one.
+
+	if (reader->resid != 0) {
+		ERR("Short read on %s: %d of %lu bytes not transferred\n", reader->dev, reader->resid, dxfer_len);
+
+		return 1;
+	}
+
+	return 0;
+}
@@ -27,6 +27,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <scsicmd/scsicmd.h>
 
+#include <stdint.h>
+
+// Issues SCSI commands to a device through the sg driver's SG_IO ioctl.
+// Nothing is zeroed between commands: the transfer length is exactly what
+// the command asks for, sense data is only parsed as far as the driver says
+// it wrote, and a command the driver doesn't report as completed cleanly, or
+// a read that comes back short, fails.
+
 typedef struct reader_ctx_struct {
 	char* dev;
 	int fd;
@@ -34,9 +42,14 @@ typedef struct reader_ctx_struct {
 	char* sensebuf;
 	unsigned char sensebuf_len;
 
-	char* buf;
+	char* buf; // Page aligned, for read_blocks()
 	unsigned int buf_len;
 
+	uint32_t block_size; // Set by get_capacity() (512 until then)
+	unsigned int timeout; // Milliseconds per read command
+
+	int resid; // Bytes not transferred by the last command
+
 	int error;
 	char error_msg[4096];
 
@@ -46,5 +59,5 @@ typedef struct reader_ctx_struct {
 int init_reader(reader_ctx* reader, const char* dev, unsigned char sensebuf_len, unsigned int buf_len);
 void cleanup_reader(reader_ctx* reader);
 
-int get_capacity(reader_ctx* reader, uint32_t *max_lba, uint32_t *block_size);
-int read_blocks(reader_ctx* reader, uint64_t lba, uint16_t len);
+int get_capacity(reader_ctx* reader, uint64_t *max_lba, uint32_t *block_size);
+int read_blocks(reader_ctx* reader, uint64_t lba, uint32_t len);
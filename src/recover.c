@@ -0,0 +1,774 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "recover.h"
+#include "overlay.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define ERR(...) \
+	if (dd->error == 0) { \
+		memset(dd->error_msg, 0, 4096); \
+		dd->error = 1; \
+	} \
+	dd->error = 1; \
+	snprintf(dd->error_msg + strlen(dd->error_msg), 4096 - strlen(dd->error_msg), __VA_ARGS__);
+
+static unsigned char* _get_buffer(recovery_ctx* rc)
+{
+	if (rc->buf_pool_count > 0) {
+		return rc->buf_pool[--rc->buf_pool_count];
+	}
+
+	return device_reader_alloc(&rc->reader);
+}
+
+static void _put_buffer(recovery_ctx* rc, unsigned char* buf)
+{
+	if (buf == NULL) {
+		return;
+	}
+
+	rc->buf_pool = (unsigned char**)realloc(rc->buf_pool, sizeof(unsigned char*) * (rc->buf_pool_count + 1));
+	rc->buf_pool[rc->buf_pool_count++] = buf;
+}
+
+/**
+ * Find the device node named by the entry in a sysfs directory (the sg
+ * device of a disk, say, or the disk of an sg device.)
+ *
+ * @param dir sysfs directory
+ * @param node Set to /dev/ followed by the entry's name
+ * @param size Size of node
+ * @return 0 if found, nonzero if not
+ */
+static int _sysfs_node(const char* dir, char* node, size_t size)
+{
+	DIR* d = opendir(dir);
+
+	if (d == NULL) {
+		return 1;
+	}
+
+	int result = 1;
+
+	struct dirent* entry;
+
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] != '.') {
+			snprintf(node, size, "/dev/%s", entry->d_name);
+
+			result = 0;
+			break;
+		}
+	}
+
+	closedir(d);
+
+	return result;
+}
+
+static int _init_recovery(dd_ctx* dd, const char* device, block_source_st* source, int range_clusters, double timeout)
+{
+	if (dd->recovery != NULL) {
+		return 0;
+	}
+
+	recovery_ctx* rc = (recovery_ctx*)malloc(sizeof(recovery_ctx));
+
+	memset(rc, 0, sizeof(recovery_ctx));
+
+	rc->partition_offset = NTFS.partition_offset;
+	rc->cluster_size = NTFS_CLUSTER_SIZE;
+	rc->range_clusters = (range_clusters > 0) ? range_clusters : 256;
+
+	size_t buf_size = (size_t)rc->range_clusters * rc->cluster_size;
+
+	// Queued reads need the disk's sg device, which doesn't serve pread(),
+	// so single reads and retries go to its block device.  Either can be
+	// given; the other is looked up in sysfs.
+
+	char block_device[PATH_MAX];
+	char sg_device[PATH_MAX];
+	char sysfs_dir[PATH_MAX];
+
+	const char* read_device = device;
+	const char* queue_device = NULL;
+
+	struct stat st;
+
+	if (device != NULL && stat(device, &st) == 0) {
+		if (S_ISCHR(st.st_mode)) {
+			snprintf(sysfs_dir, PATH_MAX, "/sys/dev/char/%u:%u/device/block", major(st.st_rdev), minor(st.st_rdev));
+
+			if (_sysfs_node(sysfs_dir, block_device, PATH_MAX)) {
+				ERR("No block device found for %s\n", device);
+
+				free(rc);
+
+				return 1;
+			}
+
+			read_device = block_device;
+			queue_device = device;
+		} else if (S_ISBLK(st.st_mode)) {
+			snprintf(sysfs_dir, PATH_MAX, "/sys/dev/block/%u:%u/device/scsi_generic", major(st.st_rdev), minor(st.st_rdev));
+
+			if (_sysfs_node(sysfs_dir, sg_device, PATH_MAX) == 0) {
+				queue_device = sg_device;
+			}
+		}
+	}
+
+	int result;
+
+	if (source != NULL) {
+		result = start_device_reader_source(&rc->reader, source, buf_size, timeout);
+	} else {
+		result = start_device_reader(&rc->reader, read_device, buf_size, timeout);
+	}
+
+	if (result) {
+		ERR("%s", rc->reader.error_msg);
+
+		free(rc);
+
+		return 1;
+	}
+
+	if (start_overlay_writer(dd, &rc->writer, -1)) {
+		stop_device_reader(&rc->reader);
+
+		free(rc);
+
+		return 2;
+	}
+
+	// Image files, block sources and disks without an sg device are read
+	// through the device reader alone.
+
+	if (queue_device != NULL) {
+		async_reader_st* ar = (async_reader_st*)malloc(sizeof(async_reader_st));
+
+		if (init_async_reader(ar, queue_device, -1, rc->reader.sector_size) == 0 && !ar->file_backed) {
+			rc->async = ar;
+		} else {
+			printf("Queued reads unavailable on %s: %s", queue_device, ar->error_msg);
+
+			cleanup_async_reader(ar);
+			free(ar);
+		}
+	}
+
+	dd->recovery = rc;
+
+	return 0;
+}
+
+/**
+ * Open the device and start an overlay writer on the top overlay layer.
+ * Called by recover_to_overlay() if not called beforehand.
+ *
+ * @param dd DD context struct (NTFS and overlay already open)
+ * @param device Device to read from: a disk's block device or its sg
+ *               device (the other is found in sysfs), or an image file
+ * @param range_clusters Largest single read in clusters (-1 for default)
+ * @param timeout Seconds before a device read is abandoned (-1 for default)
+ * @return 0 on success, nonzero on failure
+ */
+int init_recovery(dd_ctx* dd, const char* device, int range_clusters, double timeout)
+{
+	return _init_recovery(dd, device, NULL, range_clusters, timeout);
+}
+
+/**
+ * As init_recovery(), but read from a block source (a simulated device,
+ * say) instead of a device.
+ *
+ * @param dd DD context struct (NTFS and overlay already open)
+ * @param source Block source, addressed like the device
+ * @param range_clusters Largest single read in clusters (-1 for default)
+ * @param timeout Seconds before a read is abandoned (-1 for default), on
+ *                the source's clock if it keeps one
+ * @return 0 on success, nonzero on failure
+ */
+int init_recovery_source(dd_ctx* dd, block_source_st* source, int range_clusters, double timeout)
+{
+	return _init_recovery(dd, NULL, source, range_clusters, timeout);
+}
+
+/**
+ * Write out everything recovered, stop the overlay writer and close the
+ * device.  Must be called before save_index().
+ *
+ * @param dd DD context struct
+ * @return 0 on success, nonzero if the overlay writer failed
+ */
+int cleanup_recovery(dd_ctx* dd)
+{
+	recovery_ctx* rc = dd->recovery;
+
+	if (rc == NULL) {
+		return 0;
+	}
+
+	int result = stop_overlay_writer(&rc->writer);
+
+	if (rc->async != NULL) {
+		cleanup_async_reader(rc->async);
+		free(rc->async);
+	}
+
+	stop_device_reader(&rc->reader);
+
+	for (int i = 0; i < rc->buf_pool_count; i++) {
+		free(rc->buf_pool[i]);
+	}
+
+	free(rc->buf_pool);
+	free(rc);
+
+	dd->recovery = NULL;
+
+	return result;
+}
+
+/**
+ * Read from the device with one request, logging it to the telemetry log.
+ * If the read times out, *buf is replaced (see device_read().)
+ *
+ * @param seconds Set to the time the read took (NULL if not wanted)
+ * @return 0 on success, -1 on failure (errno set), -2 on timeout, -3 if
+ *         the device reader failed
+ */
+static int _read_extent(dd_ctx* dd, recovery_ctx* rc, unsigned char** buf, off_t offset, size_t length, double* seconds)
+{
+	// Timed by the block source's clock when it keeps one, so simulated
+	// reads count simulated time.
+
+	double start = device_reader_time(&rc->reader);
+
+	int result = device_read(&rc->reader, buf, offset, length);
+
+	int error = errno;
+
+	double elapsed = device_reader_time(&rc->reader) - start;
+
+	if (seconds != NULL) {
+		*seconds = elapsed;
+	}
+
+	rc->last_result = (result == 0) ? TELEMETRY_OK : (result == -2) ? TELEMETRY_TIMEOUT : TELEMETRY_ERROR;
+
+	if (result == 0) {
+		telemetry_record(rc->telemetry, offset, length, elapsed, TELEMETRY_OK, NULL);
+	} else if (result == -1) {
+		telemetry_record(rc->telemetry, offset, length, elapsed, TELEMETRY_ERROR, &rc->reader.sense);
+	} else if (result == -2) {
+		telemetry_record(rc->telemetry, offset, length, elapsed, TELEMETRY_TIMEOUT, NULL);
+	} else if (result == -3) {
+		ERR("%s", rc->reader.error_msg);
+	}
+
+	errno = error;
+
+	return result;
+}
+
+/**
+ * Read a run of clusters from the device with one request (see
+ * _read_extent().)
+ */
+static int _read_device(dd_ctx* dd, recovery_ctx* rc, unsigned char** buf, __uint64_t cluster_pos, __uint64_t num_clusters, double* seconds)
+{
+	int result = _read_extent(dd, rc, buf, rc->partition_offset + cluster_pos * rc->cluster_size,
+			num_clusters * rc->cluster_size, seconds);
+
+	if (result == -2) {
+		printf("Read of clusters %lu-%lu timed out after %.1fs%s\n",
+				cluster_pos, cluster_pos + num_clusters - 1, rc->reader.timeout,
+				(rc->reader.source != NULL && rc->reader.source->clock != NULL) ? " (simulated)" : "; I/O thread parked");
+
+		errno = ETIMEDOUT;
+	}
+
+	return result;
+}
+
+/**
+ * Read what can be read of a cluster that failed as a whole, one device
+ * sector at a time, skipping sectors an earlier try already recovered.  A
+ * cluster completed this way goes to the overlay writer; one still missing
+ * sectors is stored as a partial cluster (see write_partial_cluster()), as
+ * MFT records and INDX blocks lying in the sectors read are still usable.
+ * Gives up at the first timeout.
+ *
+ * @param seconds Set to the device time taken (NULL if not wanted)
+ * @return 0 if the whole cluster is now recovered, 1 if not, 2 if the
+ *         overlay or device reader failed
+ */
+static int _recover_sectors(dd_ctx* dd, recovery_ctx* rc, unsigned char** buf, __uint64_t cluster_pos, double* seconds)
+{
+	int sectors = rc->cluster_size / OVERLAY_SECTOR_SIZE;
+	size_t step = rc->reader.sector_size;
+
+	if (seconds != NULL) {
+		*seconds = 0;
+	}
+
+	// A cluster of one device sector has nothing smaller to read, and the
+	// mask only covers 64 sectors.
+
+	if (sectors > 64 || step >= rc->cluster_size || step % OVERLAY_SECTOR_SIZE != 0 || rc->cluster_size % step != 0) {
+		return 1;
+	}
+
+	int step_sectors = step / OVERLAY_SECTOR_SIZE;
+
+	unsigned char* cluster = (unsigned char*)malloc(rc->cluster_size);
+
+	memset(cluster, 0, rc->cluster_size);
+
+	__uint64_t mask = read_partial_cluster(dd, cluster, cluster_pos);
+	__uint64_t old_mask = mask;
+
+	int result = 1;
+
+	for (int i = 0; i < sectors; i += step_sectors) {
+		__uint64_t step_mask = SECTOR_MASK_FULL(step_sectors) << i;
+
+		if ((mask & step_mask) == step_mask) {
+			continue;
+		}
+
+		double read_seconds;
+
+		int read_result = _read_extent(dd, rc, buf,
+				rc->partition_offset + cluster_pos * rc->cluster_size + i * OVERLAY_SECTOR_SIZE, step, &read_seconds);
+
+		if (seconds != NULL) {
+			*seconds += read_seconds;
+		}
+
+		if (read_result == 0) {
+			memcpy(cluster + i * OVERLAY_SECTOR_SIZE, *buf, step);
+
+			mask |= step_mask;
+			rc->sectors_recovered += step_sectors;
+		} else if (read_result == -2) {
+			printf("Read of cluster %lu sector %d timed out; I/O thread parked\n", cluster_pos, i);
+
+			break;
+		} else if (read_result == -3) {
+			result = 2;
+
+			break;
+		}
+	}
+
+	if (result == 1 && mask == SECTOR_MASK_FULL(sectors)) {
+		if (overlay_writer_submit(&rc->writer, cluster_pos, cluster)) {
+			ERR("%s", rc->writer.error_msg);
+
+			result = 2;
+		} else {
+			result = 0;
+		}
+	} else if (result == 1 && mask != old_mask) {
+		if (write_partial_cluster(dd, cluster, cluster_pos, mask)) {
+			result = 2;
+		} else {
+			printf("Cluster %lu: %d of %d sectors recovered\n", cluster_pos, __builtin_popcountll(mask), sectors);
+
+			if (old_mask == 0) {
+				rc->clusters_partial++;
+			}
+		}
+	}
+
+	free(cluster);
+
+	return result;
+}
+
+/**
+ * Read a run of clusters and queue them for the overlay.  If the read fails
+ * the run is split in half and each half tried in turn, down to single
+ * clusters, so a bad sector only costs the clusters it sits in.  A run that
+ * times out isn't split; its halves would most likely hang as well.
+ *
+ * @return 0 if every cluster was recovered, 1 if some failed, 2 if the
+ *         overlay writer or device reader failed
+ */
+static int _recover_run(dd_ctx* dd, recovery_ctx* rc, unsigned char** buf, __uint64_t cluster_pos, __uint64_t num_clusters)
+{
+	int read_result = _read_device(dd, rc, buf, cluster_pos, num_clusters, NULL);
+
+	if (read_result == 0) {
+		for (__uint64_t i = 0; i < num_clusters; i++) {
+			if (overlay_writer_submit(&rc->writer, cluster_pos + i, *buf + rc->cluster_size * i)) {
+				ERR("%s", rc->writer.error_msg);
+
+				return 2;
+			}
+		}
+
+		rc->clusters_recovered += num_clusters;
+
+		return 0;
+	}
+
+	if (read_result == -3) {
+		return 2;
+	}
+
+	if (read_result == -2) {
+		rc->clusters_failed += num_clusters;
+
+		return 1;
+	}
+
+	if (num_clusters == 1) {
+		printf("Cluster %lu unreadable: %s\n", cluster_pos, strerror(errno));
+
+		int sector_result = _recover_sectors(dd, rc, buf, cluster_pos, NULL);
+
+		if (sector_result == 0) {
+			rc->clusters_recovered++;
+		} else if (sector_result == 1) {
+			rc->clusters_failed++;
+		}
+
+		return sector_result;
+	}
+
+	__uint64_t half = num_clusters / 2;
+
+	int first = _recover_run(dd, rc, buf, cluster_pos, half);
+
+	if (first > 1) {
+		return first;
+	}
+
+	int second = _recover_run(dd, rc, buf, cluster_pos + half, num_clusters - half);
+
+	return (first > second) ? first : second;
+}
+
+/**
+ * Recover a range of clusters from the device into the overlay, reading up
+ * to range_clusters at a time (several at once on an sg device, see
+ * recover_range_queued().)
+ *
+ * @param dd DD context struct (recovery initialized)
+ * @param start_cluster_pos First cluster number
+ * @param num_clusters Number of clusters
+ * @return 0 if every cluster was recovered, 1 if some failed, 2 if the
+ *         overlay writer or device reader failed
+ */
+int recover_range(dd_ctx* dd, __uint64_t start_cluster_pos, __uint64_t num_clusters)
+{
+	recovery_ctx* rc = dd->recovery;
+
+	if (rc->async != NULL) {
+		return recover_range_queued(dd, rc->async, start_cluster_pos, num_clusters);
+	}
+
+	unsigned char* buf = _get_buffer(rc);
+
+	if (buf == NULL) {
+		ERR("Unable to allocate recovery buffer\n");
+
+		return 2;
+	}
+
+	int result = 0;
+
+	for (__uint64_t pos = start_cluster_pos; pos < start_cluster_pos + num_clusters; pos += rc->range_clusters) {
+		__uint64_t count = start_cluster_pos + num_clusters - pos;
+
+		if (count > rc->range_clusters) {
+			count = rc->range_clusters;
+		}
+
+		int run_result = _recover_run(dd, rc, &buf, pos, count);
+
+		if (run_result > result) {
+			result = run_result;
+		}
+
+		if (result > 1) {
+			break;
+		}
+	}
+
+	_put_buffer(rc, buf);
+
+	return result;
+}
+
+/**
+ * Recover a range of clusters with several reads in flight at once on an
+ * async reader, which pays off on the healthy stretches of a failing drive.
+ * Reads that fail are retried synchronously through the device reader (on
+ * the disk's block device), split down to single clusters as in
+ * recover_range().
+ *
+ * @param dd DD context struct (recovery initialized)
+ * @param ar Async reader on the same device
+ * @param start_cluster_pos First cluster number
+ * @param num_clusters Number of clusters
+ * @return 0 if every cluster was recovered, 1 if some failed, 2 if the
+ *         overlay writer or either reader failed
+ */
+int recover_range_queued(dd_ctx* dd, async_reader_st* ar, __uint64_t start_cluster_pos, __uint64_t num_clusters)
+{
+	recovery_ctx* rc = dd->recovery;
+
+	if (rc->cluster_size % ar->block_size != 0 || rc->partition_offset % ar->block_size != 0) {
+		ERR("Clusters aren't aligned to %u byte blocks\n", ar->block_size);
+
+		return 2;
+	}
+
+	__uint64_t blocks_per_cluster = rc->cluster_size / ar->block_size;
+	__uint64_t first_lba = rc->partition_offset / ar->block_size;
+
+	__uint64_t end = start_cluster_pos + num_clusters;
+	__uint64_t pos = start_cluster_pos;
+
+	int result = 0;
+
+	while ((pos < end && result < 2) || ar->in_flight > 0) {
+		// Keep the queue full.
+
+		while (pos < end && result < 2 && ar->in_flight < ar->depth) {
+			__uint64_t count = end - pos;
+
+			if (count > rc->range_clusters) {
+				count = rc->range_clusters;
+			}
+
+			unsigned char* buf = _get_buffer(rc);
+
+			if (buf == NULL) {
+				ERR("Unable to allocate recovery buffer\n");
+
+				result = 2;
+				break;
+			}
+
+			if (async_read_submit(ar, first_lba + pos * blocks_per_cluster, count * blocks_per_cluster, buf, NULL)) {
+				ERR("%s", ar->error_msg);
+
+				_put_buffer(rc, buf);
+
+				result = 2;
+				break;
+			}
+
+			pos += count;
+		}
+
+		async_completion_st completion;
+
+		int ret = async_read_complete(ar, &completion, 1);
+
+		if (ret < 0) {
+			ERR("%s", ar->error_msg);
+
+			return 2;
+		}
+
+		if (ret == 0) {
+			continue;
+		}
+
+		__uint64_t cluster_pos = (completion.lba - first_lba) / blocks_per_cluster;
+		__uint64_t count = completion.len / blocks_per_cluster;
+
+		telemetry_record(rc->telemetry, completion.lba * ar->block_size, completion.len * ar->block_size, completion.seconds,
+				completion.result ? TELEMETRY_ERROR : TELEMETRY_OK, &completion.senseinfo);
+
+		int run_result = 0;
+
+		if (completion.result == 0) {
+			for (__uint64_t i = 0; i < count; i++) {
+				if (overlay_writer_submit(&rc->writer, cluster_pos + i, completion.buf + rc->cluster_size * i)) {
+					ERR("%s", rc->writer.error_msg);
+
+					run_result = 2;
+					break;
+				}
+			}
+
+			rc->clusters_recovered += count;
+		} else if (result < 2) {
+			printf("Queued read of clusters %lu-%lu failed: sense %02x/%02x/%02x; retrying\n",
+					cluster_pos, cluster_pos + count - 1, completion.senseinfo.sense_key,
+					completion.senseinfo.asc, completion.senseinfo.ascq);
+
+			run_result = _recover_run(dd, rc, &completion.buf, cluster_pos, count);
+		}
+
+		_put_buffer(rc, completion.buf);
+
+		if (run_result > result) {
+			result = run_result;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Make a single read attempt at a run of clusters, queueing them for the
+ * overlay if it succeeds.  No retries or splitting; that's left to the
+ * caller (see scheduler.c.)
+ *
+ * @param dd DD context struct (recovery initialized)
+ * @param cluster_pos First cluster number
+ * @param num_clusters Number of clusters (at most range_clusters)
+ * @param seconds Set to the time the device took to answer (the timeout,
+ *                if the read was abandoned)
+ * @return 0 if the run was recovered, 1 if the read failed or timed out, 2
+ *         if the overlay writer or device reader failed
+ */
+int recover_read(dd_ctx* dd, __uint64_t cluster_pos, __uint64_t num_clusters, double* seconds)
+{
+	recovery_ctx* rc = dd->recovery;
+
+	unsigned char* buf = _get_buffer(rc);
+
+	if (buf == NULL) {
+		ERR("Unable to allocate recovery buffer\n");
+
+		return 2;
+	}
+
+	int read_result = _read_device(dd, rc, &buf, cluster_pos, num_clusters, seconds);
+
+	int result = 0;
+
+	if (read_result == -3) {
+		result = 2;
+	} else if (read_result) {
+		result = 1;
+	} else {
+		for (__uint64_t i = 0; i < num_clusters; i++) {
+			if (overlay_writer_submit(&rc->writer, cluster_pos + i, buf + rc->cluster_size * i)) {
+				ERR("%s", rc->writer.error_msg);
+
+				result = 2;
+				break;
+			}
+		}
+
+		rc->clusters_recovered += num_clusters;
+	}
+
+	_put_buffer(rc, buf);
+
+	return result;
+}
+
+/**
+ * Retry a single cluster that failed to read, a device sector at a time,
+ * storing whatever sectors can be read (see _recover_sectors().)
+ *
+ * @param dd DD context struct (recovery initialized)
+ * @param cluster_pos Cluster number
+ * @param seconds Set to the device time taken
+ * @return 0 if the whole cluster is now recovered, 1 if not, 2 if the
+ *         overlay writer or device reader failed
+ */
+int recover_sectors(dd_ctx* dd, __uint64_t cluster_pos, double* seconds)
+{
+	recovery_ctx* rc = dd->recovery;
+
+	unsigned char* buf = _get_buffer(rc);
+
+	if (buf == NULL) {
+		ERR("Unable to allocate recovery buffer\n");
+
+		return 2;
+	}
+
+	int result = _recover_sectors(dd, rc, &buf, cluster_pos, seconds);
+
+	if (result == 0) {
+		rc->clusters_recovered++;
+	}
+
+	_put_buffer(rc, buf);
+
+	return result;
+}
+
+/**
+ * Recover num_clusters clusters from the device into the overlay, opening
+ * the device on first use.  Returns once what was recovered is in the
+ * overlay.
+ *
+ * @param dd DD context struct
+ * @param device Device to read from
+ * @param start_cluster_pos First cluster number
+ * @param num_clusters Number of clusters
+ * @return 0 on success, nonzero on failure
+ */
+int recover_to_overlay(dd_ctx* dd, const char* device, __uint64_t start_cluster_pos, int num_clusters)
+{
+	if (init_recovery(dd, device, -1, -1)) {
+		return 3;
+	}
+
+	int result = recover_range(dd, start_cluster_pos, num_clusters);
+
+	// Callers read the clusters back from the overlay next.
+
+	if (overlay_writer_flush(&dd->recovery->writer)) {
+		ERR("%s", dd->recovery->writer.error_msg);
+
+		return 4;
+	}
+
+	if (result == 1) {
+		ERR("Unable to read all of clusters %lu - %lu from %s\n", start_cluster_pos, start_cluster_pos + num_clusters - 1, device);
+
+		return 5;
+	}
+
+	return result;
+}
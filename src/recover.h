@@ -0,0 +1,84 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "dd.h"
+#include "overlay_writer.h"
+#include "device_reader.h"
+#include "async_reader.h"
+#include "telemetry.h"
+
+// Reads clusters missing from the image off the original device and hands
+// them to an overlay writer.  The device stays open for the whole recovery
+// and reads go through a pool of aligned buffers, one request per range of
+// adjacent clusters.  Reads go through a device reader, so one that hangs
+// is abandoned after reader.timeout seconds and counts as failed.  Single
+// clusters that fail are retried a device sector at a time.
+//
+// On a disk with an sg device, recover_range() keeps several reads in
+// flight at once through an async reader on the sg device, while the device
+// reader (and so every retry) uses the disk's block device.
+
+typedef struct recovery_ctx_st {
+	device_reader_st reader;
+
+	async_reader_st* async; // Queued reads on the disk's sg device (else NULL)
+
+	__uint64_t partition_offset;
+	int cluster_size;
+
+	int range_clusters; // Largest single device read, in clusters
+
+	unsigned char** buf_pool; // Free range buffers
+	int buf_pool_count;
+
+	overlay_writer_st writer;
+
+	telemetry_st* telemetry; // Logs every device read (if set)
+
+	int last_result; // TELEMETRY_* of the last device read
+
+	__uint64_t clusters_recovered;
+	__uint64_t clusters_failed;
+	__uint64_t clusters_partial; // Stored with some sectors missing
+	__uint64_t sectors_recovered; // By sector retries
+} recovery_ctx;
+
+int init_recovery(dd_ctx* dd, const char* device, int range_clusters, double timeout);
+
+int init_recovery_source(dd_ctx* dd, block_source_st* source, int range_clusters, double timeout);
+
+int cleanup_recovery(dd_ctx* dd);
+
+int recover_range(dd_ctx* dd, __uint64_t start_cluster_pos, __uint64_t num_clusters);
+
+int recover_range_queued(dd_ctx* dd, async_reader_st* ar, __uint64_t start_cluster_pos, __uint64_t num_clusters);
+
+int recover_read(dd_ctx* dd, __uint64_t cluster_pos, __uint64_t num_clusters, double* seconds);
+
+int recover_sectors(dd_ctx* dd, __uint64_t cluster_pos, double* seconds);
+
+int recover_to_overlay(dd_ctx* dd, const char* device, __uint64_t start_cluster_pos, int num_clusters);
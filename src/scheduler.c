@@ -0,0 +1,823 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "scheduler.h"
+#include "recover.h"
+#include "overlay.h"
+#include "simdev.h"
+
+#include <string.h>
+
+#define ERR(...) \
+	if (dd->error == 0) { \
+		memset(dd->error_msg, 0, 4096); \
+		dd->error = 1; \
+	} \
+	dd->error = 1; \
+	snprintf(dd->error_msg + strlen(dd->error_msg), 4096 - strlen(dd->error_msg), __VA_ARGS__);
+
+void init_scheduler(scheduler_ctx* sched)
+{
+	memset(sched, 0, sizeof(scheduler_ctx));
+
+	sched->max_passes = 8;
+	sched->max_attempts = 3;
+	sched->max_timeouts = 2;
+	sched->sector_retry = 1;
+	sched->time_budget = 0;
+	sched->slow_read = 1.0;
+
+	sched->range_clusters = 256;
+	sched->min_skip = 256;
+	sched->max_skip = 65536;
+}
+
+void cleanup_scheduler(scheduler_ctx* sched)
+{
+	free(sched->region);
+	free(sched->avoid);
+
+	sched->avoid = NULL;
+	sched->avoid_count = 0;
+
+	sched->region = NULL;
+	sched->region_count = 0;
+	sched->region_alloc = 0;
+}
+
+static sched_region_st* _append_region(sched_region_st** region, __uint64_t* count, __uint64_t* alloc)
+{
+	if (*count == *alloc) {
+		*alloc = (*alloc == 0) ? 256 : *alloc * 2;
+		*region = (sched_region_st*)realloc(*region, sizeof(sched_region_st) * *alloc);
+	}
+
+	return &(*region)[(*count)++];
+}
+
+/**
+ * Add a range of clusters to be recovered.
+ *
+ * @param sched Scheduler
+ * @param start First cluster number
+ * @param count Number of clusters
+ * @param priority Ranges with higher priority are read first
+ */
+void scheduler_add_range(scheduler_ctx* sched, __uint64_t start, __uint64_t count, int priority)
+{
+	sched_region_st* region = _append_region(&sched->region, &sched->region_count, &sched->region_alloc);
+
+	memset(region, 0, sizeof(sched_region_st));
+
+	region->start = start;
+	region->count = count;
+	region->priority = priority;
+	region->state = REGION_PENDING;
+}
+
+static int _sort_ranges(const void* a, const void* b)
+{
+	const sched_range_st* ra = (const sched_range_st*)a;
+	const sched_range_st* rb = (const sched_range_st*)b;
+
+	return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+/**
+ * Add ranges to the avoid list in one go, keeping it sorted and merging
+ * overlapping or adjacent ranges.
+ *
+ * @param sched Scheduler
+ * @param ranges Ranges to add, in any order
+ * @param count Number of ranges
+ */
+static void _avoid_ranges(scheduler_ctx* sched, const sched_range_st* ranges, __uint64_t count)
+{
+	if (count == 0) {
+		return;
+	}
+
+	sched->avoid = (sched_range_st*)realloc(sched->avoid, sizeof(sched_range_st) * (sched->avoid_count + count));
+
+	memcpy(sched->avoid + sched->avoid_count, ranges, sizeof(sched_range_st) * count);
+
+	sched->avoid_count += count;
+
+	qsort(sched->avoid, sched->avoid_count, sizeof(sched_range_st), _sort_ranges);
+
+	__uint64_t out = 0;
+
+	for (__uint64_t i = 1; i < sched->avoid_count; i++) {
+		sched_range_st* last = &sched->avoid[out];
+
+		if (sched->avoid[i].start <= last->start + last->count) {
+			__uint64_t end = sched->avoid[i].start + sched->avoid[i].count;
+
+			if (end > last->start + last->count) {
+				last->count = end - last->start;
+			}
+		} else {
+			sched->avoid[++out] = sched->avoid[i];
+		}
+	}
+
+	sched->avoid_count = out + 1;
+}
+
+/**
+ * Leave a range of clusters out of the first pass (because the device is
+ * known to be slow there); later passes still read it.
+ *
+ * @param sched Scheduler
+ * @param start First cluster number
+ * @param count Number of clusters
+ */
+void scheduler_avoid_range(scheduler_ctx* sched, __uint64_t start, __uint64_t count)
+{
+	sched_range_st range;
+
+	range.start = start;
+	range.count = count;
+
+	_avoid_ranges(sched, &range, 1);
+}
+
+/**
+ * Avoid (see scheduler_avoid_range()) the zones a telemetry log shows to be
+ * slow or failing.
+ *
+ * @param dd DD context struct
+ * @param sched Scheduler
+ * @param summary Telemetry summary
+ * @param slow_latency Avoid zones with a mean read latency above this
+ *                     (seconds)
+ * @param max_fail_rate Avoid zones where more than this fraction of reads
+ *                      failed
+ * @return Number of zones avoided
+ */
+int scheduler_avoid_slow_zones(dd_ctx* dd, scheduler_ctx* sched, telemetry_summary_st* summary, double slow_latency, double max_fail_rate)
+{
+	int avoided = 0;
+
+	for (__uint64_t i = 0; i < summary->zone_count; i++) {
+		telemetry_zone_st* zone = &summary->zone[i];
+
+		if (zone->latency / zone->reads <= slow_latency && (double)zone->failures / zone->reads <= max_fail_rate) {
+			continue;
+		}
+
+		// Clusters overlapping the zone.
+
+		__uint64_t zone_end = zone->offset + summary->zone_size;
+
+		if (zone_end <= NTFS.partition_offset) {
+			continue;
+		}
+
+		__uint64_t start = (zone->offset > NTFS.partition_offset) ? (zone->offset - NTFS.partition_offset) / NTFS_CLUSTER_SIZE : 0;
+		__uint64_t end = (zone_end - NTFS.partition_offset + NTFS_CLUSTER_SIZE - 1) / NTFS_CLUSTER_SIZE;
+
+		scheduler_avoid_range(sched, start, end - start);
+
+		avoided++;
+	}
+
+	return avoided;
+}
+
+// What the journal says to do with a cluster: 0 read as usual, 1 read
+// only after everything else (it has failed before), 2 give up on it.
+
+static int _journal_class(scheduler_ctx* sched, __uint64_t cluster)
+{
+	journal_entry_st* entry = journal_lookup(sched->journal, cluster);
+
+	if (entry == NULL || entry->last_result == JOURNAL_OK) {
+		return 0;
+	}
+
+	if (entry->failures >= sched->max_attempts || entry->timeouts >= sched->max_timeouts) {
+		return 2;
+	}
+
+	return 1;
+}
+
+static int _sort_by_id(bad_cluster_st *a, bad_cluster_st *b)
+{
+	return (a->id > b->id) - (a->id < b->id);
+}
+
+/**
+ * Add every cluster in dd->bad_clusters that isn't in the overlay yet, as
+ * ranges of adjacent clusters of equal priority (see priority.h.)
+ *
+ * @param dd DD context struct
+ * @param sched Scheduler
+ * @param prio Ranked files (NULL to rank file data equally)
+ */
+void scheduler_add_bad_clusters(dd_ctx* dd, scheduler_ctx* sched, priority_ctx* prio)
+{
+	bad_cluster_st *current_bad_cluster;
+	bad_cluster_st *bad_cluster_tmp;
+
+	if (prio != NULL) {
+		rank_bad_clusters(dd, prio);
+	}
+
+	HASH_SORT(dd->bad_clusters, _sort_by_id);
+
+	__uint64_t range_start = UINT64_MAX;
+	__uint64_t range_end = UINT64_MAX;
+	int range_priority = 0;
+
+	HASH_ITER(hh, dd->bad_clusters, current_bad_cluster, bad_cluster_tmp) {
+		if (overlay_has_cluster(dd, current_bad_cluster->id)) {
+			continue;
+		}
+
+		int priority = cluster_priority(dd, prio, current_bad_cluster);
+
+		if (range_start != UINT64_MAX && current_bad_cluster->id == range_end + 1 && priority == range_priority) {
+			range_end = current_bad_cluster->id;
+
+			continue;
+		}
+
+		if (range_start != UINT64_MAX) {
+			scheduler_add_range(sched, range_start, range_end - range_start + 1, range_priority);
+		}
+
+		range_start = current_bad_cluster->id;
+		range_end = current_bad_cluster->id;
+		range_priority = priority;
+	}
+
+	if (range_start != UINT64_MAX) {
+		scheduler_add_range(sched, range_start, range_end - range_start + 1, range_priority);
+	}
+}
+
+static int _sort_regions(const void* a, const void* b)
+{
+	const sched_region_st* ra = (const sched_region_st*)a;
+	const sched_region_st* rb = (const sched_region_st*)b;
+
+	if (ra->priority != rb->priority) {
+		return (ra->priority < rb->priority) - (ra->priority > rb->priority);
+	}
+
+	return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+// State carried through one pass while regions are rebuilt.
+
+typedef struct pass_st {
+	sched_region_st* region;
+	__uint64_t count;
+	__uint64_t alloc;
+
+	__uint64_t skip; // Clusters to skip after the next bad read (first pass)
+	__uint64_t skip_left; // Clusters still to skip
+	__uint64_t skip_end; // Where the region skip_left was set in ended
+
+	int sealed; // The last region can't be extended
+} pass_st;
+
+static void _emit(pass_st* pass, sched_region_st* from, __uint64_t start, __uint64_t count, int state, int attempts, double seconds)
+{
+	// Extend the previous region if it continues it.
+
+	if (pass->count > 0 && !pass->sealed) {
+		sched_region_st* prev = &pass->region[pass->count - 1];
+
+		if (prev->start + prev->count == start && prev->state == state &&
+				prev->priority == from->priority && prev->attempts == attempts) {
+			prev->count += count;
+			prev->seconds += seconds;
+
+			return;
+		}
+	}
+
+	sched_region_st* region = _append_region(&pass->region, &pass->count, &pass->alloc);
+
+	region->start = start;
+	region->count = count;
+	region->priority = from->priority;
+	region->state = state;
+	region->attempts = attempts;
+	region->seconds = seconds;
+
+	pass->sealed = 0;
+}
+
+static int _budget_spent(scheduler_ctx* sched)
+{
+	return sched->time_budget > 0 && sched->device_time >= sched->time_budget;
+}
+
+/**
+ * Attempt one read and record the outcome as a region of the new pass.
+ *
+ * @param split Leave a run of several clusters that fails with a read error
+ *              (rather than a timeout) to the caller to split, instead of
+ *              recording it
+ * @return 1 if the read failed or was slow, 0 if it was fine, 2 if it
+ *         failed and is left to be split, -1 if the overlay writer failed
+ */
+static int _attempt(dd_ctx* dd, scheduler_ctx* sched, pass_st* pass, sched_region_st* from, __uint64_t start, __uint64_t count, int split)
+{
+	double seconds;
+
+	journal_begin(sched->journal, start, count);
+
+	int result = recover_read(dd, start, count, &seconds);
+
+	if (result < 2) {
+		int journal_result = JOURNAL_OK;
+
+		if (result == 1) {
+			journal_result = (dd->recovery->last_result == TELEMETRY_TIMEOUT) ? JOURNAL_TIMEOUT : JOURNAL_FAILED;
+		}
+
+		journal_end(sched->journal, start, count, journal_result, seconds);
+	}
+
+	sched->device_time += seconds;
+
+	if (result > 1) {
+		return -1;
+	}
+
+	if (result == 0) {
+		_emit(pass, from, start, count, REGION_DONE, from->attempts, seconds);
+
+		return seconds > sched->slow_read;
+	}
+
+	if (split && count > 1 && dd->recovery->last_result == TELEMETRY_ERROR) {
+		return 2;
+	}
+
+	// Salvage what sectors of a bad cluster can be read.  Not after a
+	// timeout; the sectors would most likely hang the device too.
+
+	if (count == 1 && sched->sector_retry && dd->recovery->last_result == TELEMETRY_ERROR) {
+		double sector_seconds;
+
+		int sector_result = recover_sectors(dd, start, &sector_seconds);
+
+		sched->device_time += sector_seconds;
+		seconds += sector_seconds;
+
+		if (sector_result > 1) {
+			return -1;
+		}
+
+		if (sector_result == 0) {
+			_emit(pass, from, start, count, REGION_DONE, from->attempts, seconds);
+
+			return 1;
+		}
+	}
+
+	int attempts = from->attempts + 1;
+	int state = REGION_PENDING;
+
+	if (count == 1 && attempts >= sched->max_attempts) {
+		state = REGION_FAILED;
+	}
+
+	if (count == 1 && sched->journal != NULL && _journal_class(sched, start) == 2) {
+		state = REGION_FAILED;
+	}
+
+	// Keep each failed read a region of its own, so the next pass splits
+	// it rather than the run it was split from.
+
+	pass->sealed = 1;
+
+	_emit(pass, from, start, count, state, attempts, seconds);
+
+	pass->sealed = 1;
+
+	return 1;
+}
+
+/**
+ * Find the first avoided zone ending after pos.
+ *
+ * @return 1 if found (start and end set), 0 if not (both UINT64_MAX)
+ */
+static int _next_avoided(scheduler_ctx* sched, __uint64_t pos, __uint64_t* start, __uint64_t* end)
+{
+	__uint64_t low = 0;
+	__uint64_t high = sched->avoid_count;
+
+	while (low < high) {
+		__uint64_t mid = low + (high - low) / 2;
+
+		if (sched->avoid[mid].start + sched->avoid[mid].count <= pos) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	if (low == sched->avoid_count) {
+		*start = UINT64_MAX;
+		*end = UINT64_MAX;
+
+		return 0;
+	}
+
+	*start = sched->avoid[low].start;
+	*end = sched->avoid[low].start + sched->avoid[low].count;
+
+	return 1;
+}
+
+/**
+ * First pass over a pending region: large reads, skipping ahead past bad or
+ * slow spots.  Skipped clusters stay pending for later passes.
+ */
+static int _copy_region(dd_ctx* dd, scheduler_ctx* sched, pass_st* pass, sched_region_st* from)
+{
+	__uint64_t pos = from->start;
+	__uint64_t end = from->start + from->count;
+
+	// Regions are in priority order, so the one before may be nowhere near
+	// this one; only skip on into a region that carries on from it.
+
+	if (pass->skip_end != from->start) {
+		pass->skip_left = 0;
+	}
+
+	pass->skip_end = end;
+
+	while (pos < end) {
+		__uint64_t count = end - pos;
+
+		if (pass->skip_left > 0 || _budget_spent(sched)) {
+			if (count > pass->skip_left && !_budget_spent(sched)) {
+				count = pass->skip_left;
+			}
+
+			_emit(pass, from, pos, count, REGION_PENDING, from->attempts, 0);
+
+			pass->skip_left -= (count < pass->skip_left) ? count : pass->skip_left;
+			pos += count;
+
+			continue;
+		}
+
+		// Leave zones known to be slow for the later passes.
+
+		__uint64_t avoid_start;
+		__uint64_t avoid_end;
+
+		if (_next_avoided(sched, pos, &avoid_start, &avoid_end) && avoid_start <= pos) {
+			count = ((avoid_end < end) ? avoid_end : end) - pos;
+
+			_emit(pass, from, pos, count, REGION_PENDING, from->attempts, 0);
+
+			pos += count;
+
+			continue;
+		}
+
+		if (count > sched->range_clusters) {
+			count = sched->range_clusters;
+		}
+
+		if (avoid_start != UINT64_MAX && pos + count > avoid_start) {
+			count = avoid_start - pos;
+		}
+
+		int bad = _attempt(dd, sched, pass, from, pos, count, 0);
+
+		if (bad < 0) {
+			return -1;
+		}
+
+		if (bad) {
+			pass->skip_left = pass->skip;
+
+			if (pass->skip < sched->max_skip) {
+				pass->skip *= 2;
+			}
+		} else {
+			pass->skip = sched->min_skip;
+		}
+
+		pos += count;
+	}
+
+	return 0;
+}
+
+/**
+ * Split a run of a pending region in half and try each half once.  A half
+ * that fails with a read error is split again, down to single clusters, so
+ * one pass isolates the bad clusters in it; halves that time out are left
+ * for the next pass.  Single clusters are retried until they run out of
+ * attempts.
+ */
+static int _split_range(dd_ctx* dd, scheduler_ctx* sched, pass_st* pass, sched_region_st* from, __uint64_t start, __uint64_t count)
+{
+	__uint64_t piece = (count + 1) / 2;
+
+	if (piece > sched->range_clusters) {
+		piece = sched->range_clusters;
+	}
+
+	for (__uint64_t pos = start; pos < start + count; pos += piece) {
+		__uint64_t piece_count = start + count - pos;
+
+		if (piece_count > piece) {
+			piece_count = piece;
+		}
+
+		if (_budget_spent(sched)) {
+			_emit(pass, from, pos, piece_count, REGION_PENDING, from->attempts, 0);
+
+			continue;
+		}
+
+		int bad = _attempt(dd, sched, pass, from, pos, piece_count, 1);
+
+		if (bad < 0) {
+			return -1;
+		}
+
+		if (bad == 2 && _split_range(dd, sched, pass, from, pos, piece_count) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Later passes over a pending region (see _split_range().)
+ */
+static int _split_region(dd_ctx* dd, scheduler_ctx* sched, pass_st* pass, sched_region_st* from)
+{
+	if (_budget_spent(sched)) {
+		_emit(pass, from, from->start, from->count, REGION_PENDING, from->attempts, 0);
+
+		return 0;
+	}
+
+	return _split_range(dd, sched, pass, from, from->start, from->count);
+}
+
+/**
+ * Resume from a recovery journal: clusters that have failed before are
+ * left out of the first pass, and those that have failed too often (or
+ * hung the drive too often) aren't read again.  Further reads are added to
+ * the journal.  Call after adding ranges, before run_scheduler().
+ *
+ * @param sched Scheduler
+ * @param journal Journal
+ */
+void scheduler_apply_journal(scheduler_ctx* sched, journal_st* journal)
+{
+	sched->journal = journal;
+
+	pass_st pass;
+
+	memset(&pass, 0, sizeof(pass_st));
+
+	__uint64_t skipped = 0;
+	__uint64_t deferred = 0;
+
+	// Deferred clusters are gathered into runs and avoided together once
+	// the regions are rebuilt.
+
+	sched_range_st* runs = NULL;
+	__uint64_t run_count = 0;
+	__uint64_t run_alloc = 0;
+
+	for (__uint64_t i = 0; i < sched->region_count; i++) {
+		sched_region_st* from = &sched->region[i];
+
+		if (from->state != REGION_PENDING) {
+			_emit(&pass, from, from->start, from->count, from->state, from->attempts, from->seconds);
+
+			continue;
+		}
+
+		for (__uint64_t cluster = from->start; cluster < from->start + from->count; cluster++) {
+			int journal_class = _journal_class(sched, cluster);
+
+			if (journal_class == 2) {
+				_emit(&pass, from, cluster, 1, REGION_FAILED, from->attempts, 0);
+
+				skipped++;
+			} else {
+				_emit(&pass, from, cluster, 1, REGION_PENDING, from->attempts, 0);
+
+				if (journal_class == 1) {
+					if (run_count > 0 && runs[run_count - 1].start + runs[run_count - 1].count == cluster) {
+						runs[run_count - 1].count++;
+					} else {
+						if (run_count == run_alloc) {
+							run_alloc = (run_alloc == 0) ? 64 : run_alloc * 2;
+							runs = (sched_range_st*)realloc(runs, sizeof(sched_range_st) * run_alloc);
+						}
+
+						runs[run_count].start = cluster;
+						runs[run_count].count = 1;
+						run_count++;
+					}
+
+					deferred++;
+				}
+			}
+		}
+	}
+
+	free(sched->region);
+
+	sched->region = pass.region;
+	sched->region_count = pass.count;
+	sched->region_alloc = pass.alloc;
+
+	_avoid_ranges(sched, runs, run_count);
+
+	free(runs);
+
+	printf("Journal: %lu clusters given up on, %lu left for later passes\n", skipped, deferred);
+}
+
+/**
+ * Recover the scheduler's ranges from the device into the overlay.
+ * Recovery must already be initialized with init_recovery().
+ *
+ * @param dd DD context struct
+ * @param sched Scheduler with ranges added
+ * @return 0 if everything was recovered, 1 if some clusters failed or were
+ *         left unread, 2 if the overlay writer failed
+ */
+int run_scheduler(dd_ctx* dd, scheduler_ctx* sched)
+{
+	qsort(sched->region, sched->region_count, sizeof(sched_region_st), &_sort_regions);
+
+	for (sched->pass = 1; sched->pass <= sched->max_passes && !_budget_spent(sched); sched->pass++) {
+		pass_st pass;
+
+		memset(&pass, 0, sizeof(pass_st));
+
+		pass.skip = sched->min_skip;
+
+		__uint64_t pending = 0;
+
+		for (__uint64_t i = 0; i < sched->region_count; i++) {
+			if (sched->region[i].state == REGION_PENDING) {
+				pending += sched->region[i].count;
+			}
+		}
+
+		if (pending == 0) {
+			break;
+		}
+
+		printf("Pass %d: %lu clusters pending, %.1fs device time\n", sched->pass, pending, sched->device_time);
+
+		for (__uint64_t i = 0; i < sched->region_count; i++) {
+			sched_region_st* from = &sched->region[i];
+
+			int result = 0;
+
+			if (from->state != REGION_PENDING) {
+				_emit(&pass, from, from->start, from->count, from->state, from->attempts, from->seconds);
+			} else if (sched->pass == 1) {
+				result = _copy_region(dd, sched, &pass, from);
+			} else {
+				result = _split_region(dd, sched, &pass, from);
+			}
+
+			if (result < 0) {
+				free(pass.region);
+
+				return 2;
+			}
+		}
+
+		free(sched->region);
+
+		sched->region = pass.region;
+		sched->region_count = pass.count;
+		sched->region_alloc = pass.alloc;
+	}
+
+	// Summarize.
+
+	__uint64_t totals[3] = { 0, 0, 0 };
+
+	for (__uint64_t i = 0; i < sched->region_count; i++) {
+		totals[sched->region[i].state] += sched->region[i].count;
+	}
+
+	printf("Recovered %lu clusters, %lu failed, %lu left unread; %.1fs device time\n",
+			totals[REGION_DONE], totals[REGION_FAILED], totals[REGION_PENDING], sched->device_time);
+
+	if (dd->recovery->clusters_partial > 0) {
+		printf("%lu clusters partly recovered; %lu sectors read by sector retries\n", dd->recovery->clusters_partial, dd->recovery->sectors_recovered);
+	}
+
+	return (totals[REGION_FAILED] + totals[REGION_PENDING] > 0) ? 1 : 0;
+}
+
+/**
+ * Benchmark the scheduler against a simulated failing drive: recover its
+ * ranges from a good image of the device as the fault profile lets them
+ * be read, then print what was recovered per simulated hour.  Reads and
+ * timeouts cost simulated time only, so a run takes as long as the host
+ * needs and gives the same result for the same profile, seed and
+ * scheduler settings.
+ *
+ * @param dd DD context struct (NTFS and a scratch overlay open, recovery
+ *           not initialized)
+ * @param sched Scheduler with ranges added
+ * @param image Good image of the device
+ * @param profile Fault profile (see simdev.h)
+ * @param seed Seed for intermittent failures
+ * @param power_cycle Simulated seconds before a frozen device is power
+ *                    cycled (0 to leave it frozen)
+ * @param telemetry Log of the simulated reads, stamped with simulated time
+ *                  (NULL for none)
+ * @return As run_scheduler(), or 3 if the simulated device or recovery
+ *         couldn't be started
+ */
+int benchmark_scheduler(dd_ctx* dd, scheduler_ctx* sched, const char* image, const char* profile, __uint64_t seed, double power_cycle, telemetry_st* telemetry)
+{
+	sim_device_st sim;
+
+	if (open_sim_device(&sim, image, profile, 0, seed)) {
+		ERR("%s", sim.error_msg);
+
+		return 3;
+	}
+
+	sim.power_cycle = power_cycle;
+
+	if (init_recovery_source(dd, &sim.source, sched->range_clusters, -1)) {
+		close_sim_device(&sim);
+
+		return 3;
+	}
+
+	if (telemetry != NULL) {
+		telemetry->source = &sim.source;
+	}
+
+	dd->recovery->telemetry = telemetry;
+
+	int result = run_scheduler(dd, sched);
+
+	__uint64_t recovered = dd->recovery->clusters_recovered;
+
+	if (cleanup_recovery(dd)) {
+		result = 2;
+	}
+
+	if (telemetry != NULL) {
+		telemetry->source = NULL;
+	}
+
+	print_sim_stats(&sim);
+
+	double hours = sim.sim_seconds / 3600;
+
+	printf("Benchmark: %lu clusters recovered in %.2f simulated hours (%.0f per hour)\n",
+			recovered, hours, (hours > 0) ? recovered / hours : 0);
+
+	close_sim_device(&sim);
+
+	return result;
+}
@@ -0,0 +1,102 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "dd.h"
+#include "priority.h"
+#include "telemetry.h"
+#include "journal.h"
+
+// Decides what to read from a failing device and in what order, in the
+// manner of GNU ddrescue.  The first pass reads every target range in large
+// requests in LBA order, skipping ahead (by a growing distance) past reads
+// that fail or are slow.  Later passes split what's left in half and retry,
+// splitting halves that fail on down to single clusters within the pass,
+// until single clusters have used up their attempts, the passes run out or
+// the device time budget is spent.  Single clusters that fail are retried a
+// sector at a time, keeping whatever sectors can be read.
+
+#define REGION_PENDING 0
+#define REGION_DONE 1
+#define REGION_FAILED 2
+
+typedef struct sched_region_st {
+	__uint64_t start; // first cluster number
+	__uint64_t count; // number of clusters
+
+	int priority; // Higher priority regions are read first
+	int state;
+	int attempts; // Failed or slow reads covering this region
+	double seconds; // Device time spent on this region
+} sched_region_st;
+
+typedef struct sched_range_st {
+	__uint64_t start;
+	__uint64_t count;
+} sched_range_st;
+
+typedef struct scheduler_ctx_st {
+	sched_region_st* region; // Sorted by priority, then cluster
+	__uint64_t region_count;
+	__uint64_t region_alloc;
+
+	int max_passes;
+	int max_attempts; // Give up on a single cluster after this many tries
+	int max_timeouts; // Give up on a cluster after hanging this many reads (journal)
+	int sector_retry; // Retry single clusters that fail a sector at a time
+	double time_budget; // Seconds of device time (0 for no limit)
+	double slow_read; // Reads slower than this (seconds) skip ahead
+
+	__uint64_t range_clusters; // Largest read
+	__uint64_t min_skip; // Clusters skipped after the first bad read
+	__uint64_t max_skip;
+
+	sched_range_st* avoid; // Left out of the first pass; sorted, disjoint
+	__uint64_t avoid_count;
+
+	journal_st* journal; // Every read is journaled (if set)
+
+	double device_time; // Seconds spent waiting on the device so far
+	int pass;
+} scheduler_ctx;
+
+void init_scheduler(scheduler_ctx* sched);
+
+void cleanup_scheduler(scheduler_ctx* sched);
+
+void scheduler_add_range(scheduler_ctx* sched, __uint64_t start, __uint64_t count, int priority);
+
+void scheduler_add_bad_clusters(dd_ctx* dd, scheduler_ctx* sched, priority_ctx* prio);
+
+void scheduler_avoid_range(scheduler_ctx* sched, __uint64_t start, __uint64_t count);
+
+int scheduler_avoid_slow_zones(dd_ctx* dd, scheduler_ctx* sched, telemetry_summary_st* summary, double slow_latency, double max_fail_rate);
+
+void scheduler_apply_journal(scheduler_ctx* sched, journal_st* journal);
+
+int run_scheduler(dd_ctx* dd, scheduler_ctx* sched);
+
+int benchmark_scheduler(dd_ctx* dd, scheduler_ctx* sched, const char* image, const char* profile, __uint64_t seed, double power_cycle, telemetry_st* telemetry);
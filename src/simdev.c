@@ -0,0 +1,381 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "simdev.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERR(...) \
+	snprintf(sim->error_msg, 4096, __VA_ARGS__);
+
+static __uint64_t _next_random(sim_device_st* sim)
+{
+	sim->rng ^= sim->rng << 13;
+	sim->rng ^= sim->rng >> 7;
+	sim->rng ^= sim->rng << 17;
+
+	return sim->rng;
+}
+
+static int _parse_profile_line(sim_device_st* sim, const char* line, sim_region_st* region)
+{
+	char pos[32];
+	char size[32];
+	char sense[32];
+
+	memset(region, 0, sizeof(sim_region_st));
+
+	double latency_ms;
+
+	if (sscanf(line, "%31s %31s %lf %lf %31s %lu", pos, size, &latency_ms, &region->fail_rate, sense, &region->freeze_after) != 6) {
+		return 1;
+	}
+
+	region->pos = strtoull(pos, NULL, 0);
+	region->size = strtoull(size, NULL, 0);
+	region->latency = latency_ms / 1000;
+
+	if (strcmp(sense, "-")) {
+		unsigned int key, asc, ascq;
+
+		if (sscanf(sense, "%x/%x/%x", &key, &asc, &ascq) != 3) {
+			return 1;
+		}
+
+		region->sense.is_fixed = true;
+		region->sense.is_current = true;
+		region->sense.sense_key = key;
+		region->sense.asc = asc;
+		region->sense.ascq = ascq;
+	}
+
+	return 0;
+}
+
+static int _sim_read(block_source_st* source, unsigned char* buf, off_t offset, size_t length, struct sense_info_t* sense)
+{
+	sim_device_st* sim = (sim_device_st*)source->param;
+
+	memset(sense, 0, sizeof(struct sense_info_t));
+
+	pthread_mutex_lock(&sim->lock);
+
+	sim->active++;
+	sim->reads++;
+
+	double latency = 0;
+	sim_region_st* failed = NULL;
+	int freeze = 0;
+
+	for (int i = 0; i < sim->region_count; i++) {
+		sim_region_st* region = &sim->region[i];
+
+		if (offset >= region->pos + region->size || offset + length <= region->pos) {
+			continue;
+		}
+
+		region->reads++;
+
+		if (region->latency > latency) {
+			latency = region->latency;
+		}
+
+		if (failed == NULL && region->fail_rate > 0 &&
+				(double)(_next_random(sim) >> 11) / (double)(1ull << 53) < region->fail_rate) {
+			failed = region;
+		}
+
+		if (region->freeze_after != 0 && region->reads == region->freeze_after) {
+			freeze = 1;
+		}
+	}
+
+	if (freeze && !sim->frozen) {
+		sim->frozen = 1;
+		sim->frozen_at = sim->sim_seconds;
+		sim->freezes++;
+	}
+
+	// A frozen device doesn't answer until it's thawed, by thaw_sim_device()
+	// or by being power cycled.  A reader with a timeout gives up first,
+	// and any read taking longer than the timeout is given up on.
+
+	double timeout = source->timeout;
+	int timed_out = 0;
+
+	if (sim->frozen && timeout > 0) {
+		latency = timeout;
+		timed_out = 1;
+	} else if (sim->frozen && sim->power_cycle > 0) {
+		latency += sim->frozen_at + sim->power_cycle - sim->sim_seconds;
+	}
+
+	while (sim->frozen && timeout <= 0 && sim->power_cycle <= 0 && !sim->closing) {
+		pthread_cond_wait(&sim->thaw, &sim->lock);
+	}
+
+	if (timeout > 0 && latency > timeout) {
+		latency = timeout;
+		timed_out = 1;
+	}
+
+	if (timed_out) {
+		sim->timeouts++;
+	}
+
+	int closing = sim->closing;
+
+	sim->sim_seconds += latency;
+
+	if (sim->frozen && sim->power_cycle > 0 && sim->sim_seconds >= sim->frozen_at + sim->power_cycle) {
+		sim->frozen = 0;
+		sim->power_cycles++;
+
+		pthread_cond_broadcast(&sim->thaw);
+	}
+
+	pthread_mutex_unlock(&sim->lock);
+
+	if (latency > 0 && sim->time_scale > 0 && !closing) {
+		struct timespec delay;
+
+		double seconds = latency * sim->time_scale;
+
+		delay.tv_sec = (time_t)seconds;
+		delay.tv_nsec = (long)((seconds - delay.tv_sec) * 1e9);
+
+		while (nanosleep(&delay, &delay) == -1 && errno == EINTR);
+	}
+
+	int error = 0;
+
+	if (closing) {
+		error = EIO;
+	} else if (timed_out) {
+		error = ETIMEDOUT;
+	} else if (failed != NULL) {
+		*sense = failed->sense;
+
+		sense->information_valid = true;
+		sense->information = ((__uint64_t)offset > failed->pos) ? offset : failed->pos;
+
+		error = EIO;
+	} else {
+		size_t done = 0;
+
+		while (done < length) {
+			ssize_t ret = pread(sim->fd, buf + done, length - done, offset + done);
+
+			if (ret == -1 && errno == EINTR) {
+				continue;
+			}
+
+			if (ret <= 0) {
+				error = (ret == 0) ? EIO : errno;
+
+				// Past the end of the image: ILLEGAL REQUEST, LBA OUT OF RANGE.
+
+				sense->is_fixed = true;
+				sense->is_current = true;
+				sense->sense_key = 0x05;
+				sense->asc = 0x21;
+
+				break;
+			}
+
+			done += ret;
+		}
+	}
+
+	pthread_mutex_lock(&sim->lock);
+
+	if (error) {
+		sim->failed_reads++;
+	} else {
+		sim->bytes_read += length;
+	}
+
+	if (--sim->active == 0) {
+		pthread_cond_broadcast(&sim->thaw);
+	}
+
+	pthread_mutex_unlock(&sim->lock);
+
+	return error;
+}
+
+static double _sim_clock(block_source_st* source)
+{
+	sim_device_st* sim = (sim_device_st*)source->param;
+
+	pthread_mutex_lock(&sim->lock);
+
+	double seconds = sim->sim_seconds;
+
+	pthread_mutex_unlock(&sim->lock);
+
+	return seconds;
+}
+
+/**
+ * Open a simulated device.
+ *
+ * @param sim Simulated device to initialize
+ * @param image Good image of the device
+ * @param profile Fault profile (see simdev.h)
+ * @param time_scale Real seconds per simulated second (0 to not wait)
+ * @param seed Seed for intermittent failures
+ * @return 0 on success, nonzero on failure (sim->error_msg set)
+ */
+int open_sim_device(sim_device_st* sim, const char* image, const char* profile, double time_scale, __uint64_t seed)
+{
+	memset(sim, 0, sizeof(sim_device_st));
+
+	sim->source.read = &_sim_read;
+	sim->source.clock = &_sim_clock;
+	sim->source.param = sim;
+
+	sim->time_scale = time_scale;
+	sim->rng = (seed != 0) ? seed : 0x9E3779B97F4A7C15ull;
+
+	FILE* file = fopen(profile, "r");
+
+	if (file == NULL) {
+		ERR("Unable to open fault profile %s: %s\n", profile, strerror(errno));
+
+		return 1;
+	}
+
+	char line[256];
+	int line_num = 0;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		line_num++;
+
+		char* start = line + strspn(line, " \t\r\n");
+
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+
+		sim->region = (sim_region_st*)realloc(sim->region, sizeof(sim_region_st) * (sim->region_count + 1));
+
+		if (_parse_profile_line(sim, start, &sim->region[sim->region_count])) {
+			ERR("Invalid line %d in fault profile %s\n", line_num, profile);
+
+			fclose(file);
+			free(sim->region);
+
+			return 2;
+		}
+
+		sim->region_count++;
+	}
+
+	fclose(file);
+
+	sim->fd = open(image, O_RDONLY);
+
+	if (sim->fd == -1) {
+		ERR("Unable to open %s: %s\n", image, strerror(errno));
+
+		free(sim->region);
+
+		return 3;
+	}
+
+	pthread_mutex_init(&sim->lock, NULL);
+	pthread_cond_init(&sim->thaw, NULL);
+
+	return 0;
+}
+
+/**
+ * Unfreeze the device (as if power cycled); reads waiting on it carry on.
+ *
+ * @param sim Simulated device
+ */
+void thaw_sim_device(sim_device_st* sim)
+{
+	pthread_mutex_lock(&sim->lock);
+
+	sim->frozen = 0;
+
+	pthread_cond_broadcast(&sim->thaw);
+	pthread_mutex_unlock(&sim->lock);
+}
+
+/**
+ * Close the device.  Reads stuck on a freeze fail, and closing waits for
+ * them to return.
+ *
+ * @param sim Simulated device
+ */
+void close_sim_device(sim_device_st* sim)
+{
+	pthread_mutex_lock(&sim->lock);
+
+	sim->closing = 1;
+
+	pthread_cond_broadcast(&sim->thaw);
+
+	while (sim->active > 0) {
+		pthread_cond_wait(&sim->thaw, &sim->lock);
+	}
+
+	pthread_mutex_unlock(&sim->lock);
+
+	close(sim->fd);
+
+	free(sim->region);
+
+	pthread_mutex_destroy(&sim->lock);
+	pthread_cond_destroy(&sim->thaw);
+}
+
+/**
+ * Print what the simulated device has served, per simulated hour.
+ *
+ * @param sim Simulated device
+ */
+void print_sim_stats(sim_device_st* sim)
+{
+	pthread_mutex_lock(&sim->lock);
+
+	double hours = sim->sim_seconds / 3600;
+
+	printf("Simulated device: %lu reads, %lu failed, %lu timed out, %lu freezes, %lu power cycles, %.1f simulated seconds\n",
+			sim->reads, sim->failed_reads, sim->timeouts, sim->freezes, sim->power_cycles, sim->sim_seconds);
+	printf("Recovered %.1f MB (%.1f MB per simulated hour)\n",
+			sim->bytes_read / 1e6, (hours > 0) ? sim->bytes_read / 1e6 / hours : 0);
+
+	pthread_mutex_unlock(&sim->lock);
+}
@@ -0,0 +1,104 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "block_source.h"
+
+#include <pthread.h>
+
+// A failing drive simulated from a good image and a fault profile, for
+// trying recovery strategies without one.  Reads are served from the image
+// after the profile's latency; regions of the profile can fail every read
+// (hard errors) or some of them (intermittent), with the sense data given,
+// and can freeze the whole device after so many reads, until it's thawed
+// (power cycled.)
+//
+// The simulation keeps its own clock, so results are reproducible for a
+// given profile and seed however fast the host is; time_scale sets how
+// much real time a simulated second takes (0 to not wait at all.)  The
+// clock is the block source's, so readers time reads and time them out by
+// it: a read to a frozen device costs the reader's timeout in simulated
+// time, not real time.
+//
+// Profile lines, ddrescue mapfile style, positions and sizes in bytes:
+//
+//   # pos       size        latency_ms  fail_rate  sense     freeze_after
+//   0x00000000  0x10000000  8           0          -         0
+//   0x10000000  0x00100000  3000        1          03/11/00  0
+//   0x10100000  0x00400000  500         0.7        03/11/00  200
+//
+// Bytes not covered by any line read without error or delay.
+
+typedef struct sim_region_st {
+	__uint64_t pos;
+	__uint64_t size;
+
+	double latency; // Seconds per read touching the region
+	double fail_rate; // 0 never fails, 1 always fails, in between intermittent
+	struct sense_info_t sense; // Reported on failure
+
+	__uint64_t freeze_after; // Freeze the device on this many reads (0 never)
+	__uint64_t reads;
+} sim_region_st;
+
+typedef struct sim_device_st {
+	block_source_st source; // Hand &sim->source to the readers
+
+	int fd; // Good image
+
+	sim_region_st* region;
+	int region_count;
+
+	double time_scale; // Real seconds per simulated second
+	double power_cycle; // Simulated seconds a freeze lasts (0 until thaw_sim_device())
+	__uint64_t rng; // xorshift64 state
+
+	pthread_mutex_t lock; // Guards everything below, and reads/rng above
+	pthread_cond_t thaw;
+
+	int frozen;
+	double frozen_at; // Simulated time of the last freeze
+	int closing;
+	int active; // Reads in progress
+
+	double sim_seconds; // Simulated device time so far
+	__uint64_t reads;
+	__uint64_t failed_reads;
+	__uint64_t bytes_read; // Bytes of successful reads
+	__uint64_t timeouts; // Reads given up on by the reader's timeout
+	__uint64_t freezes;
+	__uint64_t power_cycles;
+
+	char error_msg[4096];
+} sim_device_st;
+
+int open_sim_device(sim_device_st* sim, const char* image, const char* profile, double time_scale, __uint64_t seed);
+
+void thaw_sim_device(sim_device_st* sim);
+
+void close_sim_device(sim_device_st* sim);
+
+void print_sim_stats(sim_device_st* sim);
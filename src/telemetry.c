@@ -0,0 +1,340 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "telemetry.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <uthash-master/uthash.h>
+
+// File format: an 8-byte header ("EDDT", version) followed by 32-byte
+// records (telemetry_record_st, little endian as written.)
+
+#define TELEMETRY_MAGIC "EDDT"
+#define TELEMETRY_VERSION 1
+
+#define TELEMETRY_HEADER_SIZE 8
+
+/**
+ * Open a telemetry log for appending, creating it if it doesn't exist.
+ *
+ * @param tel Telemetry log to initialize
+ * @param filename Log file
+ * @return 0 on success, nonzero on failure
+ */
+int open_telemetry(telemetry_st* tel, const char* filename)
+{
+	memset(tel, 0, sizeof(telemetry_st));
+
+	tel->file = fopen(filename, "ab");
+
+	if (tel->file == NULL) {
+		return 1;
+	}
+
+	if (ftell(tel->file) == 0) {
+		__uint32_t version = TELEMETRY_VERSION;
+
+		fwrite(TELEMETRY_MAGIC, 4, 1, tel->file);
+		fwrite(&version, sizeof(__uint32_t), 1, tel->file);
+	}
+
+	tel->filename = (char*)malloc(strlen(filename) + 1);
+	strcpy(tel->filename, filename);
+
+	return 0;
+}
+
+void close_telemetry(telemetry_st* tel)
+{
+	if (tel->file != NULL) {
+		fclose(tel->file);
+
+		tel->file = NULL;
+	}
+
+	free(tel->filename);
+
+	tel->filename = NULL;
+}
+
+/**
+ * Log one device read.
+ *
+ * @param tel Telemetry log (NULL to do nothing)
+ * @param offset Device byte offset
+ * @param length Bytes
+ * @param seconds Time the read took
+ * @param result TELEMETRY_*
+ * @param sense Sense data (NULL if none)
+ */
+void telemetry_record(telemetry_st* tel, off_t offset, size_t length, double seconds, int result, const struct sense_info_t* sense)
+{
+	if (tel == NULL || tel->file == NULL) {
+		return;
+	}
+
+	telemetry_record_st record;
+
+	memset(&record, 0, sizeof(telemetry_record_st));
+
+	record.offset = offset;
+
+	if (tel->source != NULL && tel->source->clock != NULL) {
+		record.time_us = (__uint64_t)(tel->source->clock(tel->source) * 1e6);
+	} else {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+
+		record.time_us = (__uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+	}
+	record.length = length;
+	record.latency_us = (seconds * 1e6 < UINT32_MAX) ? (__uint32_t)(seconds * 1e6) : UINT32_MAX;
+	record.result = result;
+
+	if (sense != NULL) {
+		record.sense_key = sense->sense_key;
+		record.asc = sense->asc;
+		record.ascq = sense->ascq;
+	}
+
+	fwrite(&record, sizeof(telemetry_record_st), 1, tel->file);
+
+	tel->records++;
+}
+
+static int _sort_zones(const void* a, const void* b)
+{
+	const telemetry_zone_st* za = (const telemetry_zone_st*)a;
+	const telemetry_zone_st* zb = (const telemetry_zone_st*)b;
+
+	return (za->offset > zb->offset) - (za->offset < zb->offset);
+}
+
+// Zones are found by offset through a hash while reading the log.
+
+typedef struct zone_hash_st {
+	__uint64_t id; // zone offset
+	__uint64_t index; // into summary->zone
+
+	UT_hash_handle hh;
+} zone_hash_st;
+
+static telemetry_zone_st* _find_zone(telemetry_summary_st* summary, zone_hash_st** zones, __uint64_t offset, __uint64_t* zone_alloc)
+{
+	zone_hash_st* zone_hash;
+
+	HASH_FIND(hh, *zones, &offset, sizeof(__uint64_t), zone_hash);
+
+	if (zone_hash != NULL) {
+		return &summary->zone[zone_hash->index];
+	}
+
+	if (summary->zone_count == *zone_alloc) {
+		*zone_alloc = (*zone_alloc == 0) ? 256 : *zone_alloc * 2;
+		summary->zone = (telemetry_zone_st*)realloc(summary->zone, sizeof(telemetry_zone_st) * *zone_alloc);
+	}
+
+	zone_hash = (zone_hash_st*)malloc(sizeof(zone_hash_st));
+
+	zone_hash->id = offset;
+	zone_hash->index = summary->zone_count;
+
+	HASH_ADD(hh, *zones, id, sizeof(__uint64_t), zone_hash);
+
+	telemetry_zone_st* zone = &summary->zone[summary->zone_count++];
+
+	memset(zone, 0, sizeof(telemetry_zone_st));
+
+	zone->offset = offset;
+
+	return zone;
+}
+
+/**
+ * Read a telemetry log into per-zone totals.
+ *
+ * @param filename Log file
+ * @param zone_size Bytes per zone
+ * @param summary Summary to fill in (cleanup_telemetry_summary() when done)
+ * @param error_msg Set on failure (4096 bytes)
+ * @return 0 on success, nonzero on failure
+ */
+int summarize_telemetry(const char* filename, __uint64_t zone_size, telemetry_summary_st* summary, char* error_msg)
+{
+	memset(summary, 0, sizeof(telemetry_summary_st));
+
+	summary->zone_size = zone_size;
+
+	FILE* file = fopen(filename, "rb");
+
+	if (file == NULL) {
+		snprintf(error_msg, 4096, "Unable to open %s: %s\n", filename, strerror(errno));
+
+		return 1;
+	}
+
+	char magic[4];
+	__uint32_t version;
+
+	if (fread(magic, 4, 1, file) != 1 || memcmp(magic, TELEMETRY_MAGIC, 4) ||
+			fread(&version, sizeof(__uint32_t), 1, file) != 1 || version != TELEMETRY_VERSION) {
+		snprintf(error_msg, 4096, "%s is not a telemetry log\n", filename);
+
+		fclose(file);
+
+		return 2;
+	}
+
+	__uint64_t zone_alloc = 0;
+
+	zone_hash_st* zones = NULL;
+	zone_hash_st* current_zone;
+	zone_hash_st* zone_tmp;
+
+	telemetry_record_st record;
+
+	while (fread(&record, sizeof(telemetry_record_st), 1, file) == 1) {
+		if (summary->records == 0) {
+			summary->first_time_us = record.time_us;
+		}
+
+		summary->last_time_us = record.time_us;
+		summary->records++;
+
+		telemetry_zone_st* zone = _find_zone(summary, &zones, record.offset - record.offset % zone_size, &zone_alloc);
+
+		double latency = record.latency_us / 1e6;
+
+		zone->reads++;
+		zone->latency += latency;
+
+		if (latency > zone->max_latency) {
+			zone->max_latency = latency;
+		}
+
+		if (record.result != TELEMETRY_OK) {
+			zone->failures++;
+		}
+	}
+
+	fclose(file);
+
+	HASH_ITER(hh, zones, current_zone, zone_tmp) {
+		HASH_DEL(zones, current_zone);
+
+		free(current_zone);
+	}
+
+	qsort(summary->zone, summary->zone_count, sizeof(telemetry_zone_st), &_sort_zones);
+
+	return 0;
+}
+
+void cleanup_telemetry_summary(telemetry_summary_st* summary)
+{
+	free(summary->zone);
+
+	summary->zone = NULL;
+	summary->zone_count = 0;
+}
+
+/**
+ * Print a latency heatmap (one character per zone, darker for slower, X
+ * for zones where most reads failed, blank for zones never read) and a
+ * table of zones with failures or slow reads.
+ *
+ * @param summary Telemetry summary
+ */
+void print_telemetry_summary(telemetry_summary_st* summary)
+{
+	// Mean latency thresholds for each heatmap character, in seconds.
+
+	static const char ramp[] = ".:-=+*#%@";
+	static const double ramp_latency[] = { 0, 0.005, 0.02, 0.05, 0.1, 0.25, 0.5, 1, 5 };
+
+	printf("%lu reads over %.1f hours, %lu zones of %lu MB read\n", summary->records,
+			(summary->last_time_us - summary->first_time_us) / 3.6e9, summary->zone_count, summary->zone_size >> 20);
+
+	if (summary->zone_count == 0) {
+		return;
+	}
+
+	printf("\nMean latency by zone (.:-=+*#%%@ from <5ms to >5s; X mostly failing):\n");
+
+	__uint64_t first = summary->zone[0].offset;
+	__uint64_t last = summary->zone[summary->zone_count - 1].offset;
+
+	__uint64_t i = 0;
+
+	for (__uint64_t offset = first; offset <= last; offset += summary->zone_size) {
+		if ((offset - first) / summary->zone_size % 64 == 0) {
+			printf("\n%14lX ", offset);
+		}
+
+		if (summary->zone[i].offset != offset) {
+			printf(" ");
+
+			continue;
+		}
+
+		telemetry_zone_st* zone = &summary->zone[i++];
+
+		if (zone->failures * 2 > zone->reads) {
+			printf("X");
+
+			continue;
+		}
+
+		double mean = zone->latency / zone->reads;
+
+		int level = 0;
+
+		while (level < 8 && mean >= ramp_latency[level + 1]) {
+			level++;
+		}
+
+		printf("%c", ramp[level]);
+	}
+
+	printf("\n\n%14s %8s %8s %9s %10s %10s\n", "Zone", "Reads", "Failed", "Fail rate", "Mean (s)", "Max (s)");
+
+	for (__uint64_t i = 0; i < summary->zone_count; i++) {
+		telemetry_zone_st* zone = &summary->zone[i];
+
+		double mean = zone->latency / zone->reads;
+
+		if (zone->failures == 0 && mean < ramp_latency[5]) {
+			continue;
+		}
+
+		printf("%14lX %8lu %8lu %8.1f%% %10.3f %10.3f\n", zone->offset, zone->reads, zone->failures,
+				100.0 * zone->failures / zone->reads, mean, zone->max_latency);
+	}
+}
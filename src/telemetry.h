@@ -0,0 +1,97 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "block_source.h"
+
+#include <scsicmd/scsicmd.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Binary log of every device read made during recovery: where, how much,
+// how long it took and how it ended.  The log is appended to across runs,
+// so it shows whether a drive is getting worse, and summarized into a
+// per-zone latency heatmap and failure table that the scheduler can use to
+// leave slow zones for last.
+
+#define TELEMETRY_OK 0
+#define TELEMETRY_ERROR 1
+#define TELEMETRY_TIMEOUT 2
+
+typedef struct telemetry_record_st {
+	__uint64_t offset; // Device byte offset
+	__uint64_t time_us; // Wall clock (or source clock) time the read ended, microseconds
+	__uint32_t length; // Bytes
+	__uint32_t latency_us;
+	__uint8_t result; // TELEMETRY_*
+	__uint8_t sense_key;
+	__uint8_t asc;
+	__uint8_t ascq;
+	__uint32_t reserved;
+} telemetry_record_st;
+
+typedef struct telemetry_st {
+	char* filename;
+	FILE* file;
+
+	// Reads are stamped with this source's clock rather than the wall
+	// clock, if it keeps one (see block_source.h.)
+
+	block_source_st* source;
+
+	__uint64_t records;
+} telemetry_st;
+
+typedef struct telemetry_zone_st {
+	__uint64_t offset; // Device byte offset of the zone
+	__uint64_t reads;
+	__uint64_t failures; // Errors and timeouts
+	double latency; // Total seconds
+	double max_latency;
+} telemetry_zone_st;
+
+typedef struct telemetry_summary_st {
+	__uint64_t zone_size; // Bytes per zone
+	telemetry_zone_st* zone; // Zones read at least once, by offset
+	__uint64_t zone_count;
+
+	__uint64_t records;
+	__uint64_t first_time_us;
+	__uint64_t last_time_us;
+} telemetry_summary_st;
+
+int open_telemetry(telemetry_st* tel, const char* filename);
+
+void close_telemetry(telemetry_st* tel);
+
+void telemetry_record(telemetry_st* tel, off_t offset, size_t length, double seconds, int result, const struct sense_info_t* sense);
+
+int summarize_telemetry(const char* filename, __uint64_t zone_size, telemetry_summary_st* summary, char* error_msg);
+
+void print_telemetry_summary(telemetry_summary_st* summary);
+
+void cleanup_telemetry_summary(telemetry_summary_st* summary);
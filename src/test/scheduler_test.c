@@ -0,0 +1,263 @@
+/*
+Copyright (c) 2018, Eric Adolfson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Runs the scheduler with its default settings against a simulated drive
+// with one bad sector, and checks that it isolates the sector: every other
+// cluster is recovered, and the cluster holding the sector is stored with
+// the rest of its sectors.  Exits nonzero on failure.
+
+#include "dd.h"
+#include "overlay.h"
+#include "recover.h"
+#include "scheduler.h"
+#include "simdev.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CLUSTER_SIZE 4096
+#define NUM_CLUSTERS 1024
+
+// The bad sector is the first one of cluster 100.
+
+#define BAD_CLUSTER 100
+#define BAD_SECTOR_POS 0x64000
+
+static void _fill_cluster(unsigned char* buf, __uint64_t cluster_pos)
+{
+	for (int i = 0; i < CLUSTER_SIZE; i++) {
+		buf[i] = (unsigned char)(cluster_pos * 7 + i);
+	}
+}
+
+static int _write_image(const char* filename)
+{
+	FILE* file = fopen(filename, "wb");
+
+	if (file == NULL) {
+		return 1;
+	}
+
+	unsigned char buf[CLUSTER_SIZE];
+
+	for (__uint64_t c = 0; c < NUM_CLUSTERS; c++) {
+		_fill_cluster(buf, c);
+
+		if (fwrite(buf, CLUSTER_SIZE, 1, file) != 1) {
+			fclose(file);
+
+			return 1;
+		}
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+static void _remove_dir(const char* dir)
+{
+	DIR* d = opendir(dir);
+
+	if (d != NULL) {
+		struct dirent* entry;
+		char path[4096];
+
+		while ((entry = readdir(d)) != NULL) {
+			if (entry->d_name[0] != '.') {
+				snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+				unlink(path);
+			}
+		}
+
+		closedir(d);
+	}
+
+	rmdir(dir);
+}
+
+static int _run(const char* dir)
+{
+	char image[4096];
+	char profile[4096];
+	char overlay[4096];
+
+	snprintf(image, sizeof(image), "%s/image.bin", dir);
+	snprintf(profile, sizeof(profile), "%s/faults.txt", dir);
+	snprintf(overlay, sizeof(overlay), "%s/overlay", dir);
+
+	if (_write_image(image)) {
+		printf("Unable to write %s\n", image);
+
+		return 1;
+	}
+
+	FILE* file = fopen(profile, "w");
+
+	if (file == NULL) {
+		printf("Unable to write %s\n", profile);
+
+		return 1;
+	}
+
+	fprintf(file, "0x%X  0x200  0  1  03/11/00  0\n", BAD_SECTOR_POS);
+	fclose(file);
+
+	sim_device_st sim;
+
+	if (open_sim_device(&sim, image, profile, 0, 1)) {
+		printf("%s", sim.error_msg);
+
+		return 1;
+	}
+
+	dd_ctx dd_struct;
+	dd_ctx* dd = &dd_struct;
+
+	init_dd(dd);
+
+	NTFS_HEADER.bytes_per_sector = 512;
+	NTFS_HEADER.sectors_per_cluster = CLUSTER_SIZE / 512;
+
+	if (open_overlay(dd, overlay)) {
+		printf("%s", dd->error_msg);
+
+		close_sim_device(&sim);
+
+		return 1;
+	}
+
+	scheduler_ctx sched;
+
+	init_scheduler(&sched);
+
+	scheduler_add_range(&sched, 0, NUM_CLUSTERS, 0);
+
+	int failed = 0;
+
+	if (init_recovery_source(dd, &sim.source, sched.range_clusters, -1)) {
+		printf("%s", dd->error_msg);
+
+		failed = 1;
+	} else {
+		// The bad cluster can't be recovered whole.
+
+		int result = run_scheduler(dd, &sched);
+
+		if (result != 1) {
+			printf("run_scheduler() returned %d, expected 1\n", result);
+
+			failed = 1;
+		}
+
+		if (cleanup_recovery(dd)) {
+			printf("%s", dd->error_msg);
+
+			failed = 1;
+		}
+	}
+
+	// Every cluster but the bad one is in the overlay.
+
+	unsigned char expected[CLUSTER_SIZE];
+	unsigned char cluster[CLUSTER_SIZE];
+
+	for (__uint64_t c = 0; c < NUM_CLUSTERS && !failed; c++) {
+		int result = read_cluster_from_overlay(dd, cluster, c);
+
+		_fill_cluster(expected, c);
+
+		if (c == BAD_CLUSTER) {
+			if (result != -1) {
+				printf("Cluster %lu has a bad sector but is in the overlay\n", c);
+
+				failed = 1;
+			}
+		} else if (result != 0 || memcmp(cluster, expected, CLUSTER_SIZE) != 0) {
+			printf("Cluster %lu wasn't recovered\n", c);
+
+			failed = 1;
+		}
+	}
+
+	// The bad cluster is stored with every sector but the bad one, and
+	// given up on.
+
+	if (!failed) {
+		memset(cluster, 0, CLUSTER_SIZE);
+
+		__uint64_t mask = read_partial_cluster(dd, cluster, BAD_CLUSTER);
+
+		_fill_cluster(expected, BAD_CLUSTER);
+
+		if (mask != 0xFE || memcmp(cluster + 512, expected + 512, CLUSTER_SIZE - 512) != 0) {
+			printf("Cluster %d stored with sector mask %lX, expected FE\n", BAD_CLUSTER, mask);
+
+			failed = 1;
+		}
+	}
+
+	for (__uint64_t i = 0; i < sched.region_count && !failed; i++) {
+		sched_region_st* region = &sched.region[i];
+
+		int expected_state = (region->start == BAD_CLUSTER && region->count == 1) ? REGION_FAILED : REGION_DONE;
+
+		if (region->state != expected_state) {
+			printf("Clusters %lu-%lu left in state %d\n", region->start, region->start + region->count - 1, region->state);
+
+			failed = 1;
+		}
+	}
+
+	cleanup_scheduler(&sched);
+
+	close_overlay(dd);
+	close_sim_device(&sim);
+
+	return failed;
+}
+
+int main()
+{
+	char dir[] = "/tmp/scheduler_test_XXXXXX";
+
+	if (mkdtemp(dir) == NULL) {
+		printf("Unable to create a temporary directory\n");
+
+		return 1;
+	}
+
+	int failed = _run(dir);
+
+	_remove_dir(dir);
+
+	printf("scheduler_test: %s\n", failed ? "FAILED" : "passed");
+
+	return failed;
+}